@@ -0,0 +1,383 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/core>
+#include <mozart++/fdstream>
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace mpp_impl {
+    /**
+     * Size of a cache line, indices written by different
+     * threads are kept apart to avoid false sharing.
+     */
+    constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+    inline std::size_t round_up_pow2(std::size_t n) {
+        std::size_t p = 1;
+        while (p < n) {
+            p <<= 1u;
+        }
+        return p;
+    }
+}
+
+namespace mpp {
+    /**
+     * Bounded lock-free queue for exactly one producer thread
+     * and one consumer thread.
+     * @tparam T default constructible and move assignable
+     */
+    template <typename T>
+    class spsc_queue {
+    private:
+        std::unique_ptr<T[]> _slots;
+        std::size_t _mask;
+
+        char _pad0[mpp_impl::CACHE_LINE_SIZE];
+        // written by the consumer
+        std::atomic<std::size_t> _head{0};
+        std::size_t _cached_tail = 0;
+
+        char _pad1[mpp_impl::CACHE_LINE_SIZE];
+        // written by the producer
+        std::atomic<std::size_t> _tail{0};
+        std::size_t _cached_head = 0;
+
+        char _pad2[mpp_impl::CACHE_LINE_SIZE];
+
+    public:
+        /**
+         * @param capacity rounded up to a power of 2
+         */
+        explicit spsc_queue(std::size_t capacity)
+            : _slots(new T[mpp_impl::round_up_pow2(capacity)]),
+              _mask(mpp_impl::round_up_pow2(capacity) - 1) {}
+
+        spsc_queue(const spsc_queue &) = delete;
+
+        spsc_queue &operator=(const spsc_queue &) = delete;
+
+        /**
+         * @return false when full, value is left untouched
+         */
+        bool try_push(T &&value) {
+            std::size_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail - _cached_head > _mask) {
+                _cached_head = _head.load(std::memory_order_acquire);
+                if (tail - _cached_head > _mask) {
+                    return false;
+                }
+            }
+            _slots[tail & _mask] = std::move(value);
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * @return false when empty
+         */
+        bool try_pop(T &value) {
+            std::size_t head = _head.load(std::memory_order_relaxed);
+            if (head == _cached_tail) {
+                _cached_tail = _tail.load(std::memory_order_acquire);
+                if (head == _cached_tail) {
+                    return false;
+                }
+            }
+            value = std::move(_slots[head & _mask]);
+            // let go of what the slot holds right away
+            _slots[head & _mask] = T();
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t capacity() const {
+            return _mask + 1;
+        }
+    };
+
+    /**
+     * Bounded lock-free queue for any number of producers and consumers,
+     * after Dmitry Vyukov's: every slot has a sequence number telling
+     * whose turn it is, so pushing and popping take one CAS each.
+     * Use it as MPSC for many drainers feeding one parser, or the
+     * other way round.
+     * @tparam T default constructible and move assignable
+     */
+    template <typename T>
+    class mpmc_queue {
+    private:
+        struct cell {
+            std::atomic<std::size_t> _sequence;
+            T _value;
+        };
+
+        std::unique_ptr<cell[]> _cells;
+        std::size_t _mask;
+
+        char _pad0[mpp_impl::CACHE_LINE_SIZE];
+        std::atomic<std::size_t> _enqueue{0};
+        char _pad1[mpp_impl::CACHE_LINE_SIZE];
+        std::atomic<std::size_t> _dequeue{0};
+        char _pad2[mpp_impl::CACHE_LINE_SIZE];
+
+    public:
+        /**
+         * @param capacity rounded up to a power of 2
+         */
+        explicit mpmc_queue(std::size_t capacity)
+            : _cells(new cell[mpp_impl::round_up_pow2(capacity)]),
+              _mask(mpp_impl::round_up_pow2(capacity) - 1) {
+            for (std::size_t i = 0; i <= _mask; ++i) {
+                _cells[i]._sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        mpmc_queue(const mpmc_queue &) = delete;
+
+        mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+        /**
+         * @return false when full, value is left untouched
+         */
+        bool try_push(T &&value) {
+            std::size_t pos = _enqueue.load(std::memory_order_relaxed);
+            cell *c;
+            while (true) {
+                c = &_cells[pos & _mask];
+                std::size_t seq = c->_sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+                if (diff == 0) {
+                    if (_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = _enqueue.load(std::memory_order_relaxed);
+                }
+            }
+            c->_value = std::move(value);
+            c->_sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * @return false when empty
+         */
+        bool try_pop(T &value) {
+            std::size_t pos = _dequeue.load(std::memory_order_relaxed);
+            cell *c;
+            while (true) {
+                c = &_cells[pos & _mask];
+                std::size_t seq = c->_sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+                if (diff == 0) {
+                    if (_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = _dequeue.load(std::memory_order_relaxed);
+                }
+            }
+            value = std::move(c->_value);
+            c->_value = T();
+            c->_sequence.store(pos + _mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t capacity() const {
+            return _mask + 1;
+        }
+    };
+
+    class chunk_pool;
+}
+
+namespace mpp_impl {
+    struct chunk_block {
+        std::atomic<std::uint32_t> _refs{0};
+        mpp::chunk_pool *_pool = nullptr;
+        std::size_t _size = 0;
+        std::uint32_t _tag = 0;
+        std::unique_ptr<char[]> _data;
+    };
+}
+
+namespace mpp {
+    /**
+     * Shared handle of a pooled buffer. Copies refer to the same bytes,
+     * the buffer goes back to its pool when the last handle is gone,
+     * from whichever thread that happens.
+     */
+    class chunk_ref {
+        friend class chunk_pool;
+
+    private:
+        mpp_impl::chunk_block *_block = nullptr;
+
+        explicit chunk_ref(mpp_impl::chunk_block *block) : _block(block) {
+            _block->_refs.store(1, std::memory_order_relaxed);
+        }
+
+    public:
+        chunk_ref() = default;
+
+        chunk_ref(const chunk_ref &other) : _block(other._block) {
+            if (_block != nullptr) {
+                _block->_refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        chunk_ref(chunk_ref &&other) noexcept : _block(other._block) {
+            other._block = nullptr;
+        }
+
+        chunk_ref &operator=(const chunk_ref &other) {
+            chunk_ref(other).swap(*this);
+            return *this;
+        }
+
+        chunk_ref &operator=(chunk_ref &&other) noexcept {
+            chunk_ref(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        ~chunk_ref() {
+            reset();
+        }
+
+        void swap(chunk_ref &other) noexcept {
+            std::swap(_block, other._block);
+        }
+
+        /**
+         * Defined below chunk_pool.
+         */
+        inline void reset();
+
+        explicit operator bool() const {
+            return _block != nullptr;
+        }
+
+        char *data() {
+            return _block->_data.get();
+        }
+
+        const char *data() const {
+            return _block->_data.get();
+        }
+
+        /**
+         * Bytes in use, set by the writer before handing the chunk over.
+         */
+        std::size_t size() const {
+            return _block->_size;
+        }
+
+        void resize(std::size_t size) {
+            _block->_size = size;
+        }
+
+        inline std::size_t capacity() const;
+
+        /**
+         * Free for the user, for example which child the bytes came from.
+         */
+        std::uint32_t tag() const {
+            return _block->_tag;
+        }
+
+        void set_tag(std::uint32_t tag) {
+            _block->_tag = tag;
+        }
+    };
+
+    /**
+     * Fixed number of equally sized buffers, allocated up front and
+     * recycled through a lock-free free list. The pool must outlive
+     * every chunk taken from it.
+     */
+    class chunk_pool {
+        friend class chunk_ref;
+
+    private:
+        std::size_t _chunk_size;
+        std::vector<std::unique_ptr<mpp_impl::chunk_block>> _blocks;
+        mpmc_queue<mpp_impl::chunk_block *> _free;
+
+        void recycle(mpp_impl::chunk_block *block) {
+            block->_size = 0;
+            block->_tag = 0;
+            // Every block fits, but a push fails while a concurrent pop
+            // is between taking its cell and releasing it: wait for that
+            // pop to finish instead of losing the block.
+            while (!_free.try_push(std::move(block))) {
+                std::this_thread::yield();
+            }
+        }
+
+    public:
+        explicit chunk_pool(std::size_t chunks, std::size_t chunk_size = 64 * 1024);
+
+        chunk_pool(const chunk_pool &) = delete;
+
+        chunk_pool &operator=(const chunk_pool &) = delete;
+
+        /**
+         * @return an empty chunk_ref when every buffer is in use,
+         *         which is the backpressure of the pool
+         */
+        chunk_ref acquire() {
+            mpp_impl::chunk_block *block = nullptr;
+            if (!_free.try_pop(block)) {
+                return chunk_ref();
+            }
+            return chunk_ref(block);
+        }
+
+        std::size_t chunk_size() const {
+            return _chunk_size;
+        }
+
+        std::size_t chunks() const {
+            return _blocks.size();
+        }
+    };
+
+    inline void chunk_ref::reset() {
+        if (_block != nullptr && _block->_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            _block->_pool->recycle(_block);
+        }
+        _block = nullptr;
+    }
+
+    inline std::size_t chunk_ref::capacity() const {
+        return _block->_pool->_chunk_size;
+    }
+
+    /**
+     * Read what fd has right now, at least one byte, straight into chunk.
+     * @return bytes read and set as the size of chunk, 0 at end of file, -1 on errors
+     */
+    mpp::ssize_t read_chunk(fd_type fd, chunk_ref &chunk);
+
+    /**
+     * The same for process streams, takes what the stream has buffered
+     * or what one read of the underlying descriptor brings in.
+     */
+    mpp::ssize_t read_chunk(std::istream &in, chunk_ref &chunk);
+}
@@ -0,0 +1,141 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/core>
+#include <istream>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mpp_impl {
+    /**
+     * Worst case size of lz_compress() output.
+     */
+    constexpr std::size_t lz_compress_bound(std::size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    /**
+     * A small LZ77 codec in the style of LZ4: byte-aligned sequences of
+     * literals and back references within a 64KiB window, favouring
+     * speed over ratio. Highly repetitive logs still shrink 5-10x.
+     *
+     * @param dst at least lz_compress_bound(size) bytes
+     * @return compressed size
+     */
+    std::size_t lz_compress(const char *src, std::size_t size, char *dst);
+
+    /**
+     * @return decompressed size, or -1 on malformed input or
+     *         when the output doesn't fit in capacity
+     */
+    mpp::ssize_t lz_decompress(const char *src, std::size_t size, char *dst, std::size_t capacity);
+}
+
+namespace mpp {
+    /**
+     * Captured output kept compressed in memory.
+     *
+     * Data is compressed in independent blocks as soon as a block fills up,
+     * so memory stays low while draining, and any block can be read back
+     * without touching the others.
+     */
+    class compressed_capture {
+    private:
+        struct block_info {
+            /**
+             * In _data, which can grow past 4GiB.
+             */
+            std::uint64_t _offset;
+            std::uint32_t _size;
+            std::uint32_t _raw_size;
+            bool _stored;
+        };
+
+        std::size_t _block_size;
+        std::string _pending;
+        std::string _data;
+        std::vector<block_info> _blocks;
+        std::uint64_t _raw_size = 0;
+
+        void seal(const char *data, std::size_t size);
+
+    public:
+        /**
+         * @param block_size unit of compression and random access
+         */
+        explicit compressed_capture(std::size_t block_size = 64 * 1024);
+
+        compressed_capture(compressed_capture &&) = default;
+
+        compressed_capture(const compressed_capture &) = default;
+
+        compressed_capture &operator=(compressed_capture &&) = default;
+
+        compressed_capture &operator=(const compressed_capture &) = default;
+
+        ~compressed_capture() = default;
+
+    public:
+        void append(const char *data, std::size_t size);
+
+        /**
+         * Read the stream until end of file, usually process::out().
+         * @return number of bytes captured
+         */
+        std::size_t drain(std::istream &in);
+
+        /**
+         * Compress the incomplete last block and release spare memory,
+         * call it when the capture is complete.
+         */
+        void finish();
+
+        /**
+         * Blocks in capture order, the last one may be shorter.
+         */
+        std::size_t block_count() const {
+            return _blocks.size() + (_pending.empty() ? 0 : 1);
+        }
+
+        std::size_t block_size() const {
+            return _block_size;
+        }
+
+        /**
+         * Decompress the index-th block into out.
+         */
+        void read_block(std::size_t index, std::string &out) const;
+
+        std::string block(std::size_t index) const {
+            std::string out;
+            read_block(index, out);
+            return out;
+        }
+
+        /**
+         * Decompress everything.
+         */
+        std::string str() const;
+
+        /**
+         * @return size of captured output
+         */
+        std::uint64_t size() const {
+            return _raw_size;
+        }
+
+        /**
+         * @return bytes held in memory for the captured output
+         */
+        std::size_t memory_size() const {
+            return _data.capacity() + _pending.capacity() + _blocks.capacity() * sizeof(block_info);
+        }
+    };
+}
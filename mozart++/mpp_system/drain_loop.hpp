@@ -0,0 +1,190 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <mozart++/chunk_queue>
+#include <chrono>
+#include <functional>
+#include <istream>
+#include <type_traits>
+#include <vector>
+
+namespace mpp_impl {
+    /**
+     * Wait until some of fds can be read without blocking,
+     * or reached end of file.
+     * @param ready resized to fds, nonzero for ready descriptors
+     * @param timeout_ms -1 for no timeout
+     * @return number of ready descriptors, 0 on timeout or interruption
+     */
+    int wait_readable(const std::vector<fd_type> &fds, std::vector<char> &ready, int timeout_ms);
+}
+
+namespace mpp {
+    enum class drain_priority {
+        high, normal, low,
+    };
+
+    struct drain_options {
+        drain_priority _priority = drain_priority::normal;
+
+        /**
+         * Bytes per second taken from the child, stdout and stderr together.
+         * 0 for no limit.
+         */
+        std::uint64_t _rate = 0;
+
+        /**
+         * Most bytes taken at once after a quiet period,
+         * 0 for one second worth of _rate.
+         */
+        std::uint64_t _burst = 0;
+    };
+
+    /**
+     * Drains the outputs of many children from one thread, handing pooled
+     * chunks to a handler, see chunk_queue.
+     *
+     * Every round reads one chunk from every ready stream, high priority
+     * children first; before each read of a lower priority child, ready
+     * high priority ones are serviced again, so their latency stays within
+     * one chunk under floods. A child over its rate is not read at all
+     * until its bucket refills: the pipe fills up and the child blocks in
+     * write(), nothing is buffered on our side.
+     *
+     * Descriptors are read directly, do not read out() or err() of
+     * a process in the loop, and keep it alive while the loop runs.
+     */
+    class drain_loop {
+    public:
+        /**
+         * An empty chunk marks the end of a stream.
+         * @param child id returned by add()
+         * @param stream 1 for stdout, 2 for stderr
+         */
+        using output_handler = std::function<void(std::size_t child, int stream, chunk_ref chunk)>;
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        /**
+         * Reads of a throttled child resume with at least this many
+         * tokens, unless its burst is smaller.
+         */
+        static constexpr double MIN_READ = 4096;
+
+        struct child_state {
+            drain_priority _priority;
+            double _rate;
+            double _burst;
+            double _tokens;
+            clock::time_point _refilled;
+        };
+
+        struct source {
+            fd_type _fd;
+            std::size_t _child;
+            int _stream;
+            bool _open;
+        };
+
+        chunk_pool &_pool;
+        output_handler _handler;
+        std::vector<child_state> _children;
+        std::vector<source> _sources;
+        std::size_t _open = 0;
+        bool _starved = false;
+
+        /**
+         * Sources being waited for, kept to avoid allocations.
+         */
+        struct wait_set {
+            std::vector<std::size_t> _sources;
+            std::vector<fd_type> _fds;
+            std::vector<char> _ready;
+        };
+
+        wait_set _round;
+        wait_set _high;
+
+        bool eligible(const source &s) const;
+
+        /**
+         * @return false when the pool has no chunk left
+         */
+        bool service(source &s);
+
+        void service_high();
+
+        static bool buffered(std::istream &stream) {
+            return stream.rdbuf()->in_avail() > 0;
+        }
+
+        /**
+         * Streams compiled out of basic_process.
+         */
+        template <typename Stream>
+        static typename std::enable_if<!std::is_base_of<std::istream, Stream>::value, bool>::type
+        buffered(Stream &) {
+            return false;
+        }
+
+    public:
+        drain_loop(chunk_pool &pool, output_handler handler)
+            : _pool(pool), _handler(std::move(handler)) {}
+
+        drain_loop(const drain_loop &) = delete;
+
+        drain_loop &operator=(const drain_loop &) = delete;
+
+        /**
+         * Drain the given descriptors, either may be FD_INVALID.
+         * @return id of the child
+         */
+        std::size_t add(fd_type out, fd_type err, const drain_options &options = drain_options());
+
+        /**
+         * Drain the pipes of a process, streams that are
+         * not pipes to us are left alone. Throws for a process with
+         * a line filter or a stdio recording, or with output already
+         * buffered by out() or err(): reading the pipes directly would
+         * bypass or lose them.
+         */
+        template <typename In, typename Out, typename Err>
+        std::size_t add(basic_process<In, Out, Err> &p, const drain_options &options = drain_options()) {
+            const auto &info = p._this->_info;
+            if (info._stdout_filter || info._stderr_filter || info._recorder) {
+                mpp::throw_ex<mpp::runtime_error>("drain_loop: process output is filtered or recorded");
+            }
+            if (buffered(p._this->_stdout) || buffered(p._this->_stderr)) {
+                mpp::throw_ex<mpp::runtime_error>("drain_loop: process output was already read from");
+            }
+            return add(info._stdout, info._stderr, options);
+        }
+
+        /**
+         * Wait for output at most timeout and service one round.
+         * @param timeout negative for no timeout
+         * @return false when every stream has ended
+         */
+        bool run_once(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+
+        /**
+         * Until every stream has ended.
+         */
+        void run() {
+            while (run_once()) {
+            }
+        }
+
+        std::size_t open_streams() const {
+            return _open;
+        }
+    };
+}
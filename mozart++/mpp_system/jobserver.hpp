@@ -0,0 +1,181 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace mpp_impl {
+    /**
+     * Find the jobserver in MAKEFLAGS, the last one wins like in make.
+     * @param auth "R,W" or "fifo:PATH"
+     * @param slots from -jN, 0 when not given
+     * @return false when there is none
+     */
+    bool parse_makeflags(const std::string &makeflags, std::string &auth, std::size_t &slots);
+}
+
+namespace mpp {
+    /**
+     * A slot taken from a jobserver, given back when destroyed.
+     */
+    class jobserver_token {
+        friend class jobserver;
+
+    private:
+        std::shared_ptr<jobserver> _server;
+        char _byte = 0;
+        bool _implicit = false;
+
+        jobserver_token(std::shared_ptr<jobserver> server, char byte, bool implicit)
+            : _server(std::move(server)), _byte(byte), _implicit(implicit) {}
+
+    public:
+        jobserver_token() = default;
+
+        jobserver_token(const jobserver_token &) = delete;
+
+        jobserver_token &operator=(const jobserver_token &) = delete;
+
+        jobserver_token(jobserver_token &&other) noexcept;
+
+        jobserver_token &operator=(jobserver_token &&other) noexcept;
+
+        ~jobserver_token() {
+            release();
+        }
+
+        void release();
+
+        explicit operator bool() const {
+            return _server != nullptr;
+        }
+    };
+
+    /**
+     * The jobserver of GNU make: a pipe holding one byte per free slot,
+     * shared by a whole process tree to respect one budget of parallel
+     * jobs. make, ninja and compilers parallelizing on their own find it
+     * in MAKEFLAGS, see process_builder::use_jobserver().
+     *
+     * Like in make, whoever holds the jobserver owns one implicit slot
+     * that is not in the pipe, so a jobserver of N slots holds N - 1 bytes.
+     */
+    class jobserver : public std::enable_shared_from_this<jobserver> {
+        friend class jobserver_token;
+
+    public:
+        enum class style {
+            /**
+             * Descriptors inherited by children, understood by every make.
+             */
+            pipe,
+            /**
+             * A named pipe in a temporary directory, GNU make 4.4 and later.
+             */
+            fifo,
+        };
+
+    private:
+        /**
+         * As passed to children.
+         */
+        fd_type _read = FD_INVALID;
+        fd_type _write = FD_INVALID;
+
+        /**
+         * Non-blocking description of the read side, children
+         * keep reading from a blocking one.
+         */
+        fd_type _reader = FD_INVALID;
+
+        /**
+         * Written when the implicit slot is given back,
+         * so waiters in acquire() look at it again.
+         */
+        fd_type _wake[2] = {FD_INVALID, FD_INVALID};
+
+        std::string _fifo;
+        bool _owned = false;
+        std::size_t _slots = 0;
+        std::atomic<bool> _implicit_free{true};
+
+        jobserver() = default;
+
+        void open_wake();
+
+        void wake();
+
+        void drain_wake();
+
+        /**
+         * @return 1 with a byte, 0 on timeout, 2 when woken up, -1 on errors
+         */
+        int read_token(char &byte, int timeout_ms);
+
+        void write_token(char byte);
+
+    public:
+        ~jobserver();
+
+        jobserver(const jobserver &) = delete;
+
+        jobserver &operator=(const jobserver &) = delete;
+
+        /**
+         * Become the jobserver of a new tree of slots jobs.
+         */
+        static std::shared_ptr<jobserver> create(std::size_t slots, style s = style::pipe);
+
+        /**
+         * Join the jobserver of the make running us, found in MAKEFLAGS.
+         * Only works when make passed its descriptors to us, which it does
+         * for recipes marked with '+' or using $(MAKE).
+         * @return nullptr when there is none
+         */
+        static std::shared_ptr<jobserver> from_environment();
+
+        /**
+         * Take a slot, the implicit one first.
+         * @param timeout negative for no timeout
+         * @return an empty token on timeout
+         */
+        jobserver_token acquire(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+
+        /**
+         * 0 when joined from a MAKEFLAGS without -jN.
+         */
+        std::size_t slots() const {
+            return _slots;
+        }
+
+        /**
+         * Flags passed to children in MAKEFLAGS.
+         */
+        std::string makeflags() const;
+
+        /**
+         * Descriptors children inherit, FD_INVALID for style::fifo.
+         */
+        fd_type read_fd() const {
+            return _fifo.empty() ? _read : FD_INVALID;
+        }
+
+        fd_type write_fd() const {
+            return _fifo.empty() ? _write : FD_INVALID;
+        }
+    };
+
+    inline process_builder &process_builder::use_jobserver(std::shared_ptr<jobserver> server) {
+        _startup._jobserver = std::move(server);
+        return *this;
+    }
+}
@@ -0,0 +1,107 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace mpp_impl {
+    /**
+     * Find the first occurrence of needle in haystack, using SSE2 to
+     * test 16 candidate positions at once when available.
+     * @return position, or size when not found
+     */
+    std::size_t find_literal(const char *haystack, std::size_t size,
+                             const char *needle, std::size_t needle_size);
+}
+
+namespace mpp {
+    /**
+     * Selects lines of child output at drain time,
+     * see process_builder::filter_stdout().
+     *
+     * Lines are matched without their trailing newline, which is kept
+     * in the output. Substring sets are matched over the whole buffer
+     * with a SIMD prefilter, so lines without any candidate are skipped
+     * without looking at them one by one.
+     */
+    class line_filter {
+    private:
+        enum class kind {
+            contains, prefix, regex,
+        };
+
+        kind _kind;
+        std::vector<std::string> _literals;
+        std::shared_ptr<const std::regex> _regex;
+        bool _discard = false;
+
+        line_filter(kind k, std::vector<std::string> literals)
+            : _kind(k), _literals(std::move(literals)) {}
+
+        std::size_t filter_contains(const char *data, std::size_t size, std::string &out) const;
+
+    public:
+        /**
+         * Lines containing any of the literals.
+         */
+        static line_filter contains(std::vector<std::string> literals) {
+            return line_filter(kind::contains, std::move(literals));
+        }
+
+        /**
+         * Lines starting with any of the prefixes.
+         */
+        static line_filter prefix(std::vector<std::string> prefixes) {
+            return line_filter(kind::prefix, std::move(prefixes));
+        }
+
+        /**
+         * Lines in which the ECMAScript regular expression matches.
+         */
+        static line_filter regex(const std::string &pattern) {
+            line_filter f(kind::regex, {});
+            f._regex = std::make_shared<const std::regex>(pattern, std::regex::optimize);
+            return f;
+        }
+
+        /**
+         * Drop matching lines instead of retaining them.
+         */
+        line_filter &discard(bool r = true) {
+            _discard = r;
+            return *this;
+        }
+
+    public:
+        /**
+         * Whether the line (without newline) is selected.
+         */
+        bool match(const char *line, std::size_t size) const;
+
+        /**
+         * Append the selected lines of a buffer to out.
+         * A last line without newline is treated as a complete line.
+         * @return number of lines selected
+         */
+        std::size_t apply(const char *data, std::size_t size, std::string &out) const;
+    };
+
+    inline process_builder &process_builder::filter_stdout(line_filter filter) {
+        _startup._stdout_filter = std::make_shared<const line_filter>(std::move(filter));
+        return *this;
+    }
+
+    inline process_builder &process_builder::filter_stderr(line_filter filter) {
+        _startup._stderr_filter = std::make_shared<const line_filter>(std::move(filter));
+        return *this;
+    }
+}
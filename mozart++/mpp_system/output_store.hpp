@@ -0,0 +1,210 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/core>
+#include <cstdint>
+#include <cstdio>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mpp {
+    /**
+     * A line of retained output containing what was searched for.
+     */
+    struct output_match {
+        std::string _key;
+        int _stream = 1;
+
+        /**
+         * Offset of the line in the output of the job.
+         */
+        std::uint64_t _offset = 0;
+        std::string _line;
+    };
+
+    /**
+     * Outputs of finished jobs kept for search, in a directory of
+     * append-only segments, each with an index of the trigrams
+     * (3 byte sequences) every output contains.
+     *
+     * A search only reads the outputs containing every trigram of what
+     * is searched for, so it takes milliseconds over millions of jobs
+     * instead of a full scan. Trigrams are collected while output is
+     * appended, on the drain path, and outputs are written whole when
+     * finished. Until then, a writer keeps up to 1MiB in memory and
+     * spools the rest to a temporary file.
+     *
+     * Files of a segment:
+     *      seg-N.data   "MPPO", u8 version, then per output: varint key size, key,
+     *                   u8 stream, varint size, output
+     *      seg-N.index  "MPPX", u8 version, varint output count, per output: varint
+     *                   offset and size of the output in seg-N.data,
+     *                   varint key size, key, u8 stream; then varint
+     *                   trigram count, per trigram in ascending order:
+     *                   varint trigram delta, varint size of its posting
+     *                   list, outputs containing it as varint deltas
+     *
+     * The index of a segment is written when the segment is full or the
+     * store is destroyed. A segment without index, left by a crash,
+     * is indexed again when the store is opened.
+     *
+     * Thread-safe, writers may be used from different threads.
+     */
+    class output_store {
+    public:
+        /**
+         * Output of one job being appended, stored when finished.
+         */
+        class writer {
+            friend class output_store;
+
+        private:
+            output_store *_store = nullptr;
+            std::string _key;
+            int _stream = 1;
+
+            /**
+             * Output not spooled yet, and where larger outputs go
+             * until finish(), so memory stays bounded per writer.
+             */
+            std::string _data;
+            std::FILE *_spool = nullptr;
+            std::uint64_t _size = 0;
+
+            /**
+             * Last 2 bytes appended, trigrams may start in them.
+             */
+            std::string _carry;
+            std::vector<std::uint32_t> _trigrams;
+
+            void spool();
+
+            writer(output_store *store, std::string key, int stream)
+                : _store(store), _key(std::move(key)), _stream(stream) {}
+
+        public:
+            writer(writer &&other) noexcept;
+
+            writer &operator=(writer &&other) = delete;
+
+            writer(const writer &) = delete;
+
+            writer &operator=(const writer &) = delete;
+
+            /**
+             * Finishes, errors are dropped, call finish() to see them.
+             */
+            ~writer();
+
+            void append(const char *data, std::size_t size);
+
+            /**
+             * Read the stream until end of file, usually process::out().
+             * @return number of bytes appended
+             */
+            std::size_t drain(std::istream &in);
+
+            /**
+             * Store the output, nothing can be appended afterwards.
+             */
+            void finish();
+        };
+
+    private:
+        struct output_info {
+            std::uint64_t _offset;
+            std::uint64_t _size;
+            std::string _key;
+            int _stream;
+        };
+
+        struct segment {
+            std::string _data_path;
+            std::vector<output_info> _outputs;
+
+            /**
+             * Sealed segments: trigrams in ascending order, where their
+             * posting lists start in _postings, and one more for the end.
+             */
+            std::vector<std::uint32_t> _trigrams;
+            std::vector<std::uint32_t> _starts;
+            std::string _postings;
+
+            /**
+             * The active segment: outputs containing each trigram.
+             */
+            std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> _active;
+            std::uint64_t _size = 0;
+        };
+
+        std::string _dir;
+        std::uint64_t _segment_size;
+        std::vector<segment> _segments;
+        std::FILE *_out = nullptr;
+        std::uint64_t _output_count = 0;
+        mutable std::mutex _lock;
+
+        std::string segment_path(std::size_t index, const char *suffix) const;
+
+        void load(std::size_t index);
+
+        void start_segment();
+
+        void seal_active();
+
+        void store(writer &w);
+
+        /**
+         * Outputs of the segment containing every trigram, ascending.
+         */
+        std::vector<std::uint32_t> candidates(const segment &s, const std::vector<std::uint32_t> &trigrams) const;
+
+    public:
+        /**
+         * Open the store in dir, which must exist.
+         * @param segment_size a segment is sealed once it is that large,
+         *                     below 2GiB
+         */
+        explicit output_store(const std::string &dir, std::uint64_t segment_size = 64 * 1024 * 1024);
+
+        ~output_store();
+
+        output_store(const output_store &) = delete;
+
+        output_store &operator=(const output_store &) = delete;
+
+        /**
+         * Start retaining an output.
+         * @param key identifies the job, need not be unique
+         * @param stream 1 for stdout, 2 for stderr
+         */
+        writer open(const std::string &key, int stream = 1) {
+            return writer(this, key, stream);
+        }
+
+        /**
+         * Lines containing needle, as is, in the order outputs were stored.
+         * @param limit most lines returned
+         */
+        std::vector<output_match> search(const std::string &needle, std::size_t limit = 100) const;
+
+        /**
+         * Write the index of the active segment and start another one.
+         */
+        void seal();
+
+        std::size_t segment_count() const;
+
+        std::uint64_t output_count() const;
+    };
+}
@@ -0,0 +1,162 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mpp {
+    enum class pressure_resource {
+        cpu, memory, io,
+    };
+
+    enum class shed_action {
+        suspend, terminate,
+    };
+
+    /**
+     * Sheds processes started with process_builder::low_priority()
+     * when tasks stall on a resource for too long.
+     *
+     * Linux PSI triggers are registered on /proc/pressure/<resource>
+     * and polled by a background thread, so shedding happens within
+     * milliseconds after the kernel notices the stall.
+     * Only available on Linux 5.2+, start() throws elsewhere.
+     * Settings other than watch() can be changed while the monitor
+     * runs, they apply from the next stall.
+     */
+    class pressure_monitor {
+    public:
+        /**
+         * Called from the monitor thread after shedding,
+         * with the number of processes affected.
+         */
+        using shed_callback = std::function<void(pressure_resource, std::size_t)>;
+
+    private:
+        struct trigger {
+            pressure_resource _resource;
+            std::uint64_t _stall_us;
+            std::uint64_t _window_us;
+            int _fd = -1;
+        };
+
+        /**
+         * May change while the monitor thread runs, guarded by _lock.
+         */
+        struct settings {
+            shed_action _action = shed_action::suspend;
+            bool _force = false;
+            std::chrono::milliseconds _resume_after{0};
+            shed_callback _callback;
+        };
+
+        std::vector<trigger> _triggers;
+        mutable std::mutex _lock;
+        settings _settings;
+
+        std::thread _thread;
+        int _wakeup[2] = {-1, -1};
+
+        settings current() const {
+            std::lock_guard<std::mutex> guard(_lock);
+            return _settings;
+        }
+
+        void run();
+
+        void close_triggers();
+
+    public:
+        pressure_monitor() = default;
+
+        ~pressure_monitor() {
+            stop();
+        }
+
+        pressure_monitor(const pressure_monitor &) = delete;
+
+        pressure_monitor &operator=(const pressure_monitor &) = delete;
+
+    public:
+        /**
+         * Shed when some tasks stalled on the resource for more than
+         * stall within any window. The kernel accepts windows from
+         * 500ms to 10s, unprivileged users need multiples of 2s.
+         * Triggers are registered by start(), throws when running.
+         */
+        pressure_monitor &watch(pressure_resource resource,
+                                std::chrono::microseconds stall,
+                                std::chrono::microseconds window = std::chrono::seconds(2)) {
+            if (running()) {
+                mpp::throw_ex<mpp::runtime_error>("pressure triggers can't be added to a running monitor");
+            }
+            _triggers.push_back(trigger{resource,
+                                        static_cast<std::uint64_t>(stall.count()),
+                                        static_cast<std::uint64_t>(window.count())});
+            return *this;
+        }
+
+        /**
+         * @param force use SIGKILL instead of SIGTERM when terminating
+         */
+        pressure_monitor &action(shed_action action, bool force = false) {
+            std::lock_guard<std::mutex> guard(_lock);
+            _settings._action = action;
+            _settings._force = force;
+            return *this;
+        }
+
+        /**
+         * Resume the processes the monitor suspended after no stall has
+         * been reported for the given time, 0 (default) leaves resuming
+         * to users. Processes suspended or resumed by other means since
+         * are left alone.
+         */
+        pressure_monitor &resume_after(std::chrono::milliseconds quiet) {
+            std::lock_guard<std::mutex> guard(_lock);
+            _settings._resume_after = quiet;
+            return *this;
+        }
+
+        pressure_monitor &on_shed(shed_callback callback) {
+            std::lock_guard<std::mutex> guard(_lock);
+            _settings._callback = std::move(callback);
+            return *this;
+        }
+
+        /**
+         * Register triggers and start the monitor thread.
+         */
+        void start();
+
+        void stop();
+
+        bool running() const {
+            return _thread.joinable();
+        }
+
+        /**
+         * Apply the shed action immediately, as if the resource stalled.
+         * @return number of processes affected
+         */
+        std::size_t shed(pressure_resource resource);
+
+        /**
+         * Report a stall seen by other means, for example by a userspace
+         * monitor. A running monitor handles it on its thread like an
+         * event of its triggers, resuming later included; otherwise it
+         * sheds immediately.
+         */
+        void report_stall(pressure_resource resource);
+    };
+}
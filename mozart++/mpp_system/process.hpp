@@ -15,6 +15,37 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <type_traits>
+#include <cstdint>
+#include <limits>
+#include <atomic>
+#include <chrono>
+
+// MOZART_PROCESS_PMR changes the layout of process_startup, so it is
+// fixed when the library is built and passed on to its users, never
+// guessed per translation unit, see CMakeLists.txt.
+#ifdef MOZART_PROCESS_PMR
+#if __cplusplus < 201703L
+#error "MOZART_PROCESS_PMR requires C++17"
+#endif
+#include <memory_resource>
+#endif
+
+namespace mpp {
+    class line_filter;
+
+    class startup_record;
+
+    class stdio_recorder;
+
+    class drain_loop;
+
+    class sealed_input;
+
+    class jobserver;
+
+    class jobserver_token;
+}
 
 namespace mpp_impl {
     using mpp::fd_type;
@@ -33,14 +64,172 @@ namespace mpp_impl {
         }
     };
 
+    /**
+     * Containers of process_startup, allocator-aware when the library
+     * is built with MOZART_PROCESS_PMR, so that startups can be built
+     * from a memory arena and released in one shot.
+     */
+#ifdef MOZART_PROCESS_PMR
+    using startup_string = std::pmr::string;
+    using startup_cmdline = std::pmr::vector<startup_string>;
+    using startup_env = std::pmr::unordered_map<startup_string, startup_string>;
+#else
+    using startup_string = std::string;
+    using startup_cmdline = std::vector<startup_string>;
+    using startup_env = std::unordered_map<startup_string, startup_string>;
+#endif
+
+    /**
+     * What happens to a child whose handle is destroyed before it was waited.
+     */
+    enum class destroy_policy {
+        /**
+         * Leave it running, the shared reaper reaps it once it exits.
+         * A suspended child is resumed first.
+         */
+        reap,
+        /**
+         * Kill it, the shared reaper reaps it.
+         */
+        kill_and_reap,
+        /**
+         * Leave it running and never reap it, for callers reaping
+         * by their own means. It stays a zombie until they do.
+         */
+        abandon,
+    };
+
+    /**
+     * nullptr-terminated argv and envp, ready to be passed to exec.
+     * Strings are referenced, not copied: they point into storage
+     * owned by the image, or into the buffer the image was built from.
+     */
+    struct exec_image {
+        /**
+         * Always has one more slot after the terminating nullptr,
+         * exec of scripts without shebang needs it.
+         */
+        std::vector<const char *> _argv;
+        std::vector<const char *> _envp;
+        std::string _storage;
+    };
+
     struct process_startup {
-        std::vector<std::string> _cmdline;
-        std::unordered_map<std::string, std::string> _env;
-        std::string _cwd = ".";
+        startup_cmdline _cmdline;
+        startup_env _env;
+        startup_string _cwd;
         redirect_info _stdin;
         redirect_info _stdout;
         redirect_info _stderr;
         bool merge_outputs = false;
+
+        /**
+         * Start the child as leader of a new process group.
+         */
+        bool _new_process_group = false;
+
+        /**
+         * cgroup v2 directory the child joins before exec, empty for none.
+         */
+        startup_string _cgroup;
+
+        /**
+         * Job class for batch operations, empty for none.
+         */
+        startup_string _job_class;
+
+        /**
+         * Whether the process may be shed under load, see pressure_monitor.
+         */
+        bool _low_priority = false;
+
+        /**
+         * Pass a readiness notification channel to the child.
+         */
+        bool _notify_ready = false;
+
+        /**
+         * Capture delay accounting and I/O counters when the child exits.
+         */
+        bool _exit_accounting = false;
+
+        destroy_policy _destroy_policy = destroy_policy::reap;
+
+        /**
+         * Directory receiving the outputs and the exit status
+         * of a detached child, empty when attached.
+         */
+        startup_string _detach_dir;
+
+        /**
+         * File receiving the stdio recording, empty for none.
+         */
+        startup_string _stdio_record;
+
+        /**
+         * Lines of output to select at drain time, see line_filter.
+         */
+        std::shared_ptr<const mpp::line_filter> _stdout_filter;
+        std::shared_ptr<const mpp::line_filter> _stderr_filter;
+
+        /**
+         * Read-only data every child reads on its own, see sealed_input.
+         * Passed as stdin, or as an extra descriptor.
+         */
+        std::shared_ptr<const mpp::sealed_input> _shared_input;
+        bool _shared_input_stdin = true;
+
+        /**
+         * Slots the child is counted against and cooperates with, see jobserver.
+         */
+        std::shared_ptr<mpp::jobserver> _jobserver;
+
+        /**
+         * Prebuilt argv and envp, see startup_record.
+         * When set, it takes the place of _cmdline and _env.
+         */
+        std::shared_ptr<const exec_image> _image;
+
+        process_startup() : _cwd(".") {}
+
+#ifdef MOZART_PROCESS_PMR
+
+        explicit process_startup(std::pmr::memory_resource *resource)
+            : _cmdline(resource), _env(resource), _cwd(".", resource),
+              _cgroup(resource), _job_class(resource), _detach_dir(resource),
+              _stdio_record(resource) {}
+
+#endif
+    };
+
+    class process_backend;
+
+    /**
+     * An atomic that can be copied along with the struct holding it,
+     * copies are not atomic with respect to each other.
+     */
+    template <typename T>
+    struct copyable_atomic : public std::atomic<T> {
+        copyable_atomic(T value = T()) : std::atomic<T>(value) {}
+
+        copyable_atomic(const copyable_atomic &other) : std::atomic<T>(other.load()) {}
+
+        copyable_atomic &operator=(const copyable_atomic &other) {
+            this->store(other.load());
+            return *this;
+        }
+
+        using std::atomic<T>::operator=;
+    };
+
+    /**
+     * How a standard stream of the child was bound.
+     */
+    enum class stdio_kind : std::uint8_t {
+        pipe,
+        file,
+        null,
+        inherit,
     };
 
     struct process_info {
@@ -53,23 +242,619 @@ namespace mpp_impl {
         fd_type _stdin = FD_INVALID;
         fd_type _stdout = FD_INVALID;
         fd_type _stderr = FD_INVALID;
+
+        /**
+         * Read end of the readiness notification channel.
+         */
+        fd_type _notify = FD_INVALID;
+
+        /**
+         * How stdin, stdout and stderr were bound. Merged stderr
+         * is bound like stdout.
+         */
+        stdio_kind _stdio_kinds[3] = {stdio_kind::pipe, stdio_kind::pipe, stdio_kind::pipe};
+
+        /**
+         * Startup settings still needed when the process is running.
+         */
+        bool _group_leader = false;
+        std::string _cgroup;
+        std::string _job_class;
+        bool _low_priority = false;
+        bool _exit_accounting = false;
+        destroy_policy _destroy_policy = destroy_policy::reap;
+
+        /**
+         * Set once the child has been reaped, its pid may belong
+         * to another process from then on. Read by job control from
+         * other threads, jobs are reaped under the job registry lock.
+         */
+        copyable_atomic<bool> _reaped{false};
+
+        /**
+         * A detached child is not ours to wait, its keeper process waits
+         * it and writes the exit status to a file in _detach_dir.
+         */
+        std::string _detach_dir;
+        long _keeper_pid = 0;
+
+        /**
+         * pidfd of the keeper, FD_INVALID when unsupported.
+         */
+        fd_type _keeper = FD_INVALID;
+
+        /**
+         * pidfd of the child, opened by exit_fd() when first asked for.
+         */
+        fd_type _exit_fd = FD_INVALID;
+
+        /**
+         * Backend that created the process, nullptr for real processes.
+         */
+        process_backend *_backend = nullptr;
+
+        std::shared_ptr<const mpp::line_filter> _stdout_filter;
+        std::shared_ptr<const mpp::line_filter> _stderr_filter;
+
+        /**
+         * Where the streams are recorded, see process_builder::record_stdio().
+         */
+        std::shared_ptr<mpp::stdio_recorder> _recorder;
+
+        /**
+         * Slot held while the child runs, see process_builder::use_jobserver().
+         * Handed to the background reaper with the child when the handle
+         * is destroyed first.
+         */
+        std::shared_ptr<mpp::jobserver_token> _job_token;
     };
 
+    /**
+     * Descriptors prepared for one standard stream of the child.
+     */
+    struct stdio_binding {
+        /**
+         * Installed as the standard stream in the child.
+         */
+        fd_type _child = FD_INVALID;
+
+        /**
+         * The other end of the pipe, kept by the parent.
+         */
+        fd_type _parent = FD_INVALID;
+
+        /**
+         * Whether _child was opened by us and should be closed
+         * by the parent once the child has started.
+         */
+        bool _owned = false;
+    };
+
+    /**
+     * Stdio policies, deciding how a standard stream of the child is bound.
+     * Only pipe policies give the parent a stream to read or write,
+     * streams of other policies are compiled out of basic_process.
+     */
+    template <bool HasStream>
+    struct stdio_policy {
+        static constexpr bool has_stream = HasStream;
+    };
+
+    /**
+     * A pipe unless a redirect target is given to process_builder,
+     * decided at runtime.
+     */
+    struct stdio_dynamic : public stdio_policy<true> {
+    };
+
+    /**
+     * Always a pipe to the parent.
+     */
+    struct stdio_pipe : public stdio_policy<true> {
+    };
+
+    /**
+     * Bound to the null device.
+     */
+    struct stdio_null : public stdio_policy<false> {
+    };
+
+    /**
+     * Shares the standard stream of the parent.
+     */
+    struct stdio_inherit : public stdio_policy<false> {
+    };
+
+    /**
+     * Bound to the redirect target given to process_builder.
+     */
+    struct stdio_file : public stdio_policy<false> {
+    };
+
+    /**
+     * @param stream 0 for stdin, 1 for stdout, 2 for stderr
+     */
+    bool bind_pipe(stdio_binding &b, int stream);
+
+    bool bind_null(stdio_binding &b, int stream);
+
+    bool bind_inherit(stdio_binding &b, int stream);
+
+    bool bind_file(const redirect_info &r, stdio_binding &b);
+
+    /**
+     * A read-only descriptor of the data with a file offset of its own.
+     */
+    bool bind_shared_input(const mpp::sealed_input &input, stdio_binding &b);
+
+    /**
+     * Close everything opened by bind_*(), used in rollback.
+     * Note: user provided redirect targets are never closed.
+     */
+    void release_stdio(stdio_binding &b);
+
+    inline bool bind_stdio(stdio_dynamic, const redirect_info &r, stdio_binding &b, int stream) {
+        return r.redirected() ? bind_file(r, b) : bind_pipe(b, stream);
+    }
+
+    inline bool bind_stdio(stdio_pipe, const redirect_info &, stdio_binding &b, int stream) {
+        return bind_pipe(b, stream);
+    }
+
+    inline bool bind_stdio(stdio_null, const redirect_info &, stdio_binding &b, int stream) {
+        return bind_null(b, stream);
+    }
+
+    inline bool bind_stdio(stdio_inherit, const redirect_info &, stdio_binding &b, int stream) {
+        return bind_inherit(b, stream);
+    }
+
+    inline bool bind_stdio(stdio_file, const redirect_info &r, stdio_binding &b, int) {
+        return bind_file(r, b);
+    }
+
+    inline stdio_kind stdio_kind_of(stdio_dynamic, const redirect_info &r) {
+        return r.redirected() ? stdio_kind::file : stdio_kind::pipe;
+    }
+
+    inline stdio_kind stdio_kind_of(stdio_pipe, const redirect_info &) {
+        return stdio_kind::pipe;
+    }
+
+    inline stdio_kind stdio_kind_of(stdio_null, const redirect_info &) {
+        return stdio_kind::null;
+    }
+
+    inline stdio_kind stdio_kind_of(stdio_inherit, const redirect_info &) {
+        return stdio_kind::inherit;
+    }
+
+    inline stdio_kind stdio_kind_of(stdio_file, const redirect_info &) {
+        return stdio_kind::file;
+    }
+
+    /**
+     * Build argv and envp of a startup, or take the prebuilt ones.
+     * The image references strings of the startup.
+     */
+    void build_exec_image(const process_startup &startup, exec_image &image);
+
+    /**
+     * @param stdio bindings of stdin, stdout and stderr,
+     *              stderr is unused when merge_outputs is set.
+     */
     void create_process_impl(const process_startup &startup,
                              process_info &info,
-                             fd_type *pstdin, fd_type *pstdout, fd_type *pstderr);
+                             stdio_binding *stdio);
+
+    /**
+     * stdin of a detached child is the null device, outputs go to files
+     * in its directory, the parent ends are opened for reading them.
+     */
+    void bind_detached(const process_startup &startup, stdio_binding *stdio);
+
+    template <typename In, typename Out, typename Err>
+    void bind_stdio(const process_startup &startup, stdio_binding *stdio) {
+        bool shared = startup._shared_input && startup._shared_input_stdin;
+        if (!(shared ? bind_shared_input(*startup._shared_input, stdio[0])
+                     : bind_stdio(In{}, startup._stdin, stdio[0], 0))) {
+            mpp::throw_ex<mpp::runtime_error>("unable to bind stdin");
+        }
+
+        if (!bind_stdio(Out{}, startup._stdout, stdio[1], 1)) {
+            release_stdio(stdio[0]);
+            mpp::throw_ex<mpp::runtime_error>("unable to bind stdout");
+        }
+
+        if (!startup.merge_outputs) {
+            // if the user doesn't redirect stderr to stdout,
+            // we bind stderr to a new file descriptor
+            if (!bind_stdio(Err{}, startup._stderr, stdio[2], 2)) {
+                release_stdio(stdio[0]);
+                release_stdio(stdio[1]);
+                mpp::throw_ex<mpp::runtime_error>("unable to bind stderr");
+            }
+        }
+    }
+
+    /**
+     * Replaces real processes, for benchmarking and testing code built on
+     * process_builder without forking. Processes remember their backend,
+     * calls on them go to it even after it is uninstalled.
+     */
+    class process_backend {
+    public:
+        virtual ~process_backend() = default;
+
+        /**
+         * Start a process, set info._pid to an id unique in this backend.
+         * Throws like process_builder::start().
+         */
+        virtual void create(const process_startup &startup, process_info &info) = 0;
+
+        /**
+         * The handle is gone, forget the process.
+         */
+        virtual void close(process_info &info) = 0;
 
-    bool redirect_or_pipe(const redirect_info &r, fd_type fds[2]);
+        virtual int wait_for(const process_info &info) = 0;
 
-    void create_process(const process_startup &startup, process_info &info);
+        virtual void terminate(const process_info &info, bool force) = 0;
+
+        virtual bool exited(const process_info &info) = 0;
+
+        virtual bool suspend(const process_info &) {
+            return false;
+        }
+
+        virtual bool resume(const process_info &) {
+            return false;
+        }
+
+        /**
+         * Output of the process read through process::out() or err().
+         * @param stream 1 for stdout, 2 for stderr
+         * @return nullptr for no output
+         */
+        virtual std::unique_ptr<std::streambuf> output(const process_info &, int) {
+            return nullptr;
+        }
+    };
+
+    /**
+     * Processes are started by the installed backend, nullptr for real ones.
+     */
+    void set_process_backend(process_backend *backend);
+
+    process_backend *get_process_backend();
+
+    /**
+     * Defined in src/stdio_replay.cpp, throws when path cannot be created.
+     */
+    std::shared_ptr<mpp::stdio_recorder> open_stdio_recorder(const std::string &path);
+
+    /**
+     * A stream buffer passing data through inner and recording it,
+     * writes for stream 0 (stdin) and reads for the others.
+     * @param owned inner when it is not owned by the stream, or nullptr
+     */
+    std::unique_ptr<std::streambuf> make_recording_buf(std::streambuf *inner,
+                                                       std::unique_ptr<std::streambuf> owned,
+                                                       std::shared_ptr<mpp::stdio_recorder> recorder,
+                                                       int stream);
+
+    /**
+     * Called by wait_for(), outputs can still be read and recorded.
+     */
+    void record_exit(mpp::stdio_recorder &recorder, int exit_code);
+
+    /**
+     * Called when the handle is destroyed, nothing is recorded afterwards.
+     */
+    void finish_recording(mpp::stdio_recorder &recorder);
+
+    template <typename In, typename Out, typename Err>
+    void create_native_process(const process_startup &startup, process_info &info) {
+        stdio_binding stdio[3];
+
+        if (!startup._detach_dir.empty()) {
+            // stdio policies do not apply
+            bind_detached(startup, stdio);
+        } else {
+            bind_stdio<In, Out, Err>(startup, stdio);
+        }
+
+        try {
+            create_process_impl(startup, info, stdio);
+        } catch (...) {
+            // do rollback work
+            release_stdio(stdio[0]);
+            release_stdio(stdio[1]);
+            release_stdio(stdio[2]);
+            throw;
+        }
+    }
+
+    /**
+     * Defined in src/jobserver.cpp, blocks until a slot is free.
+     */
+    std::shared_ptr<mpp::jobserver_token> acquire_job_token(mpp::jobserver &server);
+
+    template <typename In, typename Out, typename Err>
+    void set_stdio_kinds(const process_startup &startup, process_info &info) {
+        if (!startup._detach_dir.empty()) {
+            // see bind_detached()
+            info._stdio_kinds[0] = stdio_kind::null;
+            info._stdio_kinds[1] = stdio_kind::file;
+            info._stdio_kinds[2] = stdio_kind::file;
+            return;
+        }
+        bool shared = startup._shared_input && startup._shared_input_stdin;
+        info._stdio_kinds[0] = shared ? stdio_kind::file : stdio_kind_of(In{}, startup._stdin);
+        info._stdio_kinds[1] = stdio_kind_of(Out{}, startup._stdout);
+        info._stdio_kinds[2] = startup.merge_outputs ? info._stdio_kinds[1]
+                                                     : stdio_kind_of(Err{}, startup._stderr);
+    }
+
+    template <typename In, typename Out, typename Err>
+    void create_process(const process_startup &startup, process_info &info) {
+        if (startup._jobserver) {
+            // released if starting fails
+            info._job_token = acquire_job_token(*startup._jobserver);
+        }
+
+        if (!startup._stdio_record.empty()) {
+            // the timeline starts before the child does
+            info._recorder = open_stdio_recorder(
+                std::string(startup._stdio_record.data(), startup._stdio_record.size()));
+        }
+
+        if (auto backend = get_process_backend()) {
+            backend->create(startup, info);
+            info._backend = backend;
+        } else {
+            create_native_process<In, Out, Err>(startup, info);
+        }
+
+        info._group_leader = startup._new_process_group;
+        info._cgroup.assign(startup._cgroup.data(), startup._cgroup.size());
+        info._job_class.assign(startup._job_class.data(), startup._job_class.size());
+        info._low_priority = startup._low_priority;
+        info._exit_accounting = startup._exit_accounting;
+        info._destroy_policy = startup._destroy_policy;
+        info._detach_dir.assign(startup._detach_dir.data(), startup._detach_dir.size());
+        info._stdout_filter = startup._stdout_filter;
+        info._stderr_filter = startup._stderr_filter;
+        set_stdio_kinds<In, Out, Err>(startup, info);
+    }
+
+    /**
+     * Resources used by a child over its lifetime, from wait4(2)
+     * or GetProcessTimes(). Fields a platform lacks stay zero.
+     */
+    struct resource_usage {
+        std::uint64_t _user_ns = 0;
+        std::uint64_t _system_ns = 0;
+        std::uint64_t _max_rss_kb = 0;
+        std::uint64_t _minor_faults = 0;
+        std::uint64_t _major_faults = 0;
+        std::uint64_t _voluntary_switches = 0;
+        std::uint64_t _involuntary_switches = 0;
+    };
 
     void close_process(process_info &info);
 
+    /**
+     * Blocks until the child has exited, without reaping it.
+     */
     int wait_for(const process_info &info);
 
+    /**
+     * Reap a child that wait_for() has seen exit. Signals are
+     * not sent to a reaped child, and it counts as exited.
+     * @return false if usage is not available
+     */
+    bool reap_process(process_info &info, resource_usage &usage);
+
+    /**
+     * Apply the destroy policy to a child that was never reaped,
+     * never blocks: waiting is left to a shared reaper thread.
+     */
+    void release_process(const process_info &info);
+
     void terminate_process(const process_info &info, bool force);
 
     bool process_exited(const process_info &info);
+
+    /**
+     * Readable once the child has exited: a pidfd on Linux, the process
+     * handle on Windows, FD_INVALID where there is none.
+     */
+    fd_type exit_fd(process_info &info);
+
+    /**
+     * Text describing a detached child, see basic_process::adopt().
+     */
+    std::string detach_state(const process_info &info);
+
+    /**
+     * Fill info from a detach_state(), throws when the child can't be adopted.
+     */
+    void adopt_process(long pid, const std::string &state, process_info &info);
+
+    /**
+     * Wait for "READY=1" on the notification channel, messages
+     * received so far are kept in buffer between calls.
+     * @param timeout_ms negative for no timeout
+     * @return 1 when ready, 0 on timeout, -1 when the channel
+     *         is closed or was never opened
+     */
+    int wait_ready(process_info &info, std::string &buffer, int timeout_ms);
+
+    /**
+     * Freeze the cgroup of the process if it has one,
+     * or stop its process group (or itself) otherwise.
+     */
+    bool suspend_process(const process_info &info);
+
+    bool resume_process(const process_info &info);
+
+    /**
+     * A running process that belongs to a job class.
+     */
+    struct job_state {
+        const process_info *_info = nullptr;
+        std::atomic<bool> _suspended{false};
+
+        /**
+         * The pressure_monitor that suspended the job, only compared.
+         * Cleared when the job is suspended or resumed by anyone else.
+         */
+        std::atomic<const void *> _shed_by{nullptr};
+    };
+
+    void register_job(job_state *job);
+
+    void unregister_job(job_state *job);
+
+    /**
+     * reap_process() under the lock job control holds while it signals
+     * jobs, so a registered job is never signaled once reaped.
+     */
+    bool reap_job(process_info &info, resource_usage &usage);
+
+    /**
+     * Suspend low priority jobs on behalf of owner, resume_shed() only
+     * resumes those, not ones suspended by other means.
+     */
+    std::size_t shed_low_priority(const void *owner);
+
+    std::size_t resume_shed(const void *owner);
+
+    /**
+     * Read what is available, like read(2).
+     * @return bytes read, 0 at end of file, -1 on errors
+     */
+    mpp::ssize_t read_some(fd_type fd, void *buf, std::size_t size);
+
+    /**
+     * A stream buffer reading fd through a line_filter.
+     */
+    std::unique_ptr<std::streambuf> make_filter_buf(fd_type fd, std::shared_ptr<const mpp::line_filter> filter);
+
+    /**
+     * I/O counters of a process, as reported by the kernel.
+     */
+    struct io_counters {
+        /**
+         * Bytes passed to read(2) and write(2) like calls.
+         */
+        std::uint64_t _rchar = 0;
+        std::uint64_t _wchar = 0;
+
+        /**
+         * Bytes actually fetched from or sent to the storage layer.
+         * Not available on all platforms.
+         */
+        std::uint64_t _read_bytes = 0;
+        std::uint64_t _write_bytes = 0;
+    };
+
+    /**
+     * Works until the process is reaped, including when it is a zombie.
+     * @return false if counters are not available
+     */
+    bool read_io_counters(const process_info &info, io_counters &io);
+
+    /**
+     * Time a process spent waiting instead of running, from the delay
+     * accounting of the kernel. Counts are the number of delays.
+     */
+    struct delay_counters {
+        /**
+         * Waiting for a CPU while runnable.
+         */
+        std::uint64_t _cpu_count = 0;
+        std::uint64_t _cpu_delay_ns = 0;
+
+        /**
+         * Waiting for synchronous block I/O.
+         */
+        std::uint64_t _blkio_count = 0;
+        std::uint64_t _blkio_delay_ns = 0;
+
+        /**
+         * Waiting for pages to be swapped in.
+         */
+        std::uint64_t _swapin_count = 0;
+        std::uint64_t _swapin_delay_ns = 0;
+
+        /**
+         * Time actually spent on a CPU.
+         */
+        std::uint64_t _cpu_run_ns = 0;
+    };
+
+    /**
+     * Query taskstats of the main thread over generic netlink, Linux only.
+     * Works until the process is reaped. The query needs CAP_NET_ADMIN, and delays
+     * stay zero unless delay accounting is enabled (kernel.task_delayacct
+     * or the delayacct boot option).
+     * @return false if counters are not available
+     */
+    bool read_delay_counters(const process_info &info, delay_counters &delays);
+
+    /**
+     * Observes the lifecycle of every process started by process_builder.
+     * Callbacks may be called from any thread that owns a process handle.
+     */
+    class process_observer {
+    public:
+        virtual ~process_observer() = default;
+
+        /**
+         * Called right after the child has started.
+         */
+        virtual void on_start(const process_startup &startup, const process_info &info) = 0;
+
+        /**
+         * Called once per process, before it is reaped: when wait_for() returns,
+         * or when the handle is destroyed with exit_code -1 if never waited.
+         */
+        virtual void on_exit(const process_info &info, int exit_code) = 0;
+    };
+
+    /**
+     * Only one observer can be installed at a time, nullptr to uninstall.
+     * Returns once callbacks of the previous observer that already started
+     * have returned, so it can be destroyed then. Never call it from a
+     * callback.
+     */
+    void set_process_observer(process_observer *observer);
+
+    process_observer *get_process_observer();
+
+    /**
+     * Pins the installed observer while its callback runs,
+     * see set_process_observer().
+     */
+    class observer_call {
+    private:
+        process_observer *_observer;
+
+    public:
+        observer_call();
+
+        ~observer_call();
+
+        observer_call(const observer_call &) = delete;
+
+        observer_call &operator=(const observer_call &) = delete;
+
+        process_observer *get() const {
+            return _observer;
+        }
+    };
 }
 
 namespace mpp {
@@ -77,88 +862,437 @@ namespace mpp {
     using mpp_impl::process_info;
     using mpp_impl::process_startup;
     using mpp_impl::fd_type;
+    using mpp_impl::stdio_dynamic;
+    using mpp_impl::stdio_pipe;
+    using mpp_impl::stdio_null;
+    using mpp_impl::stdio_inherit;
+    using mpp_impl::stdio_file;
+    using mpp_impl::io_counters;
+    using mpp_impl::delay_counters;
+    using mpp_impl::resource_usage;
+    using mpp_impl::destroy_policy;
 
-    class process {
+    /**
+     * What a child went through, captured right before it is reaped.
+     * See process_builder::exit_accounting().
+     */
+    struct exit_accounting {
+        bool _has_io = false;
+        io_counters _io;
+        bool _has_delays = false;
+        delay_counters _delays;
+
+        /**
+         * Taken when the child is reaped, whether accounting is enabled or not.
+         */
+        bool _has_usage = false;
+        resource_usage _usage;
+    };
+
+    class process_builder;
+
+    /**
+     * A child process whose stdio configuration is fixed at compile time.
+     * Streams that are not pipes to the parent do not exist in the handle,
+     * and the corresponding accessors fail to compile.
+     *
+     * @tparam In stdio policy of stdin
+     * @tparam Out stdio policy of stdout
+     * @tparam Err stdio policy of stderr
+     */
+    template <typename In, typename Out, typename Err>
+    class basic_process {
         friend class process_builder;
 
+        friend class drain_loop;
+
     private:
+        /**
+         * Placeholder of a stream compiled out by its policy.
+         */
+        struct no_stream {
+            explicit no_stream(fd_type) {}
+        };
+
+        template <typename Policy, typename Stream>
+        using stream_for = typename std::conditional<Policy::has_stream, Stream, no_stream>::type;
+
         struct member_holder {
             process_info _info;
-            fdostream _stdin;
-            fdistream _stdout;
-            fdistream _stderr;
+            std::unique_ptr<std::streambuf> _stdin_buf;
+            std::unique_ptr<std::streambuf> _stdout_buf;
+            std::unique_ptr<std::streambuf> _stderr_buf;
+            stream_for<In, fdostream> _stdin;
+            stream_for<Out, fdistream> _stdout;
+            stream_for<Err, fdistream> _stderr;
             int _exit_code = -1;
+            bool _observed = false;
+            bool _ready = false;
+            std::string _notify_buffer;
+            mpp_impl::job_state _job;
+            exit_accounting _accounting;
 
             explicit member_holder(const process_info &info)
                 : _info(info), _stdin(_info._stdin),
-                  _stdout(_info._stdout), _stderr(_info._stdout) {}
+                  _stdout(_info._stdout), _stderr(_info._stderr) {
+                _job._info = &_info;
+                if (_info._backend != nullptr) {
+                    attach_output(_stdout, _stdout_buf, _info, 1);
+                    attach_output(_stderr, _stderr_buf, _info, 2);
+                } else {
+                    attach_filter(_stdout, _stdout_buf, _info._stdout, _info._stdout_filter);
+                    attach_filter(_stderr, _stderr_buf, _info._stderr, _info._stderr_filter);
+                }
+                if (_info._recorder) {
+                    // on top of filters: what the parent sees is recorded
+                    attach_recorder(_stdin, _stdin_buf, _info._recorder, 0);
+                    attach_recorder(_stdout, _stdout_buf, _info._recorder, 1);
+                    attach_recorder(_stderr, _stderr_buf, _info._recorder, 2);
+                }
+                if (is_job()) {
+                    mpp_impl::register_job(&_job);
+                }
+            }
 
             ~member_holder() {
+                if (is_job()) {
+                    mpp_impl::unregister_job(&_job);
+                }
+                notify_exit();
+                if (_info._recorder) {
+                    mpp_impl::finish_recording(*_info._recorder);
+                }
+                if (!_info._reaped) {
+                    if (_job._suspended && _info._destroy_policy != destroy_policy::abandon) {
+                        // a stopped or frozen child never exits for the reaper
+                        mpp_impl::resume_process(_info);
+                    }
+                    mpp_impl::release_process(_info);
+                }
                 mpp_impl::close_process(_info);
             }
+
+            static void attach_filter(fdistream &stream, std::unique_ptr<std::streambuf> &buf, fd_type fd,
+                                      const std::shared_ptr<const line_filter> &filter) {
+                if (filter && fd != FD_INVALID) {
+                    buf = mpp_impl::make_filter_buf(fd, filter);
+                    stream.rdbuf(buf.get());
+                }
+            }
+
+            static void attach_filter(no_stream &, std::unique_ptr<std::streambuf> &, fd_type,
+                                      const std::shared_ptr<const line_filter> &) {
+                // nothing to filter
+            }
+
+            static void attach_output(fdistream &stream, std::unique_ptr<std::streambuf> &buf,
+                                      const process_info &info, int which) {
+                buf = info._backend->output(info, which);
+                if (buf) {
+                    stream.rdbuf(buf.get());
+                }
+            }
+
+            static void attach_output(no_stream &, std::unique_ptr<std::streambuf> &,
+                                      const process_info &, int) {
+                // nothing to read
+            }
+
+            template <typename Stream>
+            static void attach_recorder(Stream &stream, std::unique_ptr<std::streambuf> &buf,
+                                        const std::shared_ptr<stdio_recorder> &recorder, int which) {
+                // buf may own the current rdbuf, the recording one takes it over
+                buf = mpp_impl::make_recording_buf(stream.rdbuf(), std::move(buf), recorder, which);
+                stream.rdbuf(buf.get());
+            }
+
+            static void attach_recorder(no_stream &, std::unique_ptr<std::streambuf> &,
+                                        const std::shared_ptr<stdio_recorder> &, int) {
+                // nothing to record
+            }
+
+            bool is_job() const {
+                return !_info._job_class.empty() || _info._low_priority;
+            }
+
+            /**
+             * The child must have exited but not been reaped yet.
+             */
+            void collect_accounting() {
+                if (_info._exit_accounting) {
+                    _accounting._has_io = mpp_impl::read_io_counters(_info, _accounting._io);
+                    _accounting._has_delays = mpp_impl::read_delay_counters(_info, _accounting._delays);
+                }
+            }
+
+            void notify_exit() {
+                if (_observed) {
+                    return;
+                }
+                _observed = true;
+                if (_info._recorder) {
+                    mpp_impl::record_exit(*_info._recorder, _exit_code);
+                }
+                mpp_impl::observer_call call;
+                if (auto observer = call.get()) {
+                    observer->on_exit(_info, _exit_code);
+                }
+            }
         };
 
         std::unique_ptr<member_holder> _this;
 
-        explicit process(const process_info &info)
+        explicit basic_process(const process_info &info)
             : _this(std::make_unique<member_holder>(info)) {}
 
     public:
-        process() = delete;
+        basic_process() = delete;
 
-        process(const process &) = delete;
+        basic_process(const basic_process &) = delete;
 
-        process(process &&) = default;
+        basic_process(basic_process &&) = default;
 
-        process &operator=(process &&) = delete;
+        basic_process &operator=(basic_process &&) = delete;
 
-        process &operator=(const process &) = delete;
+        basic_process &operator=(const basic_process &) = delete;
 
     public:
-        ~process() = default;
+        ~basic_process() = default;
 
         std::ostream &in() {
+            static_assert(In::has_stream, "stdin of this process is not a pipe");
             return _this->_stdin;
         }
 
         std::istream &out() {
+            static_assert(Out::has_stream, "stdout of this process is not a pipe");
             return _this->_stdout;
         }
 
         std::istream &err() {
+            static_assert(Err::has_stream, "stderr of this process is not a pipe");
             return _this->_stderr;
         }
 
         int wait_for() {
-            if (has_exited() && _this->_exit_code >= 0) {
+            if (_this->_info._reaped || (has_exited() && _this->_exit_code >= 0)) {
                 return _this->_exit_code;
             }
             _this->_exit_code = mpp_impl::wait_for(_this->_info);
+            // both need the child unreaped
+            _this->collect_accounting();
+            _this->notify_exit();
+            _this->_accounting._has_usage = _this->is_job()
+                                            ? mpp_impl::reap_job(_this->_info, _this->_accounting._usage)
+                                            : mpp_impl::reap_process(_this->_info, _this->_accounting._usage);
+            _this->_info._job_token.reset();
             return _this->_exit_code;
         }
 
+        /**
+         * Change what happens to the child if this handle is
+         * destroyed before wait_for(), see process_builder::on_destroy().
+         */
+        void on_destroy(destroy_policy policy) {
+            _this->_info._destroy_policy = policy;
+        }
+
+        /**
+         * Process id on *nix systems, process handle on Windows.
+         */
+        fd_type pid() const {
+            return _this->_info._pid;
+        }
+
+        /**
+         * Describes a detached child for adopt(), see process_builder::detach().
+         */
+        std::string detach_state() const {
+            return mpp_impl::detach_state(_this->_info);
+        }
+
+        /**
+         * Resume supervision of a detached child, usually started by
+         * a previous instance of this program: waiting, exit code,
+         * signals and outputs work as if we had started it. A running
+         * child is only adopted where the start time of its keeper tells
+         * it apart from a reused pid, on Linux; elsewhere only finished
+         * children are, other ones throw.
+         * @param state from detach_state() of the original handle
+         */
+        static basic_process adopt(long pid, const std::string &state) {
+            process_info info{};
+            mpp_impl::adopt_process(pid, state, info);
+            return basic_process(info);
+        }
+
+        /**
+         * Filled by wait_for() when enabled with process_builder::exit_accounting(),
+         * except resource usage which is always there once wait_for() has returned.
+         */
+        const exit_accounting &accounting() const {
+            return _this->_accounting;
+        }
+
         bool has_exited() const {
             return mpp_impl::process_exited(_this->_info);
         }
 
+        /**
+         * Finish an exited child without blocking, for event loops
+         * watching exit_fd(): reaps it and fills the exit code and
+         * accounting like wait_for(), which then returns at once.
+         * @return false while the child runs, or if finishing it failed
+         */
+        bool try_reap() noexcept {
+            try {
+                if (!_this->_info._reaped && !has_exited()) {
+                    return false;
+                }
+                wait_for();
+                return true;
+            } catch (...) {
+                return false;
+            }
+        }
+
+        /**
+         * Becomes readable when the child exits, to be watched by
+         * epoll, poll or WaitForMultipleObjects along with other work,
+         * followed by try_reap(). A pidfd on Linux 5.3 and later, the
+         * process handle on Windows. Owned by this handle.
+         * @return FD_INVALID without kernel support, has_exited()
+         *         has to be polled instead
+         */
+        fd_type exit_fd() {
+            return mpp_impl::exit_fd(_this->_info);
+        }
+
+        /**
+         * Parent ends of the stdio pipes, to be watched by event loops.
+         * They stay blocking and are shared with in(), out() and err():
+         * read or write each one through either its stream or the
+         * descriptor, as buffered stream data is invisible to polling.
+         */
+        fd_type stdin_fd() const {
+            static_assert(In::has_stream, "stdin of this process is not a pipe");
+            return _this->_info._stdin;
+        }
+
+        fd_type stdout_fd() const {
+            static_assert(Out::has_stream, "stdout of this process is not a pipe");
+            return _this->_info._stdout;
+        }
+
+        fd_type stderr_fd() const {
+            static_assert(Err::has_stream, "stderr of this process is not a pipe");
+            return _this->_info._stderr;
+        }
+
         void interrupt(bool force = false) {
             mpp_impl::terminate_process(_this->_info, force);
+            if (is_suspended()) {
+                // let it handle the signal
+                resume();
+            }
+        }
+
+        /**
+         * Wait until the child reports it is ready, see process_builder::notify_ready().
+         * Returns as soon as the child writes "READY=1", no polling involved.
+         * @return false on timeout, or when the child exited or closed
+         *         the channel without reporting readiness
+         */
+        bool wait_ready(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) {
+            if (!_this->_ready) {
+                auto ms = static_cast<int>(std::min<std::chrono::milliseconds::rep>(
+                    timeout.count(), std::numeric_limits<int>::max()));
+                _this->_ready = mpp_impl::wait_ready(_this->_info, _this->_notify_buffer, ms) == 1;
+            }
+            return _this->_ready;
+        }
+
+        /**
+         * Pause the process without losing its work, see process_builder::cgroup()
+         * and process_builder::new_process_group() for what gets paused.
+         * A suspended process is still alive, has_exited() returns false.
+         */
+        bool suspend() {
+            if (!mpp_impl::suspend_process(_this->_info)) {
+                return false;
+            }
+            _this->_job._suspended = true;
+            _this->_job._shed_by = nullptr;
+            return true;
+        }
+
+        bool resume() {
+            if (!mpp_impl::resume_process(_this->_info)) {
+                return false;
+            }
+            _this->_job._suspended = false;
+            _this->_job._shed_by = nullptr;
+            return true;
+        }
+
+        bool is_suspended() const {
+            return _this->_job._suspended;
         }
 
     public:
-        static process exec(const std::string &command);
+        static basic_process exec(const std::string &command);
 
-        static process exec(const std::string &command,
-                            const std::vector<std::string> &args);
+        static basic_process exec(const std::string &command,
+                                  const std::vector<std::string> &args);
+    };
+
+    /**
+     * The fully dynamic process, every stream is a pipe
+     * unless redirected by process_builder at runtime.
+     */
+    using process = basic_process<stdio_dynamic, stdio_dynamic, stdio_dynamic>;
+
+    /**
+     * How process_builder::shared_input() passes the data to the child.
+     */
+    enum class shared_input_mode {
+        standard_input,
+        /**
+         * Number of the descriptor is in the MPP_SHARED_INPUT_FD
+         * environment variable of the child.
+         */
+        extra_descriptor,
     };
 
     class process_builder {
     private:
         process_startup _startup;
 
+        /**
+         * A loaded startup_record replaces the command line and environment,
+         * setting them afterwards would be silently ignored.
+         */
+        void check_not_loaded(const char *setter) const {
+            if (_startup._image) {
+                mpp::throw_ex<mpp::runtime_error>(std::string(setter) + " called after load()");
+            }
+        }
+
     public:
         process_builder() = default;
 
+#ifdef MOZART_PROCESS_PMR
+
+        /**
+         * All strings and containers of the startup are allocated
+         * from the given memory resource, which must outlive the builder.
+         * Note: copies of this builder use the default memory resource.
+         */
+        explicit process_builder(std::pmr::memory_resource *resource)
+            : _startup(resource) {}
+
+#endif
+
         ~process_builder() = default;
 
         process_builder(process_builder &&) = default;
@@ -171,8 +1305,9 @@ namespace mpp {
 
     public:
         process_builder &command(const std::string &command) {
+            check_not_loaded("command()");
             if (_startup._cmdline.empty()) {
-                _startup._cmdline.push_back(command);
+                _startup._cmdline.emplace_back(command);
             } else {
                 _startup._cmdline[0].assign(command);
             }
@@ -181,8 +1316,11 @@ namespace mpp {
 
         template <typename Container>
         process_builder &arguments(const Container &c) {
+            check_not_loaded("arguments()");
             if (_startup._cmdline.size() <= 1) {
-                std::copy(c.begin(), c.end(), std::back_inserter(_startup._cmdline));
+                for (const auto &arg : c) {
+                    _startup._cmdline.emplace_back(arg);
+                }
             } else {
                 // invalid operation, do nothing
             }
@@ -190,6 +1328,7 @@ namespace mpp {
         }
 
         process_builder &environment(const std::string &key, const std::string &value) {
+            check_not_loaded("environment()");
             _startup._env.emplace(key, value);
             return *this;
         }
@@ -235,10 +1374,209 @@ namespace mpp {
             return *this;
         }
 
-        process start() {
+        /**
+         * Only deliver selected lines through process::out(),
+         * filtering happens while draining the pipe.
+         * Defined in <mozart++/line_filter>.
+         */
+        process_builder &filter_stdout(line_filter filter);
+
+        process_builder &filter_stderr(line_filter filter);
+
+        /**
+         * Pass a readiness notification channel to the child, so that
+         * process::wait_ready() returns as soon as the child is ready.
+         * Like sd_notify(3), the child writes "READY=1\n" to the descriptor
+         * whose number is given in the MPP_NOTIFY_FD environment variable.
+         * Unsupported on Windows.
+         */
+        process_builder &notify_ready(bool r) {
+            _startup._notify_ready = r;
+            return *this;
+        }
+
+        /**
+         * Capture I/O counters and delay accounting of the child when it
+         * exits, available from process::accounting() after wait_for().
+         * Tells CPU starvation apart from I/O stalls, see delay_counters.
+         */
+        process_builder &exit_accounting(bool r) {
+            _startup._exit_accounting = r;
+            return *this;
+        }
+
+        /**
+         * Let the child outlive this process. It runs in a new session
+         * under a keeper process, which waits for it and records its exit
+         * status in dir. stdin is the null device and outputs go to the
+         * files "stdout" and "stderr" of dir, which must exist; stdio
+         * policies and redirects are ignored. out() and err() read what
+         * has been written to the files so far.
+         * Pass detach_state() of the handle to adopt() to supervise the
+         * child from another process. Unsupported on Windows.
+         */
+        process_builder &detach(const std::string &dir) {
+            _startup._detach_dir = dir;
+            return *this;
+        }
+
+        /**
+         * Record the bytes written to in() and read from out() and err(),
+         * with the time they passed, into path. Replay with replay_stdio()
+         * from <mozart++/stdio_replay>.
+         *
+         * Note: outputs are timed when the parent reads them, not when the
+         * child writes them. They are only timed like the child wrote them
+         * if the parent reads while the child runs. Output read after
+         * wait_for() is stamped after the exit, and a stand-in replays it
+         * as a single burst at the end.
+         */
+        process_builder &record_stdio(const std::string &path) {
+            _startup._stdio_record = path;
+            return *this;
+        }
+
+        /**
+         * Replace the command with a stand-in child reproducing a recording,
+         * defined in <mozart++/stdio_replay>.
+         */
+        process_builder &replay_stdio(const std::string &recording, const std::string &standin,
+                                      double speed = 1);
+
+        /**
+         * Give the child read-only data shared with every other child
+         * started with it. Each child gets a descriptor of its own, reading
+         * from offset 0, and children mapping it share the same pages.
+         * Defined in <mozart++/shared_input>.
+         */
+        process_builder &shared_input(std::shared_ptr<const sealed_input> input,
+                                      shared_input_mode mode = shared_input_mode::standard_input);
+
+        /**
+         * Count the child against the slots of a jobserver, and pass it
+         * to the child in MAKEFLAGS so make, ninja and compilers started
+         * under it take their parallelism from the same slots.
+         * start() blocks until a slot is free. The slot is given back when
+         * the child is reaped: by wait_for(), or in the background after
+         * the handle is destroyed, see on_destroy(). With
+         * destroy_policy::abandon it is given back with the handle.
+         * Defined in <mozart++/jobserver>, unsupported on Windows.
+         */
+        process_builder &use_jobserver(std::shared_ptr<jobserver> server);
+
+        /**
+         * What happens to the child if its handle is destroyed before
+         * wait_for(). Destroying a handle never blocks, and by default the
+         * child keeps running and is reaped in the background when it exits.
+         * A detached child is never killed by destroy_policy::reap, only
+         * its keeper is reaped.
+         */
+        process_builder &on_destroy(destroy_policy policy) {
+            _startup._destroy_policy = policy;
+            return *this;
+        }
+
+        /**
+         * Start the child in its own process group,
+         * so that suspend() pauses its descendants too.
+         * Unused on Windows.
+         */
+        process_builder &new_process_group(bool r) {
+            _startup._new_process_group = r;
+            return *this;
+        }
+
+        /**
+         * Move the child into a cgroup v2 directory before exec,
+         * suspend() then uses cgroup.freeze instead of signals.
+         * The directory must exist and should not be shared with other processes.
+         * Unused on platforms other than Linux.
+         */
+        process_builder &cgroup(const std::string &dir) {
+            _startup._cgroup = dir;
+            return *this;
+        }
+
+        /**
+         * Tag the process for batch operations like suspend_job_class().
+         */
+        process_builder &job_class(const std::string &name) {
+            _startup._job_class = name;
+            return *this;
+        }
+
+        /**
+         * Mark the process as sheddable: it may be suspended or terminated
+         * by a pressure_monitor, or by suspend_low_priority() and friends.
+         */
+        process_builder &low_priority(bool r) {
+            _startup._low_priority = r;
+            return *this;
+        }
+
+        /**
+         * Append the startup to out in the binary encoding of startup_record.
+         */
+        void save(std::string &out) const;
+
+        /**
+         * Take the startup from an encoded record. Arguments and environments
+         * are not copied: the builder keeps pointers into the record, so the
+         * buffer it was parsed from must outlive start(). The command,
+         * arguments and environments of the record take the place of the
+         * ones set with command(), arguments() and environment(), which
+         * throw when called afterwards.
+         */
+        process_builder &load(const startup_record &record);
+
+        /**
+         * Start the process, stdio policies default to the fully dynamic
+         * configuration. stdio_file policies use the redirect targets
+         * set by redirect_stdin/stdout/stderr().
+         *
+         * example: builder.start<stdio_pipe, stdio_pipe, stdio_null>()
+         */
+        template <typename In = stdio_dynamic, typename Out = stdio_dynamic, typename Err = stdio_dynamic>
+        basic_process<In, Out, Err> start() {
             process_info info{};
-            mpp_impl::create_process(_startup, info);
-            return process(info);
+            mpp_impl::create_process<In, Out, Err>(_startup, info);
+            mpp_impl::observer_call call;
+            if (auto observer = call.get()) {
+                observer->on_start(_startup, info);
+            }
+            return basic_process<In, Out, Err>(info);
         }
     };
+
+    template <typename In, typename Out, typename Err>
+    basic_process<In, Out, Err> basic_process<In, Out, Err>::exec(const std::string &command) {
+        return process_builder().command(command).start<In, Out, Err>();
+    }
+
+    template <typename In, typename Out, typename Err>
+    basic_process<In, Out, Err> basic_process<In, Out, Err>::exec(const std::string &command,
+                                                                  const std::vector<std::string> &args) {
+        return process_builder().command(command).arguments(args).start<In, Out, Err>();
+    }
+
+    /**
+     * Suspend every live process of a job class that is not suspended yet.
+     * @return number of processes suspended
+     */
+    std::size_t suspend_job_class(const std::string &name);
+
+    /**
+     * @return number of processes resumed
+     */
+    std::size_t resume_job_class(const std::string &name);
+
+    /**
+     * Batch operations on processes started with process_builder::low_priority().
+     * @return number of processes affected
+     */
+    std::size_t suspend_low_priority();
+
+    std::size_t resume_low_priority();
+
+    std::size_t terminate_low_priority(bool force = false);
 }
@@ -0,0 +1,108 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <thread>
+#include <vector>
+
+namespace mpp_impl {
+    /**
+     * Copy everything from one pipe to every pipe in to, with tee(2) and
+     * splice(2) on Linux so that data never enters user space. Outputs
+     * that are closed by their readers are dropped. Runs until from
+     * reaches end of file, then closes every descriptor it was given.
+     */
+    void relay_fanout(fd_type from, std::vector<fd_type> to);
+
+    /**
+     * Copy from every pipe in from to one pipe, as data arrives.
+     * Lines up to 64K from different inputs are never interleaved.
+     * Runs until every input reaches end of file, then closes every
+     * descriptor it was given.
+     */
+    void merge_fanin(std::vector<fd_type> from, fd_type to);
+}
+
+namespace mpp {
+    /**
+     * Children wired into a dataflow graph: an edge connects stdout of
+     * one node to stdin of another. A node with several outgoing edges
+     * has its output copied to each of them, a node with several incoming
+     * edges reads them merged. Both are pumped by threads of the graph.
+     *
+     * Streams without edges are set up by the builder of the node as usual,
+     * for example stdin of a source is a pipe from us unless redirected.
+     *
+     * example:
+     *      process_graph g;
+     *      auto src = g.add(process_builder().command("producer"));
+     *      auto a = g.add(process_builder().command("consumer-a"));
+     *      auto b = g.add(process_builder().command("consumer-b"));
+     *      g.connect(src, a).connect(src, b);
+     *      std::vector<int> codes = g.run();
+     */
+    class process_graph {
+    public:
+        using node_id = std::size_t;
+
+    private:
+        struct edge {
+            node_id _from;
+            node_id _to;
+        };
+
+        std::vector<process_builder> _builders;
+        std::vector<edge> _edges;
+        std::vector<process> _processes;
+        std::vector<std::thread> _pumps;
+
+    public:
+        process_graph() = default;
+
+        ~process_graph();
+
+        process_graph(const process_graph &) = delete;
+
+        process_graph &operator=(const process_graph &) = delete;
+
+        /**
+         * @return id of the node, in order of add() starting from 0
+         */
+        node_id add(process_builder builder);
+
+        /**
+         * Connect stdout of from to stdin of to, redirects of
+         * these streams set on the builders are overridden.
+         */
+        process_graph &connect(node_id from, node_id to);
+
+        /**
+         * Start every node and the pumps between them.
+         * Throws like process_builder::start(), processes
+         * already started are left running.
+         */
+        void start();
+
+        /**
+         * Handle of a node started by start().
+         */
+        process &node(node_id id);
+
+        /**
+         * Wait for every node and every pump.
+         * @return exit codes of the nodes, indexed by node id
+         */
+        std::vector<int> wait_for();
+
+        std::vector<int> run() {
+            start();
+            return wait_for();
+        }
+    };
+}
@@ -0,0 +1,159 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace mpp {
+    /**
+     * What a simulated process does, decided when it starts.
+     */
+    struct simulated_outcome {
+        std::uint64_t _runtime_us = 0;
+        int _exit_code = 0;
+        std::string _stdout;
+        std::string _stderr;
+    };
+
+    /**
+     * Runs virtual processes on a virtual clock instead of forking, so that
+     * schedulers built on process_builder can be benchmarked and tested with
+     * millions of processes. Nothing depends on real time: the same model
+     * and the same calls give the same results.
+     *
+     * Time only moves with advance(), advance_to_next_exit() and wait_for(),
+     * which jumps to the exit of the process when it is later than now.
+     * Outputs are complete as soon as the process starts.
+     * The backend must outlive the processes it started.
+     */
+    class simulated_backend : public mpp_impl::process_backend {
+    public:
+        using model = std::function<simulated_outcome(const process_startup &)>;
+
+    private:
+        static constexpr std::uint64_t NEVER = UINT64_MAX;
+
+        struct sim_process {
+            std::uint64_t _exit_us = 0;
+            int _exit_code = 0;
+
+            /**
+             * Runtime left when suspended, suspended processes never exit.
+             */
+            std::uint64_t _remaining_us = 0;
+            bool _suspended = false;
+            std::string _stdout;
+            std::string _stderr;
+        };
+
+        /**
+         * Exit times with pids, entries outdated by terminate()
+         * and suspend() are skipped when they come up.
+         */
+        using exit_event = std::pair<std::uint64_t, long>;
+
+        mutable std::mutex _lock;
+        model _model;
+        std::uint64_t _now_us = 0;
+        std::uint64_t _spawn_cost_us = 0;
+        std::uint64_t _started = 0;
+        long _next_pid = 1L << 30;
+        std::unordered_map<long, sim_process> _processes;
+        std::priority_queue<exit_event, std::vector<exit_event>, std::greater<exit_event>> _exits;
+
+        sim_process &find(const process_info &info);
+
+        void schedule_exit(long pid, sim_process &p);
+
+        bool next_exit();
+
+    public:
+        /**
+         * @param m outcome of each process, by default they exit
+         *          with 0 immediately without output
+         */
+        explicit simulated_backend(model m = model());
+
+        /**
+         * Handles of simulated processes point to their backend,
+         * all of them must be destroyed first: open_processes() == 0.
+         */
+        ~simulated_backend() override;
+
+        simulated_backend(const simulated_backend &) = delete;
+
+        simulated_backend &operator=(const simulated_backend &) = delete;
+
+        /**
+         * Start simulated processes from now on, replacing real ones.
+         */
+        void install();
+
+        void uninstall();
+
+        /**
+         * Virtual time charged to every start, 0 by default.
+         */
+        void spawn_cost(std::uint64_t us);
+
+        std::uint64_t now_us() const;
+
+        void advance(std::uint64_t us);
+
+        /**
+         * Move the clock to the next exit of a running process.
+         * @return false if no process is running
+         */
+        bool advance_to_next_exit();
+
+        /**
+         * Same, and append the pids of the processes exiting then, so that
+         * schedulers don't have to poll every handle with has_exited().
+         * Processes that exit as time moves otherwise, by advance(),
+         * wait_for() or terminate(), are not reported here.
+         */
+        bool advance_to_next_exit(std::vector<fd_type> &exited);
+
+        /**
+         * Processes started so far.
+         */
+        std::uint64_t started() const;
+
+        /**
+         * Processes whose handles are still open.
+         */
+        std::size_t open_processes() const;
+
+    public:
+        void create(const process_startup &startup, process_info &info) override;
+
+        void close(process_info &info) override;
+
+        /**
+         * Throws when the process is suspended: it would never return.
+         */
+        int wait_for(const process_info &info) override;
+
+        void terminate(const process_info &info, bool force) override;
+
+        bool exited(const process_info &info) override;
+
+        bool suspend(const process_info &info) override;
+
+        bool resume(const process_info &info) override;
+
+        std::unique_ptr<std::streambuf> output(const process_info &info, int stream) override;
+    };
+}
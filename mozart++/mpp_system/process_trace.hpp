@@ -0,0 +1,167 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+namespace mpp_impl {
+    /**
+     * LEB128 varints, shared by the binary formats of the library.
+     */
+    void write_varint(std::FILE *fp, std::uint64_t value);
+
+    /**
+     * @return false at end of file or on a malformed varint
+     */
+    bool read_varint(std::FILE *fp, std::uint64_t &value);
+
+    /**
+     * Exit codes may be negative, zigzag them to keep varints short.
+     */
+    std::uint64_t zigzag(int value);
+
+    int unzigzag(std::uint64_t value);
+}
+
+namespace mpp {
+    /**
+     * How the standard streams of a recorded spawn were configured.
+     * A stream with none of its flags set was a pipe to the parent.
+     */
+    enum spawn_stdio_flags : std::uint16_t {
+        SPAWN_STDIN_REDIRECTED = 1u << 0u,
+        SPAWN_STDOUT_REDIRECTED = 1u << 1u,
+        SPAWN_STDERR_REDIRECTED = 1u << 2u,
+        SPAWN_MERGE_OUTPUTS = 1u << 3u,
+        SPAWN_STDIN_NULL = 1u << 4u,
+        SPAWN_STDOUT_NULL = 1u << 5u,
+        SPAWN_STDERR_NULL = 1u << 6u,
+        SPAWN_STDIN_INHERITED = 1u << 7u,
+        SPAWN_STDOUT_INHERITED = 1u << 8u,
+        SPAWN_STDERR_INHERITED = 1u << 9u,
+    };
+
+    /**
+     * One process_builder::start() in a spawn trace.
+     * Arguments and environments are recorded by size only.
+     */
+    struct spawn_record {
+        /**
+         * Microseconds since the recorder was created.
+         */
+        std::uint64_t _start_us = 0;
+        std::uint64_t _runtime_us = 0;
+
+        /**
+         * -1 if the handle was destroyed without wait_for().
+         */
+        int _exit_code = -1;
+
+        std::string _command;
+
+        /**
+         * Number and total length of arguments, excluding the command.
+         */
+        std::uint32_t _argc = 0;
+        std::uint32_t _arg_bytes = 0;
+
+        /**
+         * Number and total length of "key=value" environment entries.
+         */
+        std::uint32_t _envc = 0;
+        std::uint32_t _env_bytes = 0;
+
+        /**
+         * Combination of spawn_stdio_flags.
+         */
+        std::uint16_t _stdio = 0;
+
+        /**
+         * Bytes written by the child, including writes to files.
+         */
+        std::uint64_t _output_bytes = 0;
+    };
+
+    /**
+     * Records every process_builder::start() into a compact binary trace.
+     * A record is written when the process is observed to exit.
+     */
+    class spawn_recorder : public mpp_impl::process_observer {
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct pending_spawn {
+            spawn_record _record;
+            clock::time_point _start;
+        };
+
+        std::FILE *_file = nullptr;
+        std::mutex _lock;
+        clock::time_point _epoch;
+        std::unordered_map<fd_type, pending_spawn> _pending;
+
+    public:
+        /**
+         * Creates (or truncates) the trace file.
+         */
+        explicit spawn_recorder(const std::string &path);
+
+        ~spawn_recorder() override;
+
+        spawn_recorder(const spawn_recorder &) = delete;
+
+        spawn_recorder &operator=(const spawn_recorder &) = delete;
+
+        /**
+         * Start recording spawns of all process_builders.
+         */
+        void install() {
+            mpp_impl::set_process_observer(this);
+        }
+
+        /**
+         * Stop recording. Returns once callbacks already running in other
+         * threads have returned, the recorder can be destroyed then.
+         * Processes started by those threads but not exited yet are written
+         * when the recorder is destroyed, with the runtime seen so far.
+         */
+        void uninstall();
+
+        void on_start(const process_startup &startup, const process_info &info) override;
+
+        void on_exit(const process_info &info, int exit_code) override;
+    };
+
+    /**
+     * Reads records written by spawn_recorder, in order of process exit.
+     */
+    class spawn_trace_reader {
+    private:
+        std::FILE *_file = nullptr;
+
+    public:
+        explicit spawn_trace_reader(const std::string &path);
+
+        ~spawn_trace_reader();
+
+        spawn_trace_reader(const spawn_trace_reader &) = delete;
+
+        spawn_trace_reader &operator=(const spawn_trace_reader &) = delete;
+
+        /**
+         * @return false at the end of trace or on a truncated record
+         */
+        bool next(spawn_record &record);
+    };
+}
@@ -0,0 +1,66 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <memory>
+#include <string>
+
+namespace mpp {
+    /**
+     * Read-only data in a sealed memfd, given to many children without
+     * copying it for each of them, see process_builder::shared_input().
+     * Seals forbid writing, shrinking and growing, so children may
+     * mmap it and trust the contents. Linux only.
+     */
+    class sealed_input {
+    private:
+        fd_type _fd;
+        std::size_t _size;
+
+        sealed_input(fd_type fd, std::size_t size) : _fd(fd), _size(size) {}
+
+    public:
+        ~sealed_input();
+
+        sealed_input(const sealed_input &) = delete;
+
+        sealed_input &operator=(const sealed_input &) = delete;
+
+        /**
+         * Copy data into a new memfd and seal it.
+         */
+        static std::shared_ptr<const sealed_input> from_buffer(const void *data, std::size_t size);
+
+        /**
+         * Copy a file into a new memfd in the kernel, and seal it.
+         */
+        static std::shared_ptr<const sealed_input> from_file(const std::string &path);
+
+        /**
+         * Take over a memfd created with MFD_ALLOW_SEALING and seal it,
+         * fails if it is still mapped writable somewhere.
+         */
+        static std::shared_ptr<const sealed_input> from_memfd(fd_type fd);
+
+        fd_type fd() const {
+            return _fd;
+        }
+
+        std::size_t size() const {
+            return _size;
+        }
+    };
+
+    inline process_builder &process_builder::shared_input(std::shared_ptr<const sealed_input> input,
+                                                          shared_input_mode mode) {
+        _startup._shared_input = std::move(input);
+        _startup._shared_input_stdin = mode == shared_input_mode::standard_input;
+        return *this;
+    }
+}
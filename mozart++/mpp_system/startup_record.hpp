@@ -0,0 +1,184 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace mpp {
+    /**
+     * Boolean settings of an encoded startup.
+     */
+    enum startup_record_flags : std::uint16_t {
+        STARTUP_MERGE_OUTPUTS = 1u << 0u,
+        STARTUP_NEW_PROCESS_GROUP = 1u << 1u,
+        STARTUP_LOW_PRIORITY = 1u << 2u,
+        STARTUP_NOTIFY_READY = 1u << 3u,
+        STARTUP_EXIT_ACCOUNTING = 1u << 4u,
+    };
+
+    /**
+     * A zero-copy view of a process_startup in binary encoding,
+     * written by process_builder::save(). Records may be concatenated
+     * in a buffer or a file (see startup_file) and are read in place.
+     *
+     * Layout, integers are little endian:
+     *      u32     size of the record, padded to 4 bytes
+     *      u16     version
+     *      u16     flags, see startup_record_flags
+     *      u32     number of arguments, including the command
+     *      u32     number of environments
+     *      i64 x3  redirect targets of stdin, stdout and stderr, -1 for none
+     *      nul-terminated strings: cwd, cgroup, job class,
+     *      arguments, then environments as "key=value"
+     *
+     * Redirect targets are descriptors of the writing process, they
+     * are only meaningful to itself and to the children inheriting them.
+     */
+    class startup_record {
+    public:
+        static constexpr std::uint16_t VERSION = 1;
+        static constexpr std::size_t HEADER_SIZE = 40;
+
+    private:
+        const char *_data = nullptr;
+        std::size_t _size = 0;
+        std::uint16_t _flags = 0;
+        std::uint32_t _argc = 0;
+        std::uint32_t _envc = 0;
+        std::int64_t _redirect[3] = {-1, -1, -1};
+        const char *_cwd = nullptr;
+        const char *_cgroup = nullptr;
+        const char *_job_class = nullptr;
+        const char *_args = nullptr;
+        const char *_envs = nullptr;
+
+    public:
+        /**
+         * Parse and validate the record at the beginning of data.
+         * Nothing is copied, the record refers to data afterwards.
+         * @return size of the record, or 0 when it is truncated or malformed
+         */
+        std::size_t parse(const char *data, std::size_t size);
+
+        /**
+         * Encode a startup, appending the record to out.
+         * Filters are not encoded.
+         */
+        static void encode(const mpp_impl::process_startup &startup, std::string &out);
+
+        bool valid() const {
+            return _data != nullptr;
+        }
+
+        std::size_t size() const {
+            return _size;
+        }
+
+        std::uint16_t flags() const {
+            return _flags;
+        }
+
+        std::uint32_t argc() const {
+            return _argc;
+        }
+
+        std::uint32_t envc() const {
+            return _envc;
+        }
+
+        const char *cwd() const {
+            return _cwd;
+        }
+
+        const char *cgroup() const {
+            return _cgroup;
+        }
+
+        const char *job_class() const {
+            return _job_class;
+        }
+
+        /**
+         * @param stream 0 for stdin, 1 for stdout, 2 for stderr
+         * @return redirect target, -1 for none
+         */
+        std::int64_t redirect_target(int stream) const {
+            return _redirect[stream];
+        }
+
+        template <typename Fn>
+        void for_each_arg(Fn &&fn) const {
+            const char *p = _args;
+            for (std::uint32_t i = 0; i < _argc; ++i, p += std::strlen(p) + 1) {
+                fn(p);
+            }
+        }
+
+        /**
+         * Environments are visited as "key=value".
+         */
+        template <typename Fn>
+        void for_each_env(Fn &&fn) const {
+            const char *p = _envs;
+            for (std::uint32_t i = 0; i < _envc; ++i, p += std::strlen(p) + 1) {
+                fn(p);
+            }
+        }
+
+        /**
+         * Point argv and envp of image to the strings of the record,
+         * allocating nothing but the two pointer arrays.
+         */
+        void build_image(mpp_impl::exec_image &image) const;
+    };
+
+    /**
+     * A file of startup records mapped into memory, records are
+     * read without copying. The file starts with the 8 bytes written
+     * by write_header(), followed by records back to back.
+     */
+    class startup_file {
+    private:
+        const char *_data = nullptr;
+        std::size_t _size = 0;
+        std::size_t _offset = 0;
+#ifdef MOZART_PLATFORM_WIN32
+        void *_mapping = nullptr;
+#endif
+
+        void unmap();
+
+    public:
+        /**
+         * Map the file, throws when it can't be mapped or is not a startup file.
+         */
+        explicit startup_file(const std::string &path);
+
+        ~startup_file();
+
+        startup_file(const startup_file &) = delete;
+
+        startup_file &operator=(const startup_file &) = delete;
+
+        /**
+         * Read the next record, which stays valid while the file is open.
+         * @return false at the end of the file, throws on corrupted records
+         */
+        bool next(startup_record &record);
+
+        void rewind();
+
+        /**
+         * Append the file header to out, records are appended after it.
+         */
+        static void write_header(std::string &out);
+    };
+}
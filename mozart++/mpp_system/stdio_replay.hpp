@@ -0,0 +1,141 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+#pragma once
+
+#include <mozart++/process>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+namespace mpp {
+    /**
+     * Which stream a chunk of a stdio recording belongs to.
+     */
+    enum stdio_chunk_kind : std::uint8_t {
+        STDIO_CHUNK_STDIN = 0,
+        STDIO_CHUNK_STDOUT = 1,
+        STDIO_CHUNK_STDERR = 2,
+        /**
+         * The last chunk, carries the exit code instead of data. Written
+         * when the handle is destroyed, so outputs read after wait_for()
+         * come before it; its time is when the exit was seen, unless
+         * that is earlier than the chunk before.
+         */
+        STDIO_CHUNK_EXIT = 3,
+    };
+
+    struct stdio_chunk {
+        std::uint8_t _kind = STDIO_CHUNK_EXIT;
+
+        /**
+         * Microseconds since the process was started, when the parent
+         * wrote or read the data, see process_builder::record_stdio().
+         */
+        std::uint64_t _time_us = 0;
+
+        std::string _data;
+
+        /**
+         * -1 if the handle was destroyed without wait_for().
+         */
+        int _exit_code = -1;
+    };
+
+    /**
+     * Writes the stdio recording of one process,
+     * created by process_builder::record_stdio().
+     */
+    class stdio_recorder {
+    private:
+        using clock = std::chrono::steady_clock;
+
+        std::FILE *_file = nullptr;
+        std::mutex _lock;
+        clock::time_point _epoch;
+        std::uint64_t _last_us = 0;
+        std::uint64_t _exit_us = 0;
+        int _exit_code = -1;
+        bool _exited = false;
+        bool _finished = false;
+
+        std::uint64_t elapsed_us(clock::time_point now) const;
+
+    public:
+        /**
+         * Creates (or truncates) the recording file.
+         */
+        explicit stdio_recorder(const std::string &path);
+
+        ~stdio_recorder();
+
+        stdio_recorder(const stdio_recorder &) = delete;
+
+        stdio_recorder &operator=(const stdio_recorder &) = delete;
+
+        /**
+         * Called from the reading and writing threads,
+         * data after finish() is dropped.
+         */
+        void write(stdio_chunk_kind kind, const char *data, std::size_t size);
+
+        /**
+         * Remember the exit code, written by finish().
+         */
+        void exited(int exit_code);
+
+        /**
+         * Write the exit chunk, -1 for the code when exited() was never called.
+         */
+        void finish();
+    };
+
+    /**
+     * Reads chunks written by stdio_recorder, in the order they passed.
+     */
+    class stdio_replay_reader {
+    private:
+        std::FILE *_file = nullptr;
+
+    public:
+        explicit stdio_replay_reader(const std::string &path);
+
+        ~stdio_replay_reader();
+
+        stdio_replay_reader(const stdio_replay_reader &) = delete;
+
+        stdio_replay_reader &operator=(const stdio_replay_reader &) = delete;
+
+        /**
+         * @return false at the end of recording or on a truncated chunk
+         */
+        bool next(stdio_chunk &chunk);
+    };
+
+    /**
+     * The child is mpp-standin from the tools of this library, which
+     * writes the recorded outputs at the recorded times, divided by speed,
+     * or as fast as possible when speed is 0. Those are the times the
+     * recording parent read them at. It reads as many bytes
+     * from stdin as were recorded and exits with the recorded code.
+     * Other settings of the builder apply to the stand-in as usual.
+     */
+    inline process_builder &process_builder::replay_stdio(const std::string &recording,
+                                                          const std::string &standin,
+                                                          double speed) {
+        _startup._image.reset();
+        _startup._cmdline.clear();
+        _startup._cmdline.emplace_back(standin);
+        _startup._cmdline.emplace_back("--replay");
+        _startup._cmdline.emplace_back(recording);
+        _startup._cmdline.emplace_back("--speed");
+        _startup._cmdline.emplace_back(std::to_string(speed));
+        return *this;
+    }
+}
@@ -0,0 +1,46 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/chunk_queue>
+#include <mozart++/process>
+#include <algorithm>
+
+namespace mpp {
+    chunk_pool::chunk_pool(std::size_t chunks, std::size_t chunk_size)
+        : _chunk_size(chunk_size), _free(chunks) {
+        _blocks.reserve(chunks);
+        for (std::size_t i = 0; i < chunks; ++i) {
+            _blocks.emplace_back(std::make_unique<mpp_impl::chunk_block>());
+            _blocks.back()->_pool = this;
+            _blocks.back()->_data.reset(new char[chunk_size]);
+            recycle(_blocks.back().get());
+        }
+    }
+
+    mpp::ssize_t read_chunk(fd_type fd, chunk_ref &chunk) {
+        mpp::ssize_t n = mpp_impl::read_some(fd, chunk.data(), chunk.capacity());
+        chunk.resize(n > 0 ? static_cast<std::size_t>(n) : 0);
+        return n;
+    }
+
+    mpp::ssize_t read_chunk(std::istream &in, chunk_ref &chunk) {
+        std::streambuf *buf = in.rdbuf();
+        chunk.resize(0);
+
+        // blocks until there is something
+        if (std::streambuf::traits_type::eq_int_type(buf->sgetc(), std::streambuf::traits_type::eof())) {
+            in.setstate(std::ios::eofbit);
+            return 0;
+        }
+        std::streamsize avail = std::max<std::streamsize>(buf->in_avail(), 1);
+        std::streamsize n = buf->sgetn(chunk.data(), std::min<std::streamsize>(
+            avail, static_cast<std::streamsize>(chunk.capacity())));
+        chunk.resize(static_cast<std::size_t>(n));
+        return n;
+    }
+}
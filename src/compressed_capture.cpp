@@ -0,0 +1,292 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/compressed_capture>
+#include <cstring>
+
+namespace mpp_impl {
+    /**
+     * Sequence layout:
+     *      token: literal length (high 4 bits), match length - 4 (low 4 bits)
+     *      [literal length extension: 255, 255, ..., n]
+     *      literals
+     *      offset: 2 bytes, little endian
+     *      [match length extension]
+     * The last sequence of a block has literals only.
+     */
+    static constexpr int LZ_MIN_MATCH = 4;
+    static constexpr int LZ_HASH_BITS = 12;
+    static constexpr std::size_t LZ_MAX_OFFSET = 65535;
+
+    /**
+     * Matches never reach the last bytes of a block, they are always literals.
+     */
+    static constexpr std::size_t LZ_LAST_LITERALS = 5;
+
+    static inline std::uint32_t read32(const unsigned char *p) {
+        std::uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline std::uint32_t lz_hash(std::uint32_t v) {
+        return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+    }
+
+    static unsigned char *write_length(unsigned char *op, std::size_t len) {
+        while (len >= 255) {
+            *op++ = 255;
+            len -= 255;
+        }
+        *op++ = static_cast<unsigned char>(len);
+        return op;
+    }
+
+    static unsigned char *write_sequence(unsigned char *op,
+                                         const unsigned char *literals, std::size_t lit_len,
+                                         std::size_t offset, std::size_t match_len) {
+        unsigned char *token = op++;
+        std::size_t m = match_len == 0 ? 0 : match_len - LZ_MIN_MATCH;
+
+        *token = static_cast<unsigned char>((lit_len >= 15 ? 15 : lit_len) << 4u);
+        if (lit_len >= 15) {
+            op = write_length(op, lit_len - 15);
+        }
+        std::memcpy(op, literals, lit_len);
+        op += lit_len;
+
+        if (match_len == 0) {
+            // the last sequence
+            return op;
+        }
+
+        *op++ = static_cast<unsigned char>(offset & 0xffu);
+        *op++ = static_cast<unsigned char>(offset >> 8u);
+        *token |= static_cast<unsigned char>(m >= 15 ? 15 : m);
+        if (m >= 15) {
+            op = write_length(op, m - 15);
+        }
+        return op;
+    }
+
+    std::size_t lz_compress(const char *src, std::size_t size, char *dst) {
+        auto base = reinterpret_cast<const unsigned char *>(src);
+        auto ip = base;
+        auto anchor = base;
+        auto end = base + size;
+        auto op = reinterpret_cast<unsigned char *>(dst);
+
+        if (size > LZ_LAST_LITERALS + LZ_MIN_MATCH) {
+            // positions + 1, 0 means empty
+            std::uint32_t table[1u << LZ_HASH_BITS] = {0};
+            auto match_limit = end - LZ_LAST_LITERALS;
+
+            while (ip + LZ_MIN_MATCH <= match_limit) {
+                std::uint32_t seq = read32(ip);
+                std::uint32_t h = lz_hash(seq);
+                std::uint32_t candidate = table[h];
+                table[h] = static_cast<std::uint32_t>(ip - base + 1);
+
+                if (candidate == 0
+                    || static_cast<std::size_t>(ip - (base + candidate - 1)) > LZ_MAX_OFFSET
+                    || read32(base + candidate - 1) != seq) {
+                    ++ip;
+                    continue;
+                }
+
+                auto ref = base + candidate - 1;
+                std::size_t len = LZ_MIN_MATCH;
+                while (ip + len < match_limit && ref[len] == ip[len]) {
+                    ++len;
+                }
+
+                op = write_sequence(op, anchor, ip - anchor, ip - ref, len);
+                ip += len;
+                anchor = ip;
+            }
+        }
+
+        op = write_sequence(op, anchor, end - anchor, 0, 0);
+        return op - reinterpret_cast<unsigned char *>(dst);
+    }
+
+    /**
+     * Read an extended length, returns false when running out of input.
+     */
+    static bool read_length(const unsigned char *&ip, const unsigned char *end, std::size_t &len) {
+        unsigned char b;
+        do {
+            if (ip >= end) {
+                return false;
+            }
+            b = *ip++;
+            len += b;
+        } while (b == 255);
+        return true;
+    }
+
+    mpp::ssize_t lz_decompress(const char *src, std::size_t size, char *dst, std::size_t capacity) {
+        auto ip = reinterpret_cast<const unsigned char *>(src);
+        auto iend = ip + size;
+        auto out = reinterpret_cast<unsigned char *>(dst);
+        auto op = out;
+        auto oend = out + capacity;
+
+        while (ip < iend) {
+            unsigned token = *ip++;
+
+            std::size_t lit_len = token >> 4u;
+            if (lit_len == 15 && !read_length(ip, iend, lit_len)) {
+                return -1;
+            }
+            if (lit_len > static_cast<std::size_t>(iend - ip)
+                || lit_len > static_cast<std::size_t>(oend - op)) {
+                return -1;
+            }
+            std::memcpy(op, ip, lit_len);
+            ip += lit_len;
+            op += lit_len;
+
+            if (ip == iend) {
+                // the last sequence
+                break;
+            }
+
+            if (iend - ip < 2) {
+                return -1;
+            }
+            std::size_t offset = ip[0] | (static_cast<std::size_t>(ip[1]) << 8u);
+            ip += 2;
+
+            std::size_t match_len = token & 15u;
+            if (match_len == 15 && !read_length(ip, iend, match_len)) {
+                return -1;
+            }
+            match_len += LZ_MIN_MATCH;
+
+            if (offset == 0 || offset > static_cast<std::size_t>(op - out)
+                || match_len > static_cast<std::size_t>(oend - op)) {
+                return -1;
+            }
+
+            // byte by byte, the match may overlap with itself
+            const unsigned char *ref = op - offset;
+            for (std::size_t i = 0; i < match_len; ++i) {
+                op[i] = ref[i];
+            }
+            op += match_len;
+        }
+        return op - out;
+    }
+}
+
+namespace mpp {
+    compressed_capture::compressed_capture(std::size_t block_size)
+        : _block_size(block_size == 0 ? 64 * 1024 : block_size) {
+    }
+
+    void compressed_capture::seal(const char *data, std::size_t size) {
+        std::size_t offset = _data.size();
+        _data.resize(offset + mpp_impl::lz_compress_bound(size));
+        std::size_t csize = mpp_impl::lz_compress(data, size, &_data[offset]);
+
+        block_info b{static_cast<std::uint64_t>(offset), static_cast<std::uint32_t>(csize),
+                     static_cast<std::uint32_t>(size), false};
+        if (csize >= size) {
+            // incompressible, keep it as is
+            std::memcpy(&_data[offset], data, size);
+            b._size = static_cast<std::uint32_t>(size);
+            b._stored = true;
+        }
+        _data.resize(offset + b._size);
+        _blocks.push_back(b);
+    }
+
+    void compressed_capture::append(const char *data, std::size_t size) {
+        _raw_size += size;
+
+        // fill the pending block first
+        if (!_pending.empty()) {
+            std::size_t n = std::min(size, _block_size - _pending.size());
+            _pending.append(data, n);
+            data += n;
+            size -= n;
+            if (_pending.size() < _block_size) {
+                return;
+            }
+            seal(_pending.data(), _pending.size());
+            _pending.clear();
+        }
+
+        // full blocks go straight from the caller's buffer
+        while (size >= _block_size) {
+            seal(data, _block_size);
+            data += _block_size;
+            size -= _block_size;
+        }
+
+        if (size > 0) {
+            _pending.reserve(_block_size);
+            _pending.append(data, size);
+        }
+    }
+
+    std::size_t compressed_capture::drain(std::istream &in) {
+        std::vector<char> buffer(_block_size);
+        std::size_t total = 0;
+        while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+            auto n = static_cast<std::size_t>(in.gcount());
+            append(buffer.data(), n);
+            total += n;
+        }
+        return total;
+    }
+
+    void compressed_capture::finish() {
+        if (!_pending.empty()) {
+            seal(_pending.data(), _pending.size());
+        }
+        std::string().swap(_pending);
+        _data.shrink_to_fit();
+        _blocks.shrink_to_fit();
+    }
+
+    void compressed_capture::read_block(std::size_t index, std::string &out) const {
+        if (index == _blocks.size() && !_pending.empty()) {
+            out.assign(_pending);
+            return;
+        }
+        if (index >= _blocks.size()) {
+            mpp::throw_ex<mpp::runtime_error>("block index out of range");
+        }
+
+        const block_info &b = _blocks[index];
+        const char *src = _data.data() + b._offset;
+        if (b._stored) {
+            out.assign(src, b._size);
+            return;
+        }
+
+        out.resize(b._raw_size);
+        if (mpp_impl::lz_decompress(src, b._size, &out[0], out.size())
+            != static_cast<mpp::ssize_t>(b._raw_size)) {
+            mpp::throw_ex<mpp::runtime_error>("corrupted compressed block");
+        }
+    }
+
+    std::string compressed_capture::str() const {
+        std::string result;
+        std::string block;
+        result.reserve(static_cast<std::size_t>(_raw_size));
+        for (std::size_t i = 0; i < block_count(); ++i) {
+            read_block(i, block);
+            result += block;
+        }
+        return result;
+    }
+}
@@ -0,0 +1,167 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/drain_loop>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+
+namespace mpp {
+    constexpr double drain_loop::MIN_READ;
+
+    std::size_t drain_loop::add(fd_type out, fd_type err, const drain_options &options) {
+        child_state c;
+        c._priority = options._priority;
+        c._rate = static_cast<double>(options._rate);
+        c._burst = static_cast<double>(options._burst != 0 ? options._burst : options._rate);
+        c._tokens = c._burst;
+        c._refilled = clock::now();
+
+        std::size_t id = _children.size();
+        _children.push_back(c);
+        if (out != FD_INVALID) {
+            _sources.push_back(source{out, id, 1, true});
+            ++_open;
+        }
+        if (err != FD_INVALID) {
+            _sources.push_back(source{err, id, 2, true});
+            ++_open;
+        }
+        return id;
+    }
+
+    bool drain_loop::eligible(const source &s) const {
+        const child_state &c = _children[s._child];
+        return s._open && (c._rate <= 0 || c._tokens >= std::min(c._burst, MIN_READ));
+    }
+
+    bool drain_loop::service(source &s) {
+        child_state &c = _children[s._child];
+        chunk_ref chunk = _pool.acquire();
+        if (!chunk) {
+            _starved = true;
+            return false;
+        }
+
+        std::size_t limit = chunk.capacity();
+        if (c._rate > 0) {
+            limit = std::min(limit, static_cast<std::size_t>(c._tokens));
+            if (limit == 0) {
+                return true;
+            }
+        }
+
+        mpp::ssize_t n = mpp_impl::read_some(s._fd, chunk.data(), limit);
+        if (n <= 0) {
+            s._open = false;
+            --_open;
+            _handler(s._child, s._stream, chunk_ref());
+            return true;
+        }
+
+        c._tokens -= static_cast<double>(n);
+        chunk.resize(static_cast<std::size_t>(n));
+        _handler(s._child, s._stream, std::move(chunk));
+        return true;
+    }
+
+    void drain_loop::service_high() {
+        _high._sources.clear();
+        _high._fds.clear();
+        for (std::size_t i = 0; i < _sources.size(); ++i) {
+            if (_children[_sources[i]._child]._priority == drain_priority::high && eligible(_sources[i])) {
+                _high._sources.push_back(i);
+                _high._fds.push_back(_sources[i]._fd);
+            }
+        }
+        if (_high._sources.empty()
+            || mpp_impl::wait_readable(_high._fds, _high._ready, 0) <= 0) {
+            return;
+        }
+        for (std::size_t i = 0; i < _high._sources.size(); ++i) {
+            if (_high._ready[i] && !service(_sources[_high._sources[i]])) {
+                return;
+            }
+        }
+    }
+
+    bool drain_loop::run_once(std::chrono::milliseconds timeout) {
+        if (_open == 0) {
+            return false;
+        }
+
+        auto now = clock::now();
+        long long wait_ms = timeout.count() < 0 ? -1 : timeout.count();
+        for (auto &c : _children) {
+            if (c._rate > 0) {
+                double elapsed = std::chrono::duration<double>(now - c._refilled).count();
+                c._tokens = std::min(c._burst, c._tokens + elapsed * c._rate);
+            }
+            c._refilled = now;
+        }
+
+        _round._sources.clear();
+        _round._fds.clear();
+        for (std::size_t i = 0; i < _sources.size(); ++i) {
+            const source &s = _sources[i];
+            if (!s._open) {
+                continue;
+            }
+            if (eligible(s)) {
+                _round._sources.push_back(i);
+                _round._fds.push_back(s._fd);
+                continue;
+            }
+
+            // wake up when the bucket allows reading again
+            const child_state &c = _children[s._child];
+            auto refill_ms = static_cast<long long>(
+                std::ceil((std::min(c._burst, MIN_READ) - c._tokens) / c._rate * 1000));
+            refill_ms = std::max<long long>(refill_ms, 1);
+            wait_ms = wait_ms < 0 ? refill_ms : std::min(wait_ms, refill_ms);
+        }
+
+        if (_starved) {
+            // consumers hold every chunk, give them a moment
+            _starved = false;
+            wait_ms = wait_ms < 0 ? 1 : std::min<long long>(wait_ms, 1);
+            std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+            return true;
+        }
+
+        if (_round._sources.empty()) {
+            if (wait_ms > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+            }
+            return true;
+        }
+
+        if (mpp_impl::wait_readable(_round._fds, _round._ready,
+                                    static_cast<int>(std::min<long long>(wait_ms, INT32_MAX))) <= 0) {
+            return true;
+        }
+
+        // high priority first, and again before every other read
+        for (auto priority : {drain_priority::high, drain_priority::normal, drain_priority::low}) {
+            for (std::size_t i = 0; i < _round._sources.size(); ++i) {
+                source &s = _sources[_round._sources[i]];
+                if (!_round._ready[i] || _children[s._child]._priority != priority) {
+                    continue;
+                }
+                if (priority != drain_priority::high) {
+                    service_high();
+                }
+                if (s._open && !service(s)) {
+                    return true;
+                }
+            }
+        }
+        return _open != 0;
+    }
+}
@@ -0,0 +1,115 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/jobserver>
+#include <cstdlib>
+
+namespace mpp_impl {
+    bool parse_makeflags(const std::string &makeflags, std::string &auth, std::size_t &slots) {
+        bool found = false;
+        slots = 0;
+        for (std::size_t pos = 0; pos < makeflags.size();) {
+            std::size_t end = makeflags.find(' ', pos);
+            if (end == std::string::npos) {
+                end = makeflags.size();
+            }
+            std::string word = makeflags.substr(pos, end - pos);
+            pos = end + 1;
+
+            // --jobserver-fds is what make before 4.2 wrote
+            for (const char *prefix : {"--jobserver-auth=", "--jobserver-fds="}) {
+                std::size_t n = std::char_traits<char>::length(prefix);
+                if (word.compare(0, n, prefix) == 0) {
+                    auth = word.substr(n);
+                    found = true;
+                }
+            }
+            if (word.size() > 2 && word.compare(0, 2, "-j") == 0) {
+                slots = std::strtoul(word.c_str() + 2, nullptr, 10);
+            }
+        }
+        return found;
+    }
+
+    std::shared_ptr<mpp::jobserver_token> acquire_job_token(mpp::jobserver &server) {
+        auto token = std::make_shared<mpp::jobserver_token>(server.acquire());
+        if (!*token) {
+            mpp::throw_ex<mpp::runtime_error>("unable to acquire jobserver slot");
+        }
+        return token;
+    }
+}
+
+namespace mpp {
+    jobserver_token::jobserver_token(jobserver_token &&other) noexcept
+        : _server(std::move(other._server)), _byte(other._byte), _implicit(other._implicit) {}
+
+    jobserver_token &jobserver_token::operator=(jobserver_token &&other) noexcept {
+        if (this != &other) {
+            release();
+            _server = std::move(other._server);
+            _byte = other._byte;
+            _implicit = other._implicit;
+        }
+        return *this;
+    }
+
+    void jobserver_token::release() {
+        if (!_server) {
+            return;
+        }
+        if (_implicit) {
+            _server->_implicit_free = true;
+            _server->wake();
+        } else {
+            _server->write_token(_byte);
+        }
+        _server.reset();
+    }
+
+    jobserver_token jobserver::acquire(std::chrono::milliseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            // a wakeup coming after the check below is not lost
+            drain_wake();
+            bool expected = true;
+            if (_implicit_free.compare_exchange_strong(expected, false)) {
+                return jobserver_token(shared_from_this(), 0, true);
+            }
+
+            int wait_ms = -1;
+            if (timeout.count() >= 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                wait_ms = left > 0 ? static_cast<int>(left) : 0;
+            }
+
+            char byte = 0;
+            switch (read_token(byte, wait_ms)) {
+                case 1:
+                    return jobserver_token(shared_from_this(), byte, false);
+                case 0:
+                    return jobserver_token();
+                case 2:
+                    continue;
+                default:
+                    mpp::throw_ex<mpp::runtime_error>("unable to read from jobserver");
+            }
+        }
+    }
+
+    std::string jobserver::makeflags() const {
+        std::string flags = _slots > 0 ? "-j" + std::to_string(_slots) : "-j";
+        if (_fifo.empty()) {
+            flags += " --jobserver-auth=" + std::to_string(_read) + "," + std::to_string(_write);
+        } else {
+            flags += " --jobserver-auth=fifo:" + _fifo;
+        }
+        return flags;
+    }
+}
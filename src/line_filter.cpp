@@ -0,0 +1,244 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/line_filter>
+#include <algorithm>
+#include <cstring>
+#include <streambuf>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace mpp_impl {
+    std::size_t find_literal(const char *haystack, std::size_t size,
+                             const char *needle, std::size_t needle_size) {
+        if (needle_size == 0) {
+            return 0;
+        }
+        if (needle_size > size) {
+            return size;
+        }
+
+        std::size_t last = size - needle_size;
+        std::size_t i = 0;
+
+#ifdef __SSE2__
+        // compare the first and the last byte of the needle at 16 positions
+        // at once, only verify positions where both of them match.
+        const __m128i first = _mm_set1_epi8(needle[0]);
+        const __m128i tail = _mm_set1_epi8(needle[needle_size - 1]);
+
+        for (; i + 16 <= last + 1; i += 16) {
+            __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(haystack + i));
+            __m128i block_last = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(haystack + i + needle_size - 1));
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, tail))));
+
+            while (mask != 0) {
+                unsigned bit = __builtin_ctz(mask);
+                if (std::memcmp(haystack + i + bit + 1, needle + 1, needle_size - 1) == 0) {
+                    return i + bit;
+                }
+                mask &= mask - 1;
+            }
+        }
+#endif
+
+        for (; i <= last; ++i) {
+            const void *p = std::memchr(haystack + i, needle[0], last - i + 1);
+            if (p == nullptr) {
+                break;
+            }
+            i = static_cast<const char *>(p) - haystack;
+            if (std::memcmp(haystack + i + 1, needle + 1, needle_size - 1) == 0) {
+                return i;
+            }
+        }
+        return size;
+    }
+
+    /**
+     * Reads raw chunks from fd and exposes the selected lines.
+     */
+    class filter_inbuf : public std::streambuf {
+    private:
+        static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+        fd_type _fd;
+        std::shared_ptr<const mpp::line_filter> _filter;
+
+        /**
+         * Raw bytes: an incomplete line followed by the last chunk read.
+         */
+        std::vector<char> _raw;
+        std::size_t _raw_size = 0;
+        std::string _out;
+        bool _eof = false;
+
+    protected:
+        int_type underflow() override {
+            if (gptr() < egptr()) {
+                return traits_type::to_int_type(*gptr());
+            }
+
+            _out.clear();
+            while (_out.empty() && !_eof) {
+                if (_raw.size() - _raw_size < CHUNK_SIZE) {
+                    // a long line is still incomplete
+                    _raw.resize(_raw_size + CHUNK_SIZE);
+                }
+
+                mpp::ssize_t n = read_some(_fd, _raw.data() + _raw_size, CHUNK_SIZE);
+                if (n <= 0) {
+                    // the last line may be without newline
+                    _eof = true;
+                    _filter->apply(_raw.data(), _raw_size, _out);
+                    _raw_size = 0;
+                    break;
+                }
+
+                std::size_t scanned = _raw_size;
+                _raw_size += static_cast<std::size_t>(n);
+
+                // only complete lines are filtered, newlines of
+                // the incomplete one were scanned in previous rounds
+                const char *begin = _raw.data();
+                const char *end = begin + _raw_size;
+                const char *last_newline = nullptr;
+                for (const char *p = end; p > begin + scanned;) {
+                    --p;
+                    if (*p == '\n') {
+                        last_newline = p;
+                        break;
+                    }
+                }
+                if (last_newline == nullptr) {
+                    continue;
+                }
+
+                std::size_t complete = last_newline - begin + 1;
+                _filter->apply(begin, complete, _out);
+                std::memmove(_raw.data(), begin + complete, _raw_size - complete);
+                _raw_size -= complete;
+            }
+
+            if (_out.empty()) {
+                return traits_type::eof();
+            }
+            setg(&_out[0], &_out[0], &_out[0] + _out.size());
+            return traits_type::to_int_type(*gptr());
+        }
+
+    public:
+        filter_inbuf(fd_type fd, std::shared_ptr<const mpp::line_filter> filter)
+            : _fd(fd), _filter(std::move(filter)), _raw(CHUNK_SIZE) {}
+    };
+
+    std::unique_ptr<std::streambuf> make_filter_buf(fd_type fd, std::shared_ptr<const mpp::line_filter> filter) {
+        return std::make_unique<filter_inbuf>(fd, std::move(filter));
+    }
+}
+
+namespace mpp {
+    bool line_filter::match(const char *line, std::size_t size) const {
+        bool matched = false;
+        switch (_kind) {
+            case kind::contains:
+                for (const auto &l : _literals) {
+                    if (l.empty() || mpp_impl::find_literal(line, size, l.data(), l.size()) != size) {
+                        matched = true;
+                        break;
+                    }
+                }
+                break;
+            case kind::prefix:
+                for (const auto &l : _literals) {
+                    if (l.size() <= size && std::memcmp(line, l.data(), l.size()) == 0) {
+                        matched = true;
+                        break;
+                    }
+                }
+                break;
+            case kind::regex:
+                matched = std::regex_search(line, line + size, *_regex);
+                break;
+        }
+        return matched != _discard;
+    }
+
+    std::size_t line_filter::filter_contains(const char *data, std::size_t size, std::string &out) const {
+        // next hit of every literal, searched over the whole buffer
+        // instead of line by line, so lines between hits cost nothing.
+        // literals with a newline never match a line, leave them out.
+        std::vector<const std::string *> literals;
+        for (const auto &l : _literals) {
+            if (l.find('\n') == std::string::npos) {
+                literals.push_back(&l);
+            }
+        }
+        std::vector<std::size_t> hits(literals.size(), 0);
+        std::vector<bool> searched(literals.size(), false);
+        std::size_t selected = 0;
+        std::size_t cursor = 0;
+
+        while (cursor < size) {
+            std::size_t hit = size;
+            for (std::size_t i = 0; i < literals.size(); ++i) {
+                if (!searched[i] || hits[i] < cursor) {
+                    const std::string &l = *literals[i];
+                    hits[i] = cursor + mpp_impl::find_literal(data + cursor, size - cursor, l.data(), l.size());
+                    searched[i] = true;
+                }
+                hit = std::min(hit, hits[i]);
+            }
+
+            // the line containing the hit
+            std::size_t line_begin = hit;
+            while (hit < size && line_begin > cursor && data[line_begin - 1] != '\n') {
+                --line_begin;
+            }
+            const void *nl = hit < size ? std::memchr(data + hit, '\n', size - hit) : nullptr;
+            std::size_t line_end = nl ? static_cast<const char *>(nl) - data + 1 : size;
+
+            if (_discard) {
+                // lines before the matching one are selected
+                for (std::size_t p = cursor; p < line_begin;) {
+                    const void *e = std::memchr(data + p, '\n', line_begin - p);
+                    p = e ? static_cast<const char *>(e) - data + 1 : line_begin;
+                    ++selected;
+                }
+                out.append(data + cursor, line_begin - cursor);
+            } else if (hit < size) {
+                out.append(data + line_begin, line_end - line_begin);
+                ++selected;
+            }
+            cursor = line_end;
+        }
+        return selected;
+    }
+
+    std::size_t line_filter::apply(const char *data, std::size_t size, std::string &out) const {
+        if (_kind == kind::contains) {
+            return filter_contains(data, size, out);
+        }
+
+        std::size_t selected = 0;
+        for (std::size_t pos = 0; pos < size;) {
+            const void *nl = std::memchr(data + pos, '\n', size - pos);
+            std::size_t end = nl ? static_cast<const char *>(nl) - data : size;
+            if (match(data + pos, end - pos)) {
+                out.append(data + pos, (nl ? end + 1 : end) - pos);
+                ++selected;
+            }
+            pos = nl ? end + 1 : size;
+        }
+        return selected;
+    }
+}
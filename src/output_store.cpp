@@ -0,0 +1,561 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/output_store>
+#include <mozart++/process_trace>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+namespace mpp_impl {
+    static constexpr char OUTPUT_DATA_MAGIC[4] = {'M', 'P', 'P', 'O'};
+    static constexpr char OUTPUT_INDEX_MAGIC[4] = {'M', 'P', 'P', 'X'};
+    static constexpr std::uint8_t OUTPUT_STORE_VERSION = 1;
+
+    /**
+     * Trigrams of a writer are deduplicated when that many piled up.
+     */
+    static constexpr std::size_t TRIGRAM_COMPACT = 64 * 1024;
+
+    /**
+     * Output a writer keeps in memory before spooling to a file.
+     */
+    static constexpr std::size_t SPOOL_THRESHOLD = 1024 * 1024;
+
+    static inline std::uint32_t trigram(const char *p) {
+        return static_cast<std::uint32_t>(static_cast<unsigned char>(p[0])) << 16u
+               | static_cast<std::uint32_t>(static_cast<unsigned char>(p[1])) << 8u
+               | static_cast<unsigned char>(p[2]);
+    }
+
+    static void sort_unique(std::vector<std::uint32_t> &v) {
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    }
+
+    static void collect_trigrams(const std::string &data, std::vector<std::uint32_t> &out) {
+        for (std::size_t i = 0; i + 2 < data.size(); ++i) {
+            out.push_back(trigram(data.data() + i));
+        }
+    }
+
+    static void put_varint(std::string &out, std::uint64_t value) {
+        do {
+            unsigned char byte = value & 0x7fu;
+            value >>= 7u;
+            out.push_back(static_cast<char>(value != 0 ? (byte | 0x80u) : byte));
+        } while (value != 0);
+    }
+
+    static bool get_varint(const char *&p, const char *end, std::uint64_t &value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64 && p < end; shift += 7) {
+            auto c = static_cast<unsigned char>(*p++);
+            value |= static_cast<std::uint64_t>(c & 0x7fu) << shift;
+            if ((c & 0x80u) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool read_string(std::FILE *fp, std::string &s) {
+        std::uint64_t size = 0;
+        if (!read_varint(fp, size) || size > (1u << 20u)) {
+            return false;
+        }
+        s.resize(size);
+        return std::fread(&s[0], 1, size, fp) == size;
+    }
+
+    static bool file_exists(const std::string &path) {
+        std::FILE *fp = std::fopen(path.c_str(), "rb");
+        if (fp != nullptr) {
+            std::fclose(fp);
+        }
+        return fp != nullptr;
+    }
+}
+
+namespace mpp {
+    using namespace mpp_impl;
+
+    output_store::writer::writer(writer &&other) noexcept
+        : _store(other._store), _key(std::move(other._key)), _stream(other._stream),
+          _data(std::move(other._data)), _spool(other._spool), _size(other._size),
+          _carry(std::move(other._carry)), _trigrams(std::move(other._trigrams)) {
+        other._store = nullptr;
+        other._spool = nullptr;
+    }
+
+    output_store::writer::~writer() {
+        try {
+            finish();
+        } catch (...) {
+            // see finish()
+        }
+        if (_spool != nullptr) {
+            std::fclose(_spool);
+        }
+    }
+
+    void output_store::writer::append(const char *data, std::size_t size) {
+        if (size == 0) {
+            return;
+        }
+
+        // trigrams starting in the last bytes of previous appends
+        char joined[4];
+        std::size_t n = _carry.size();
+        std::memcpy(joined, _carry.data(), n);
+        std::size_t head = std::min<std::size_t>(size, 2);
+        std::memcpy(joined + n, data, head);
+        for (std::size_t i = 0; i < n && i + 2 < n + head; ++i) {
+            _trigrams.push_back(trigram(joined + i));
+        }
+        for (std::size_t i = 0; i + 2 < size; ++i) {
+            _trigrams.push_back(trigram(data + i));
+        }
+        if (size >= 2) {
+            _carry.assign(data + size - 2, 2);
+        } else {
+            _carry.append(data, size);
+            if (_carry.size() > 2) {
+                _carry.erase(0, _carry.size() - 2);
+            }
+        }
+        if (_trigrams.size() >= TRIGRAM_COMPACT) {
+            sort_unique(_trigrams);
+        }
+
+        _data.append(data, size);
+        _size += size;
+        if (_data.size() >= SPOOL_THRESHOLD) {
+            spool();
+        }
+    }
+
+    void output_store::writer::spool() {
+        if (_spool == nullptr) {
+            _spool = std::tmpfile();
+            if (_spool == nullptr) {
+                mpp::throw_ex<mpp::runtime_error>("output_store: unable to create spool file");
+            }
+        }
+        if (std::fwrite(_data.data(), 1, _data.size(), _spool) != _data.size()) {
+            mpp::throw_ex<mpp::runtime_error>("output_store: unable to write spool file");
+        }
+        _data.clear();
+    }
+
+    std::size_t output_store::writer::drain(std::istream &in) {
+        char buf[64 * 1024];
+        std::size_t total = 0;
+        while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+            auto n = static_cast<std::size_t>(in.gcount());
+            append(buf, n);
+            total += n;
+        }
+        return total;
+    }
+
+    void output_store::writer::finish() {
+        if (_store == nullptr) {
+            return;
+        }
+        output_store *s = _store;
+        _store = nullptr;
+        sort_unique(_trigrams);
+        s->store(*this);
+        _data.clear();
+        _data.shrink_to_fit();
+        _trigrams.clear();
+        _trigrams.shrink_to_fit();
+        if (_spool != nullptr) {
+            std::fclose(_spool);
+            _spool = nullptr;
+        }
+    }
+
+    output_store::output_store(const std::string &dir, std::uint64_t segment_size)
+        : _dir(dir), _segment_size(segment_size) {
+        for (std::size_t i = 0; file_exists(segment_path(i, ".data")); ++i) {
+            load(i);
+        }
+
+        // an empty segment left behind is reused
+        if (!_segments.empty() && _segments.back()._outputs.empty()) {
+            std::remove(segment_path(_segments.size() - 1, ".index").c_str());
+            _segments.pop_back();
+        }
+        start_segment();
+    }
+
+    output_store::~output_store() {
+        if (_out != nullptr) {
+            if (!_segments.back()._outputs.empty()) {
+                try {
+                    seal_active();
+                } catch (...) {
+                    // indexed again when opened
+                }
+            }
+            if (_out != nullptr) {
+                std::fclose(_out);
+            }
+        }
+    }
+
+    std::string output_store::segment_path(std::size_t index, const char *suffix) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/seg-%06zu", index);
+        return _dir + name + suffix;
+    }
+
+    void output_store::load(std::size_t index) {
+        _segments.emplace_back();
+        segment &s = _segments.back();
+        s._data_path = segment_path(index, ".data");
+
+        std::string index_path = segment_path(index, ".index");
+        std::FILE *fp = std::fopen(index_path.c_str(), "rb");
+        if (fp != nullptr) {
+            std::string data;
+            char buf[64 * 1024];
+            for (std::size_t n; (n = std::fread(buf, 1, sizeof(buf), fp)) > 0;) {
+                data.append(buf, n);
+            }
+            std::fclose(fp);
+
+            const char *p = data.data();
+            const char *end = p + data.size();
+            std::uint64_t count = 0;
+            bool ok = data.size() > 5 && std::memcmp(p, OUTPUT_INDEX_MAGIC, 4) == 0
+                      && static_cast<std::uint8_t>(p[4]) == OUTPUT_STORE_VERSION;
+            p += 5;
+            ok = ok && get_varint(p, end, count);
+            for (std::uint64_t i = 0; ok && i < count; ++i) {
+                output_info o;
+                std::uint64_t key_size = 0;
+                ok = get_varint(p, end, o._offset) && get_varint(p, end, o._size)
+                     && get_varint(p, end, key_size) && key_size < static_cast<std::uint64_t>(end - p);
+                if (ok) {
+                    o._key.assign(p, key_size);
+                    p += key_size;
+                    o._stream = static_cast<unsigned char>(*p++);
+                    s._outputs.push_back(std::move(o));
+                }
+            }
+
+            std::uint64_t trigrams = 0;
+            ok = ok && get_varint(p, end, trigrams);
+            std::uint64_t t = 0;
+            for (std::uint64_t i = 0; ok && i < trigrams; ++i) {
+                std::uint64_t delta = 0;
+                std::uint64_t size = 0;
+                ok = get_varint(p, end, delta) && get_varint(p, end, size)
+                     && size <= static_cast<std::uint64_t>(end - p);
+                if (ok) {
+                    t += delta;
+                    s._trigrams.push_back(static_cast<std::uint32_t>(t));
+                    s._starts.push_back(static_cast<std::uint32_t>(s._postings.size()));
+                    s._postings.append(p, size);
+                    p += size;
+                }
+            }
+            s._starts.push_back(static_cast<std::uint32_t>(s._postings.size()));
+
+            if (ok) {
+                _output_count += s._outputs.size();
+                return;
+            }
+            // a broken index is rebuilt
+            s._outputs.clear();
+            s._trigrams.clear();
+            s._starts.clear();
+            s._postings.clear();
+        }
+
+        // no index: read the outputs back, up to a torn one
+        fp = std::fopen(s._data_path.c_str(), "rb");
+        char magic[5];
+        if (fp == nullptr || std::fread(magic, 1, 5, fp) != 5 || std::memcmp(magic, OUTPUT_DATA_MAGIC, 4) != 0) {
+            if (fp != nullptr) {
+                std::fclose(fp);
+            }
+            mpp::throw_ex<mpp::runtime_error>("output_store: bad segment " + s._data_path);
+        }
+        std::string key;
+        std::string data;
+        while (true) {
+            int stream = 0;
+            std::uint64_t size = 0;
+            if (!read_string(fp, key) || (stream = std::fgetc(fp)) == EOF || !read_varint(fp, size)) {
+                break;
+            }
+            long offset = std::ftell(fp);
+            data.resize(size);
+            if (size > 0 && std::fread(&data[0], 1, size, fp) != size) {
+                break;
+            }
+            std::vector<std::uint32_t> trigrams;
+            collect_trigrams(data, trigrams);
+            sort_unique(trigrams);
+            auto id = static_cast<std::uint32_t>(s._outputs.size());
+            for (std::uint32_t t : trigrams) {
+                s._active[t].push_back(id);
+            }
+            s._outputs.push_back(output_info{static_cast<std::uint64_t>(offset), size, key, stream});
+            s._size = static_cast<std::uint64_t>(offset) + size;
+        }
+        std::fclose(fp);
+
+        // appending after a torn output would hide later ones, so seal it
+        _output_count += s._outputs.size();
+        _out = nullptr;
+        if (!s._outputs.empty()) {
+            seal_active();
+        }
+    }
+
+    void output_store::start_segment() {
+        std::size_t index = _segments.size();
+        _segments.emplace_back();
+        segment &s = _segments.back();
+        s._data_path = segment_path(index, ".data");
+        _out = std::fopen(s._data_path.c_str(), "wb");
+        if (_out == nullptr) {
+            mpp::throw_ex<mpp::runtime_error>("output_store: unable to create " + s._data_path);
+        }
+        std::fwrite(OUTPUT_DATA_MAGIC, 1, 4, _out);
+        std::fputc(OUTPUT_STORE_VERSION, _out);
+        std::fflush(_out);
+        s._size = 5;
+    }
+
+    void output_store::seal_active() {
+        segment &s = _segments.back();
+        std::size_t index = _segments.size() - 1;
+
+        std::vector<std::uint32_t> keys;
+        keys.reserve(s._active.size());
+        for (const auto &e : s._active) {
+            keys.push_back(e.first);
+        }
+        std::sort(keys.begin(), keys.end());
+
+        std::string index_data(OUTPUT_INDEX_MAGIC, 4);
+        index_data.push_back(static_cast<char>(OUTPUT_STORE_VERSION));
+        put_varint(index_data, s._outputs.size());
+        for (const auto &o : s._outputs) {
+            put_varint(index_data, o._offset);
+            put_varint(index_data, o._size);
+            put_varint(index_data, o._key.size());
+            index_data += o._key;
+            index_data.push_back(static_cast<char>(o._stream));
+        }
+
+        put_varint(index_data, keys.size());
+        std::string list;
+        std::uint32_t previous = 0;
+        for (std::uint32_t t : keys) {
+            list.clear();
+            std::uint32_t last = 0;
+            for (std::uint32_t id : s._active[t]) {
+                put_varint(list, id - last);
+                last = id;
+            }
+            put_varint(index_data, t - previous);
+            put_varint(index_data, list.size());
+            previous = t;
+
+            s._trigrams.push_back(t);
+            s._starts.push_back(static_cast<std::uint32_t>(s._postings.size()));
+            s._postings += list;
+            index_data += list;
+        }
+        s._starts.push_back(static_cast<std::uint32_t>(s._postings.size()));
+        s._active.clear();
+
+        // renamed when complete, a torn index is never loaded
+        std::string path = segment_path(index, ".index");
+        std::string tmp = path + ".tmp";
+        std::FILE *fp = std::fopen(tmp.c_str(), "wb");
+        bool ok = fp != nullptr && std::fwrite(index_data.data(), 1, index_data.size(), fp) == index_data.size();
+        ok = fp != nullptr && std::fclose(fp) == 0 && ok;
+        if (_out != nullptr) {
+            std::fclose(_out);
+            _out = nullptr;
+        }
+        if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            mpp::throw_ex<mpp::runtime_error>("output_store: unable to write " + path);
+        }
+    }
+
+    void output_store::store(writer &w) {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_out == nullptr) {
+            // sealing failed before
+            start_segment();
+        } else if (!_segments.back()._outputs.empty()
+            && _segments.back()._size + w._size > _segment_size) {
+            seal_active();
+            start_segment();
+        }
+
+        segment &s = _segments.back();
+        write_varint(_out, w._key.size());
+        std::fwrite(w._key.data(), 1, w._key.size(), _out);
+        std::fputc(w._stream, _out);
+        write_varint(_out, w._size);
+        long offset = std::ftell(_out);
+        bool ok = offset >= 0;
+        if (w._spool != nullptr) {
+            // spooled first, the rest is still in memory
+            char buf[64 * 1024];
+            std::rewind(w._spool);
+            for (std::size_t n; ok && (n = std::fread(buf, 1, sizeof(buf), w._spool)) > 0;) {
+                ok = std::fwrite(buf, 1, n, _out) == n;
+            }
+        }
+        ok = ok && std::fwrite(w._data.data(), 1, w._data.size(), _out) == w._data.size();
+        if (std::fflush(_out) != 0 || !ok) {
+            mpp::throw_ex<mpp::runtime_error>("output_store: unable to write " + s._data_path);
+        }
+
+        auto id = static_cast<std::uint32_t>(s._outputs.size());
+        for (std::uint32_t t : w._trigrams) {
+            s._active[t].push_back(id);
+        }
+        s._outputs.push_back(output_info{static_cast<std::uint64_t>(offset), w._size, w._key, w._stream});
+        s._size = static_cast<std::uint64_t>(offset) + w._size;
+        ++_output_count;
+    }
+
+    std::vector<std::uint32_t> output_store::candidates(const segment &s,
+                                                        const std::vector<std::uint32_t> &trigrams) const {
+        std::vector<std::vector<std::uint32_t>> lists;
+        for (std::uint32_t t : trigrams) {
+            lists.emplace_back();
+            std::vector<std::uint32_t> &list = lists.back();
+            if (s._trigrams.empty()) {
+                auto it = s._active.find(t);
+                if (it != s._active.end()) {
+                    list = it->second;
+                }
+            } else {
+                auto it = std::lower_bound(s._trigrams.begin(), s._trigrams.end(), t);
+                if (it != s._trigrams.end() && *it == t) {
+                    std::size_t i = it - s._trigrams.begin();
+                    const char *p = s._postings.data() + s._starts[i];
+                    const char *end = s._postings.data() + s._starts[i + 1];
+                    std::uint64_t id = 0;
+                    for (std::uint64_t delta; get_varint(p, end, delta);) {
+                        id += delta;
+                        list.push_back(static_cast<std::uint32_t>(id));
+                    }
+                }
+            }
+            if (list.empty()) {
+                return {};
+            }
+        }
+
+        // shortest lists first, the intersection only shrinks
+        std::sort(lists.begin(), lists.end(),
+                  [](const std::vector<std::uint32_t> &a, const std::vector<std::uint32_t> &b) {
+                      return a.size() < b.size();
+                  });
+        std::vector<std::uint32_t> result = std::move(lists.front());
+        std::vector<std::uint32_t> next;
+        for (std::size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+            next.clear();
+            std::set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(),
+                                  std::back_inserter(next));
+            result.swap(next);
+        }
+        return result;
+    }
+
+    std::vector<output_match> output_store::search(const std::string &needle, std::size_t limit) const {
+        std::vector<output_match> matches;
+        if (needle.empty() || limit == 0) {
+            return matches;
+        }
+        std::vector<std::uint32_t> trigrams;
+        collect_trigrams(needle, trigrams);
+        sort_unique(trigrams);
+
+        std::lock_guard<std::mutex> guard(_lock);
+        std::string data;
+        for (const auto &s : _segments) {
+            std::vector<std::uint32_t> ids;
+            if (trigrams.empty()) {
+                // too short to be indexed
+                for (std::uint32_t i = 0; i < s._outputs.size(); ++i) {
+                    ids.push_back(i);
+                }
+            } else {
+                ids = candidates(s, trigrams);
+            }
+            if (ids.empty()) {
+                continue;
+            }
+
+            std::FILE *fp = std::fopen(s._data_path.c_str(), "rb");
+            if (fp == nullptr) {
+                continue;
+            }
+            for (std::uint32_t id : ids) {
+                const output_info &o = s._outputs[id];
+                data.resize(o._size);
+                if (std::fseek(fp, static_cast<long>(o._offset), SEEK_SET) != 0
+                    || (o._size > 0 && std::fread(&data[0], 1, o._size, fp) != o._size)) {
+                    continue;
+                }
+                for (std::size_t pos = data.find(needle); pos != std::string::npos;) {
+                    std::size_t begin = data.rfind('\n', pos);
+                    begin = begin == std::string::npos ? 0 : begin + 1;
+                    std::size_t end = data.find('\n', pos);
+                    end = end == std::string::npos ? data.size() : end;
+                    matches.push_back(output_match{o._key, o._stream, begin, data.substr(begin, end - begin)});
+                    if (matches.size() >= limit) {
+                        std::fclose(fp);
+                        return matches;
+                    }
+                    // one match per line
+                    pos = end < data.size() ? data.find(needle, end + 1) : std::string::npos;
+                }
+            }
+            std::fclose(fp);
+        }
+        return matches;
+    }
+
+    void output_store::seal() {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_out != nullptr && _segments.back()._outputs.empty()) {
+            return;
+        }
+        if (_out != nullptr) {
+            seal_active();
+        }
+        start_segment();
+    }
+
+    std::size_t output_store::segment_count() const {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _segments.size();
+    }
+
+    std::uint64_t output_store::output_count() const {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _output_count;
+    }
+}
@@ -0,0 +1,213 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/pressure_monitor>
+
+#ifdef MOZART_PLATFORM_LINUX
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#endif
+
+namespace mpp {
+    std::size_t pressure_monitor::shed(pressure_resource resource) {
+        settings s = current();
+        std::size_t count = s._action == shed_action::suspend
+                            ? mpp_impl::shed_low_priority(this)
+                            : terminate_low_priority(s._force);
+        if (count > 0 && s._callback) {
+            s._callback(resource, count);
+        }
+        return count;
+    }
+
+#ifdef MOZART_PLATFORM_LINUX
+
+    /**
+     * Written to the wakeup pipe, other bytes are reported stalls:
+     * 1 + the resource.
+     */
+    static constexpr char WAKEUP_STOP = 0;
+
+    static const char *pressure_file(pressure_resource resource) {
+        switch (resource) {
+            case pressure_resource::cpu:
+                return "/proc/pressure/cpu";
+            case pressure_resource::memory:
+                return "/proc/pressure/memory";
+            case pressure_resource::io:
+            default:
+                return "/proc/pressure/io";
+        }
+    }
+
+    void pressure_monitor::start() {
+        if (running()) {
+            return;
+        }
+
+        for (auto &t : _triggers) {
+            t._fd = open(pressure_file(t._resource), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            if (t._fd == -1) {
+                int err = errno;
+                close_triggers();
+                mpp::throw_ex<mpp::runtime_error>(std::string("unable to open pressure file: ") + strerror(err));
+            }
+
+            // the trigger lives as long as the file stays open
+            std::string spec = "some " + std::to_string(t._stall_us)
+                               + " " + std::to_string(t._window_us);
+            if (write(t._fd, spec.c_str(), spec.size() + 1) < 0) {
+                int err = errno;
+                close_triggers();
+                mpp::throw_ex<mpp::runtime_error>(std::string("unable to register pressure trigger: ") + strerror(err));
+            }
+        }
+
+        if (pipe2(_wakeup, O_CLOEXEC) != 0) {
+            close_triggers();
+            mpp::throw_ex<mpp::runtime_error>("unable to create wakeup pipe");
+        }
+
+        try {
+            _thread = std::thread([this]() { run(); });
+        } catch (...) {
+            close(_wakeup[0]);
+            close(_wakeup[1]);
+            _wakeup[0] = _wakeup[1] = -1;
+            close_triggers();
+            throw;
+        }
+    }
+
+    void pressure_monitor::stop() {
+        if (!running()) {
+            return;
+        }
+
+        char c = WAKEUP_STOP;
+        while (write(_wakeup[1], &c, 1) == -1 && errno == EINTR) {
+            // retry
+        }
+        _thread.join();
+
+        close(_wakeup[0]);
+        close(_wakeup[1]);
+        _wakeup[0] = _wakeup[1] = -1;
+        close_triggers();
+    }
+
+    void pressure_monitor::report_stall(pressure_resource resource) {
+        if (!running()) {
+            shed(resource);
+            return;
+        }
+        char c = static_cast<char>(1 + static_cast<int>(resource));
+        while (write(_wakeup[1], &c, 1) == -1 && errno == EINTR) {
+            // retry
+        }
+    }
+
+    void pressure_monitor::close_triggers() {
+        for (auto &t : _triggers) {
+            if (t._fd != -1) {
+                close(t._fd);
+                t._fd = -1;
+            }
+        }
+    }
+
+    void pressure_monitor::run() {
+        using clock = std::chrono::steady_clock;
+
+        std::vector<pollfd> fds(_triggers.size() + 1);
+        for (std::size_t i = 0; i < _triggers.size(); ++i) {
+            fds[i].fd = _triggers[i]._fd;
+            fds[i].events = POLLPRI;
+        }
+        fds.back().fd = _wakeup[0];
+        fds.back().events = POLLIN;
+
+        bool shedding = false;
+        clock::time_point last_stall;
+        auto on_stall = [&](pressure_resource resource) {
+            shed(resource);
+            shedding = current()._action == shed_action::suspend;
+            last_stall = clock::now();
+        };
+
+        while (true) {
+            int timeout = -1;
+            auto resume_after = current()._resume_after;
+            if (shedding && resume_after.count() > 0) {
+                auto quiet = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - last_stall);
+                timeout = static_cast<int>(std::max<long long>(0, (resume_after - quiet).count()));
+            }
+
+            int n = poll(fds.data(), fds.size(), timeout);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+
+            if (n == 0) {
+                // quiet for long enough
+                mpp_impl::resume_shed(this);
+                shedding = false;
+                continue;
+            }
+
+            if (fds.back().revents != 0) {
+                char buf[64];
+                ssize_t count = read(_wakeup[0], buf, sizeof(buf));
+                for (ssize_t i = 0; i < count; ++i) {
+                    if (buf[i] == WAKEUP_STOP) {
+                        return;
+                    }
+                    on_stall(static_cast<pressure_resource>(buf[i] - 1));
+                }
+            }
+
+            for (std::size_t i = 0; i < _triggers.size(); ++i) {
+                if (fds[i].revents & POLLERR) {
+                    // the monitor is gone (e.g. cgroup removed), stop watching it
+                    fds[i].fd = -1;
+                } else if (fds[i].revents & POLLPRI) {
+                    on_stall(_triggers[i]._resource);
+                }
+            }
+        }
+    }
+
+#else
+
+    void pressure_monitor::start() {
+        mpp::throw_ex<mpp::runtime_error>("pressure stall information is only available on Linux");
+    }
+
+    void pressure_monitor::stop() {
+    }
+
+    void pressure_monitor::report_stall(pressure_resource resource) {
+        shed(resource);
+    }
+
+    void pressure_monitor::close_triggers() {
+    }
+
+    void pressure_monitor::run() {
+    }
+
+#endif
+}
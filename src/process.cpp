@@ -7,71 +7,265 @@
  */
 
 #include <mozart++/process>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 namespace mpp_impl {
-    bool redirect_or_pipe(const redirect_info &r, fd_type fds[2]) {
+    static std::atomic<process_observer *> global_observer{nullptr};
+
+    /**
+     * Callbacks in flight, counted before the observer is loaded:
+     * once the count is seen at 0 after the store, no callback
+     * can still reach the previous observer.
+     */
+    static std::atomic<std::size_t> observer_calls{0};
+
+    void set_process_observer(process_observer *observer) {
+        global_observer.store(observer);
+        while (observer_calls.load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    process_observer *get_process_observer() {
+        return global_observer.load(std::memory_order_acquire);
+    }
+
+    observer_call::observer_call() {
+        ++observer_calls;
+        _observer = global_observer.load();
+    }
+
+    observer_call::~observer_call() {
+        --observer_calls;
+    }
+
+    static std::atomic<process_backend *> global_backend{nullptr};
+
+    void set_process_backend(process_backend *backend) {
+        global_backend.store(backend, std::memory_order_release);
+    }
+
+    process_backend *get_process_backend() {
+        return global_backend.load(std::memory_order_acquire);
+    }
+
+    void build_exec_image(const process_startup &startup, exec_image &image) {
+        if (startup._image) {
+            image._argv = startup._image->_argv;
+            image._envp = startup._image->_envp;
+            return;
+        }
+
+        image._argv.clear();
+        image._argv.reserve(startup._cmdline.size() + 2);
+        for (const auto &arg : startup._cmdline) {
+            image._argv.push_back(arg.c_str());
+        }
+        image._argv.push_back(nullptr);
+        image._argv.push_back(nullptr);
+
+        // "key=value" pairs are stored back to back, pointers are
+        // taken after the storage stops growing.
+        std::size_t bytes = 0;
+        for (const auto &e : startup._env) {
+            bytes += e.first.size() + e.second.size() + 2;
+        }
+        image._storage.clear();
+        image._storage.reserve(bytes);
+        for (const auto &e : startup._env) {
+            image._storage.append(e.first.data(), e.first.size());
+            image._storage.push_back('=');
+            image._storage.append(e.second.data(), e.second.size());
+            image._storage.push_back('\0');
+        }
+
+        image._envp.clear();
+        image._envp.reserve(startup._env.size() + 1);
+        for (std::size_t pos = 0; pos < image._storage.size();
+             pos = image._storage.find('\0', pos) + 1) {
+            image._envp.push_back(image._storage.data() + pos);
+        }
+        image._envp.push_back(nullptr);
+    }
+
+    bool bind_pipe(stdio_binding &b, int stream) {
+        fd_type fds[2] = {FD_INVALID, FD_INVALID};
+        if (!create_pipe(fds)) {
+            return false;
+        }
+
+        // the child reads from stdin, and writes to stdout and stderr
+        if (stream == 0) {
+            b._child = fds[PIPE_READ];
+            b._parent = fds[PIPE_WRITE];
+        } else {
+            b._child = fds[PIPE_WRITE];
+            b._parent = fds[PIPE_READ];
+        }
+        b._owned = true;
+        return true;
+    }
+
+    bool bind_file(const redirect_info &r, stdio_binding &b) {
         if (!r.redirected()) {
             // no redirect target specified
-            return create_pipe(fds);
+            return false;
         }
 
-        fds[PIPE_READ] = r._target;
-        fds[PIPE_WRITE] = r._target;
+        // note: we should NOT close user provided redirect target fd,
+        // let users to close.
+        b._child = r._target;
+        b._owned = false;
         return true;
     }
 
-    void create_process(const process_startup &startup,
-                        process_info &info) {
-        fd_type pstdin[2] = {FD_INVALID, FD_INVALID};
-        fd_type pstdout[2] = {FD_INVALID, FD_INVALID};
-        fd_type pstderr[2] = {FD_INVALID, FD_INVALID};
+    /**
+     * Live processes by job class.
+     */
+    struct job_registry {
+        std::mutex _lock;
+        std::unordered_map<std::string, std::vector<job_state *>> _classes;
+    };
+
+    static job_registry &jobs() {
+        static job_registry registry;
+        return registry;
+    }
+
+    void register_job(job_state *job) {
+        auto &r = jobs();
+        std::lock_guard<std::mutex> guard(r._lock);
+        r._classes[job->_info->_job_class].push_back(job);
+    }
 
-        if (!redirect_or_pipe(startup._stdin, pstdin)) {
-            mpp::throw_ex<mpp::runtime_error>("unable to bind stdin");
+    void unregister_job(job_state *job) {
+        auto &r = jobs();
+        std::lock_guard<std::mutex> guard(r._lock);
+        auto it = r._classes.find(job->_info->_job_class);
+        if (it == r._classes.end()) {
+            return;
         }
+        auto &v = it->second;
+        v.erase(std::remove(v.begin(), v.end(), job), v.end());
+        if (v.empty()) {
+            r._classes.erase(it);
+        }
+    }
 
-        if (!redirect_or_pipe(startup._stdout, pstdout)) {
-            close_pipe(pstdin);
-            mpp::throw_ex<mpp::runtime_error>("unable to bind stdout");
+    bool reap_job(process_info &info, resource_usage &usage) {
+        auto &r = jobs();
+        std::lock_guard<std::mutex> guard(r._lock);
+        return reap_process(info, usage);
+    }
+
+    /**
+     * Apply op to a job whose suspended state is not yet target.
+     */
+    template <typename Op>
+    static bool apply_job(job_state *job, bool target, Op &&op) {
+        if (target) {
+            // suspended by hand now, whoever did it before
+            job->_shed_by = nullptr;
         }
+        if (job->_suspended != target && op(*job->_info)) {
+            job->_suspended = target;
+            job->_shed_by = nullptr;
+            return true;
+        }
+        return false;
+    }
 
-        if (!startup.merge_outputs) {
-            // if the user doesn't redirect stderr to stdout,
-            // we bind stderr to a new file descriptor
-            if (!redirect_or_pipe(startup._stderr, pstderr)) {
-                close_pipe(pstdin);
-                close_pipe(pstdout);
-                mpp::throw_ex<mpp::runtime_error>("unable to bind stderr");
-            }
+    template <typename Op>
+    static std::size_t for_each_job(const std::string &name, bool target, Op &&op) {
+        auto &r = jobs();
+        std::lock_guard<std::mutex> guard(r._lock);
+        auto it = r._classes.find(name);
+        if (it == r._classes.end()) {
+            return 0;
         }
 
-        try {
-            create_process_impl(startup, info, pstdin, pstdout, pstderr);
-        } catch (...) {
-            // do rollback work
-            // note: we should NOT close user provided redirect target fd,
-            // let users to close.
-            if (!startup._stdin.redirected()) {
-                close_pipe(pstdin);
+        std::size_t count = 0;
+        for (auto job : it->second) {
+            count += apply_job(job, target, op) ? 1 : 0;
+        }
+        return count;
+    }
+
+    template <typename Fn>
+    static std::size_t for_each_low_priority(Fn &&fn) {
+        auto &r = jobs();
+        std::lock_guard<std::mutex> guard(r._lock);
+        std::size_t count = 0;
+        for (auto &c : r._classes) {
+            for (auto job : c.second) {
+                if (job->_info->_low_priority) {
+                    count += fn(job) ? 1 : 0;
+                }
             }
-            if (!startup._stdout.redirected()) {
-                close_pipe(pstdout);
+        }
+        return count;
+    }
+
+    std::size_t shed_low_priority(const void *owner) {
+        return for_each_low_priority([owner](job_state *job) {
+            if (!job->_suspended && suspend_process(*job->_info)) {
+                job->_suspended = true;
+                job->_shed_by = owner;
+                return true;
             }
-            if (!startup._stderr.redirected()) {
-                close_pipe(pstderr);
+            return false;
+        });
+    }
+
+    std::size_t resume_shed(const void *owner) {
+        return for_each_low_priority([owner](job_state *job) {
+            if (job->_shed_by == owner && job->_suspended && resume_process(*job->_info)) {
+                job->_suspended = false;
+                job->_shed_by = nullptr;
+                return true;
             }
-            throw;
+            return false;
+        });
+    }
+
+    void release_stdio(stdio_binding &b) {
+        close_fd(b._parent);
+        if (b._owned) {
+            close_fd(b._child);
         }
     }
 }
 
 namespace mpp {
-    process process::exec(const std::string &command) {
-        return process_builder().command(command).start();
+    std::size_t suspend_job_class(const std::string &name) {
+        return mpp_impl::for_each_job(name, true, mpp_impl::suspend_process);
+    }
+
+    std::size_t resume_job_class(const std::string &name) {
+        return mpp_impl::for_each_job(name, false, mpp_impl::resume_process);
+    }
+
+    std::size_t suspend_low_priority() {
+        return mpp_impl::for_each_low_priority([](mpp_impl::job_state *job) {
+            return mpp_impl::apply_job(job, true, mpp_impl::suspend_process);
+        });
+    }
+
+    std::size_t resume_low_priority() {
+        return mpp_impl::for_each_low_priority([](mpp_impl::job_state *job) {
+            return mpp_impl::apply_job(job, false, mpp_impl::resume_process);
+        });
     }
 
-    process process::exec(const std::string &command,
-                          const std::vector<std::string> &args) {
-        return process_builder().command(command).arguments(args).start();
+    std::size_t terminate_low_priority(bool force) {
+        return mpp_impl::for_each_low_priority([force](mpp_impl::job_state *job) {
+            mpp_impl::terminate_process(*job->_info, force);
+            // let suspended ones handle the signal
+            mpp_impl::apply_job(job, false, mpp_impl::resume_process);
+            return true;
+        });
     }
 }
@@ -0,0 +1,173 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/process_graph>
+
+namespace mpp {
+    process_graph::~process_graph() {
+        // pumps own their descriptors and end with the producers
+        for (auto &t : _pumps) {
+            if (t.joinable()) {
+                t.detach();
+            }
+        }
+    }
+
+    process_graph::node_id process_graph::add(process_builder builder) {
+        if (!_processes.empty()) {
+            mpp::throw_ex<mpp::runtime_error>("process_graph: the graph has been started");
+        }
+        _builders.push_back(std::move(builder));
+        return _builders.size() - 1;
+    }
+
+    process_graph &process_graph::connect(node_id from, node_id to) {
+        if (!_processes.empty()) {
+            mpp::throw_ex<mpp::runtime_error>("process_graph: the graph has been started");
+        }
+        if (from >= _builders.size() || to >= _builders.size() || from == to) {
+            mpp::throw_ex<mpp::runtime_error>("process_graph: invalid edge");
+        }
+        _edges.push_back(edge{from, to});
+        return *this;
+    }
+
+    void process_graph::start() {
+        if (!_processes.empty()) {
+            mpp::throw_ex<mpp::runtime_error>("process_graph: the graph has been started");
+        }
+
+        std::size_t nodes = _builders.size();
+        std::vector<std::vector<std::size_t>> outgoing(nodes);
+        std::vector<std::vector<std::size_t>> incoming(nodes);
+        for (std::size_t e = 0; e < _edges.size(); ++e) {
+            outgoing[_edges[e]._from].push_back(e);
+            incoming[_edges[e]._to].push_back(e);
+        }
+
+        // one pipe per edge, plus one in front of every fan-out
+        // and one behind every fan-in
+        std::vector<fd_type> opened;
+        std::vector<fd_type> child_ends;
+        std::vector<fd_type> edge_read(_edges.size(), FD_INVALID);
+        std::vector<fd_type> edge_write(_edges.size(), FD_INVALID);
+        std::vector<fd_type> node_in(nodes, FD_INVALID);
+        std::vector<fd_type> node_out(nodes, FD_INVALID);
+
+        struct pump {
+            std::vector<fd_type> _from;
+            std::vector<fd_type> _to;
+        };
+        std::vector<pump> pumps;
+
+        auto make_pipe = [&](fd_type &read_end, fd_type &write_end) {
+            fd_type fds[2];
+            if (!create_pipe(fds)) {
+                for (auto fd : opened) {
+                    close_fd(fd);
+                }
+                mpp::throw_ex<mpp::runtime_error>("process_graph: unable to create pipe");
+            }
+            opened.push_back(fds[PIPE_READ]);
+            opened.push_back(fds[PIPE_WRITE]);
+            read_end = fds[PIPE_READ];
+            write_end = fds[PIPE_WRITE];
+        };
+
+        for (std::size_t e = 0; e < _edges.size(); ++e) {
+            make_pipe(edge_read[e], edge_write[e]);
+        }
+
+        for (std::size_t n = 0; n < nodes; ++n) {
+            if (outgoing[n].size() == 1) {
+                node_out[n] = edge_write[outgoing[n][0]];
+            } else if (outgoing[n].size() > 1) {
+                pump p;
+                p._from.push_back(FD_INVALID);
+                make_pipe(p._from[0], node_out[n]);
+                for (auto e : outgoing[n]) {
+                    p._to.push_back(edge_write[e]);
+                }
+                pumps.push_back(std::move(p));
+            }
+
+            if (incoming[n].size() == 1) {
+                node_in[n] = edge_read[incoming[n][0]];
+            } else if (incoming[n].size() > 1) {
+                pump p;
+                p._to.push_back(FD_INVALID);
+                make_pipe(node_in[n], p._to[0]);
+                for (auto e : incoming[n]) {
+                    p._from.push_back(edge_read[e]);
+                }
+                pumps.push_back(std::move(p));
+            }
+
+            if (node_in[n] != FD_INVALID) {
+                child_ends.push_back(node_in[n]);
+            }
+            if (node_out[n] != FD_INVALID) {
+                child_ends.push_back(node_out[n]);
+            }
+        }
+
+        try {
+            _processes.reserve(nodes);
+            for (std::size_t n = 0; n < nodes; ++n) {
+                process_builder builder = _builders[n];
+                if (node_in[n] != FD_INVALID) {
+                    builder.redirect_stdin(node_in[n]);
+                }
+                if (node_out[n] != FD_INVALID) {
+                    builder.redirect_stdout(node_out[n]);
+                }
+                _processes.push_back(builder.start());
+            }
+        } catch (...) {
+            for (auto fd : opened) {
+                close_fd(fd);
+            }
+            throw;
+        }
+
+        // children have their copies, readers see end of file
+        // only after every writer is closed
+        for (auto fd : child_ends) {
+            close_fd(fd);
+        }
+
+        for (auto &p : pumps) {
+            if (p._from.size() == 1) {
+                _pumps.emplace_back(mpp_impl::relay_fanout, p._from[0], std::move(p._to));
+            } else {
+                _pumps.emplace_back(mpp_impl::merge_fanin, std::move(p._from), p._to[0]);
+            }
+        }
+    }
+
+    process &process_graph::node(node_id id) {
+        if (id >= _processes.size()) {
+            mpp::throw_ex<mpp::runtime_error>("process_graph: no such node, or not started");
+        }
+        return _processes[id];
+    }
+
+    std::vector<int> process_graph::wait_for() {
+        std::vector<int> codes;
+        codes.reserve(_processes.size());
+        for (auto &p : _processes) {
+            codes.push_back(p.wait_for());
+        }
+        for (auto &t : _pumps) {
+            if (t.joinable()) {
+                t.join();
+            }
+        }
+        return codes;
+    }
+}
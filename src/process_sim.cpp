@@ -0,0 +1,228 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/process_sim>
+#include <cassert>
+#include <sstream>
+
+namespace mpp_impl {
+    static long simulated_pid(const process_info &info) {
+#ifdef MOZART_PLATFORM_WIN32
+        return static_cast<long>(reinterpret_cast<std::intptr_t>(info._pid));
+#else
+        return info._pid;
+#endif
+    }
+
+    static fd_type to_fd_type(long pid) {
+#ifdef MOZART_PLATFORM_WIN32
+        return reinterpret_cast<fd_type>(static_cast<std::intptr_t>(pid));
+#else
+        return static_cast<fd_type>(pid);
+#endif
+    }
+
+    /**
+     * Exit codes of processes killed by SIGTERM and SIGKILL on *nix.
+     */
+    static constexpr int SIMULATED_TERMINATED = 0x80 + 15;
+    static constexpr int SIMULATED_KILLED = 0x80 + 9;
+}
+
+namespace mpp {
+    simulated_backend::simulated_backend(model m)
+        : _model(std::move(m)) {
+    }
+
+    simulated_backend::~simulated_backend() {
+        // live handles would keep a dangling backend
+        assert(open_processes() == 0);
+        uninstall();
+    }
+
+    void simulated_backend::install() {
+        mpp_impl::set_process_backend(this);
+    }
+
+    void simulated_backend::uninstall() {
+        if (mpp_impl::get_process_backend() == this) {
+            mpp_impl::set_process_backend(nullptr);
+        }
+    }
+
+    void simulated_backend::spawn_cost(std::uint64_t us) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _spawn_cost_us = us;
+    }
+
+    std::uint64_t simulated_backend::now_us() const {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _now_us;
+    }
+
+    void simulated_backend::advance(std::uint64_t us) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _now_us += us;
+    }
+
+    bool simulated_backend::advance_to_next_exit() {
+        std::lock_guard<std::mutex> guard(_lock);
+        return next_exit();
+    }
+
+    bool simulated_backend::advance_to_next_exit(std::vector<fd_type> &exited) {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (!next_exit()) {
+            return false;
+        }
+
+        // everything exiting now, resume() may have queued a pid twice
+        long last = 0;
+        while (!_exits.empty() && _exits.top().first == _now_us) {
+            long pid = _exits.top().second;
+            _exits.pop();
+            auto it = _processes.find(pid);
+            if (pid != last && it != _processes.end() && it->second._exit_us == _now_us) {
+                exited.push_back(mpp_impl::to_fd_type(pid));
+                last = pid;
+            }
+        }
+        return true;
+    }
+
+    bool simulated_backend::next_exit() {
+        while (!_exits.empty()) {
+            exit_event e = _exits.top();
+            auto it = _processes.find(e.second);
+            if (it == _processes.end() || it->second._exit_us != e.first || e.first <= _now_us) {
+                // closed, rescheduled, or already exited
+                _exits.pop();
+                continue;
+            }
+            _now_us = e.first;
+            return true;
+        }
+        return false;
+    }
+
+    std::uint64_t simulated_backend::started() const {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _started;
+    }
+
+    std::size_t simulated_backend::open_processes() const {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _processes.size();
+    }
+
+    simulated_backend::sim_process &simulated_backend::find(const process_info &info) {
+        auto it = _processes.find(mpp_impl::simulated_pid(info));
+        if (it == _processes.end()) {
+            mpp::throw_ex<mpp::runtime_error>("unknown simulated process");
+        }
+        return it->second;
+    }
+
+    void simulated_backend::schedule_exit(long pid, sim_process &p) {
+        if (p._exit_us > _now_us) {
+            _exits.emplace(p._exit_us, pid);
+        }
+    }
+
+    void simulated_backend::create(const process_startup &startup, process_info &info) {
+        if (startup._cmdline.empty() && !startup._image) {
+            mpp::throw_ex<mpp::runtime_error>("empty command line");
+        }
+
+        // the model may take a while, and may start processes itself
+        simulated_outcome outcome = _model ? _model(startup) : simulated_outcome();
+
+        std::lock_guard<std::mutex> guard(_lock);
+        _now_us += _spawn_cost_us;
+        long pid = _next_pid++;
+
+        sim_process &p = _processes[pid];
+        p._exit_us = _now_us + outcome._runtime_us;
+        p._exit_code = outcome._exit_code;
+        p._stdout = std::move(outcome._stdout);
+        p._stderr = std::move(outcome._stderr);
+        schedule_exit(pid, p);
+        ++_started;
+
+        info._pid = mpp_impl::to_fd_type(pid);
+    }
+
+    void simulated_backend::close(process_info &info) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _processes.erase(mpp_impl::simulated_pid(info));
+    }
+
+    int simulated_backend::wait_for(const process_info &info) {
+        std::lock_guard<std::mutex> guard(_lock);
+        sim_process &p = find(info);
+        if (p._suspended) {
+            mpp::throw_ex<mpp::runtime_error>("waiting for a suspended simulated process");
+        }
+        if (p._exit_us > _now_us) {
+            _now_us = p._exit_us;
+        }
+        return p._exit_code;
+    }
+
+    void simulated_backend::terminate(const process_info &info, bool force) {
+        std::lock_guard<std::mutex> guard(_lock);
+        sim_process &p = find(info);
+        if (!p._suspended && p._exit_us <= _now_us) {
+            return;
+        }
+        p._exit_us = _now_us;
+        p._exit_code = force ? mpp_impl::SIMULATED_KILLED : mpp_impl::SIMULATED_TERMINATED;
+        p._suspended = false;
+    }
+
+    bool simulated_backend::exited(const process_info &info) {
+        std::lock_guard<std::mutex> guard(_lock);
+        const sim_process &p = find(info);
+        return !p._suspended && p._exit_us <= _now_us;
+    }
+
+    bool simulated_backend::suspend(const process_info &info) {
+        std::lock_guard<std::mutex> guard(_lock);
+        sim_process &p = find(info);
+        if (p._suspended || p._exit_us <= _now_us) {
+            return false;
+        }
+        p._remaining_us = p._exit_us - _now_us;
+        p._exit_us = NEVER;
+        p._suspended = true;
+        return true;
+    }
+
+    bool simulated_backend::resume(const process_info &info) {
+        std::lock_guard<std::mutex> guard(_lock);
+        sim_process &p = find(info);
+        if (!p._suspended) {
+            return false;
+        }
+        p._exit_us = _now_us + p._remaining_us;
+        p._suspended = false;
+        schedule_exit(mpp_impl::simulated_pid(info), p);
+        return true;
+    }
+
+    std::unique_ptr<std::streambuf> simulated_backend::output(const process_info &info, int stream) {
+        std::lock_guard<std::mutex> guard(_lock);
+        sim_process &p = find(info);
+        std::string &data = stream == 1 ? p._stdout : p._stderr;
+
+        // handed over, it is read once
+        std::unique_ptr<std::streambuf> buf(new std::stringbuf(std::move(data), std::ios_base::in));
+        data.clear();
+        return buf;
+    }
+}
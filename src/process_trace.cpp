@@ -0,0 +1,255 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/process_trace>
+#include <cstring>
+
+namespace mpp_impl {
+    /**
+     * Spawn traces start with "MPPS" and a version byte,
+     * followed by records of LEB128 varints and length-prefixed strings.
+     */
+    static constexpr char SPAWN_TRACE_MAGIC[4] = {'M', 'P', 'P', 'S'};
+    static constexpr std::uint8_t SPAWN_TRACE_VERSION = 2;
+
+    /**
+     * Version 1 only knew pipes and redirects, its flags
+     * are a subset of version 2.
+     */
+    static constexpr std::uint8_t SPAWN_TRACE_MIN_VERSION = 1;
+
+    void write_varint(std::FILE *fp, std::uint64_t value) {
+        unsigned char buf[10];
+        std::size_t n = 0;
+        do {
+            unsigned char byte = value & 0x7fu;
+            value >>= 7u;
+            buf[n++] = value != 0 ? (byte | 0x80u) : byte;
+        } while (value != 0);
+        std::fwrite(buf, 1, n, fp);
+    }
+
+    bool read_varint(std::FILE *fp, std::uint64_t &value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            int c = std::fgetc(fp);
+            if (c == EOF) {
+                return false;
+            }
+            value |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+            if ((c & 0x80) == 0) {
+                return true;
+            }
+        }
+        // malformed: more than 10 bytes
+        return false;
+    }
+
+    static void write_string(std::FILE *fp, const std::string &s) {
+        write_varint(fp, s.size());
+        std::fwrite(s.data(), 1, s.size(), fp);
+    }
+
+    static bool read_string(std::FILE *fp, std::string &s) {
+        std::uint64_t size = 0;
+        if (!read_varint(fp, size) || size > (1u << 20u)) {
+            return false;
+        }
+        s.resize(size);
+        return size == 0 || std::fread(&s[0], 1, size, fp) == size;
+    }
+
+    std::uint64_t zigzag(int value) {
+        return (static_cast<std::uint64_t>(value) << 1u) ^ static_cast<std::uint64_t>(value >> 31);
+    }
+
+    int unzigzag(std::uint64_t value) {
+        return static_cast<int>((value >> 1u) ^ (~(value & 1u) + 1));
+    }
+
+    static void write_record(std::FILE *fp, const mpp::spawn_record &r) {
+        write_varint(fp, r._start_us);
+        write_varint(fp, r._runtime_us);
+        write_varint(fp, zigzag(r._exit_code));
+        write_string(fp, r._command);
+        write_varint(fp, r._argc);
+        write_varint(fp, r._arg_bytes);
+        write_varint(fp, r._envc);
+        write_varint(fp, r._env_bytes);
+        write_varint(fp, r._stdio);
+        write_varint(fp, r._output_bytes);
+    }
+
+    static bool read_record(std::FILE *fp, mpp::spawn_record &r) {
+        std::uint64_t exit_code = 0;
+        std::uint64_t argc = 0;
+        std::uint64_t arg_bytes = 0;
+        std::uint64_t envc = 0;
+        std::uint64_t env_bytes = 0;
+        std::uint64_t stdio = 0;
+
+        if (!read_varint(fp, r._start_us)
+            || !read_varint(fp, r._runtime_us)
+            || !read_varint(fp, exit_code)
+            || !read_string(fp, r._command)
+            || !read_varint(fp, argc)
+            || !read_varint(fp, arg_bytes)
+            || !read_varint(fp, envc)
+            || !read_varint(fp, env_bytes)
+            || !read_varint(fp, stdio)
+            || !read_varint(fp, r._output_bytes)) {
+            return false;
+        }
+
+        r._exit_code = unzigzag(exit_code);
+        r._argc = static_cast<std::uint32_t>(argc);
+        r._arg_bytes = static_cast<std::uint32_t>(arg_bytes);
+        r._envc = static_cast<std::uint32_t>(envc);
+        r._env_bytes = static_cast<std::uint32_t>(env_bytes);
+        r._stdio = static_cast<std::uint16_t>(stdio);
+        return true;
+    }
+}
+
+namespace mpp {
+    spawn_recorder::spawn_recorder(const std::string &path)
+        : _epoch(clock::now()) {
+        _file = std::fopen(path.c_str(), "wb");
+        if (_file == nullptr) {
+            mpp::throw_ex<mpp::runtime_error>("unable to create spawn trace: " + path);
+        }
+        std::fwrite(mpp_impl::SPAWN_TRACE_MAGIC, 1, sizeof(mpp_impl::SPAWN_TRACE_MAGIC), _file);
+        std::fputc(mpp_impl::SPAWN_TRACE_VERSION, _file);
+    }
+
+    spawn_recorder::~spawn_recorder() {
+        uninstall();
+
+        // processes still alive are recorded with what we know so far
+        std::lock_guard<std::mutex> guard(_lock);
+        auto now = clock::now();
+        for (auto &p : _pending) {
+            p.second._record._runtime_us = static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(now - p.second._start).count());
+            mpp_impl::write_record(_file, p.second._record);
+        }
+        _pending.clear();
+        std::fclose(_file);
+    }
+
+    void spawn_recorder::uninstall() {
+        if (mpp_impl::get_process_observer() == this) {
+            mpp_impl::set_process_observer(nullptr);
+        }
+    }
+
+    void spawn_recorder::on_start(const process_startup &startup, const process_info &info) {
+        auto now = clock::now();
+
+        pending_spawn p;
+        spawn_record &r = p._record;
+        p._start = now;
+        r._start_us = static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - _epoch).count());
+
+        // prebuilt images loaded from startup records have no _cmdline
+        mpp_impl::exec_image image;
+        mpp_impl::build_exec_image(startup, image);
+        if (image._argv.front() != nullptr) {
+            r._command = image._argv.front();
+            for (auto arg = image._argv.data() + 1; *arg != nullptr; ++arg) {
+                ++r._argc;
+                r._arg_bytes += static_cast<std::uint32_t>(std::strlen(*arg));
+            }
+        }
+
+        for (auto env = image._envp.data(); *env != nullptr; ++env) {
+            // "key=value"
+            ++r._envc;
+            r._env_bytes += static_cast<std::uint32_t>(std::strlen(*env));
+        }
+
+        // the policies the child was started with, not only the redirects
+        static const unsigned flags[3][3] = {
+            {SPAWN_STDIN_REDIRECTED, SPAWN_STDIN_NULL, SPAWN_STDIN_INHERITED},
+            {SPAWN_STDOUT_REDIRECTED, SPAWN_STDOUT_NULL, SPAWN_STDOUT_INHERITED},
+            {SPAWN_STDERR_REDIRECTED, SPAWN_STDERR_NULL, SPAWN_STDERR_INHERITED},
+        };
+        unsigned stdio = startup.merge_outputs ? static_cast<unsigned>(SPAWN_MERGE_OUTPUTS) : 0u;
+        int streams = startup.merge_outputs ? 2 : 3;
+        for (int i = 0; i < streams; ++i) {
+            switch (info._stdio_kinds[i]) {
+                case mpp_impl::stdio_kind::file:
+                    stdio |= flags[i][0];
+                    break;
+                case mpp_impl::stdio_kind::null:
+                    stdio |= flags[i][1];
+                    break;
+                case mpp_impl::stdio_kind::inherit:
+                    stdio |= flags[i][2];
+                    break;
+                case mpp_impl::stdio_kind::pipe:
+                    break;
+            }
+        }
+        r._stdio = static_cast<std::uint16_t>(stdio);
+
+        std::lock_guard<std::mutex> guard(_lock);
+        _pending[info._pid] = std::move(p);
+    }
+
+    void spawn_recorder::on_exit(const process_info &info, int exit_code) {
+        auto now = clock::now();
+
+        // read before taking the lock, the child is not reaped yet
+        mpp_impl::io_counters io;
+        bool has_io = mpp_impl::read_io_counters(info, io);
+
+        std::lock_guard<std::mutex> guard(_lock);
+        auto it = _pending.find(info._pid);
+        if (it == _pending.end()) {
+            // started before we were installed
+            return;
+        }
+
+        spawn_record &r = it->second._record;
+        r._runtime_us = static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - it->second._start).count());
+        r._exit_code = exit_code;
+        r._output_bytes = has_io ? io._wchar : 0;
+        mpp_impl::write_record(_file, r);
+        _pending.erase(it);
+    }
+
+    spawn_trace_reader::spawn_trace_reader(const std::string &path) {
+        _file = std::fopen(path.c_str(), "rb");
+        if (_file == nullptr) {
+            mpp::throw_ex<mpp::runtime_error>("unable to open spawn trace: " + path);
+        }
+
+        char magic[sizeof(mpp_impl::SPAWN_TRACE_MAGIC)] = {0};
+        if (std::fread(magic, 1, sizeof(magic), _file) != sizeof(magic)
+            || std::memcmp(magic, mpp_impl::SPAWN_TRACE_MAGIC, sizeof(magic)) != 0) {
+            std::fclose(_file);
+            mpp::throw_ex<mpp::runtime_error>("not a spawn trace: " + path);
+        }
+        int version = std::fgetc(_file);
+        if (version < mpp_impl::SPAWN_TRACE_MIN_VERSION || version > mpp_impl::SPAWN_TRACE_VERSION) {
+            std::fclose(_file);
+            mpp::throw_ex<mpp::runtime_error>("not a spawn trace: " + path);
+        }
+    }
+
+    spawn_trace_reader::~spawn_trace_reader() {
+        std::fclose(_file);
+    }
+
+    bool spawn_trace_reader::next(spawn_record &record) {
+        return mpp_impl::read_record(_file, record);
+    }
+}
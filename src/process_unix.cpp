@@ -10,6 +10,10 @@
 #ifdef MOZART_PLATFORM_UNIX
 
 #include <mozart++/process>
+#include <mozart++/process_graph>
+#include <mozart++/drain_loop>
+#include <mozart++/shared_input>
+#include <mozart++/jobserver>
 #include <mozart++/string>
 #include <dirent.h>
 #include <cerrno>
@@ -21,7 +25,25 @@
 #include <climits>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <csignal>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <poll.h>
+
+#ifdef MOZART_PLATFORM_LINUX
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/taskstats.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
 
 #ifdef MOZART_PLATFORM_DARWIN
 #define FD_DIR "/dev/fd"
@@ -51,12 +73,15 @@ namespace mpp_impl {
      * waitid() is standard on all POSIX platforms.
      * Note: waitid on Mac OS X 10.7 seems to be broken;
      * it does not return the exit status consistently.
+     * @param block wait until the child exits instead of polling
      */
-    static int poll_process_status(int pid) {
+    static int poll_process_status(int pid, bool block = false) {
         siginfo_t info;
         memset(&info, '\0', sizeof(info));
 
-        if (waitid(P_PID, pid, &info, WEXITED | WSTOPPED | WNOHANG | WNOWAIT) == -1) {
+        // stopped children are still alive, so WSTOPPED is not asked for,
+        // or suspended children would be mistaken for exited ones.
+        if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT | (block ? 0 : WNOHANG)) == -1) {
             // cannot get process status at this moment
             // return early in case of undefined behavior.
             return PROCESS_POLL_FAILED;
@@ -78,19 +103,78 @@ namespace mpp_impl {
                 // the historical behaviour on Solaris is to return the
                 // original signal number, but we will ignore that!
                 return 0x80 + WTERMSIG(info.si_status);
-            case CLD_STOPPED:
-                return 0x80 + WSTOPSIG(info.si_status);
             default:
                 // process is still alive
                 return PROCESS_STILL_ALIVE;
         }
     }
 
-    static bool close_all_descriptors(int from_fd, int fail_fd) {
+    /**
+     * Descriptors kept open in the child besides standard streams,
+     * their numbers stay the same in the child.
+     */
+    struct inherit_list {
+        static constexpr int MAX_INHERIT = 16;
+        int _fds[MAX_INHERIT] = {0};
+        int _count = 0;
+
+        bool contains(int fd) const {
+            for (int i = 0; i < _count; ++i) {
+                if (_fds[i] == fd) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * @return false when full, never silently dropped: the parent
+         *         fails to start the child then
+         */
+        bool add(int fd) {
+            if (_count == MAX_INHERIT) {
+                return false;
+            }
+            _fds[_count++] = fd;
+            return true;
+        }
+    };
+
+    /**
+     * Things the child needs besides process_startup,
+     * prepared by the parent to avoid work after fork().
+     */
+    struct child_extras {
+        inherit_list _inherit;
+        std::vector<std::string> _env;
+
+        /**
+         * argv and envp, including _env.
+         */
+        exec_image _image;
+
+        /**
+         * File found and classified by the parent, see resolve_executable().
+         * Empty when the child searches PATH itself.
+         */
+        std::string _resolved;
+
+        /**
+         * _resolved is a script without shebang, argv already runs it with /bin/sh.
+         */
+        bool _resolved_script = false;
+
+        /**
+         * Path of _resolved in exec_cache, told when the kernel refuses it.
+         */
+        std::string _cache_key;
+    };
+
+    static bool close_all_descriptors(int from_fd, const inherit_list &keep) {
         DIR *dp = nullptr;
         struct dirent64 *dirp = nullptr;
 
-        // We're trying to close all file descriptors, but opendir() might\
+        // We're trying to close all file descriptors, but opendir() might
         // itself be implemented using a file descriptor, and we certainly
         // don't want to close that while it's in use.  We assume that if
         // opendir() is implemented using a file descriptor, then it uses
@@ -98,9 +182,13 @@ namespace mpp_impl {
         // close a couple explicitly.
 
         // for possible use by opendir()
-        close(from_fd);
+        if (!keep.contains(from_fd)) {
+            close(from_fd);
+        }
         // another one for good luck
-        close(from_fd + 1);
+        if (!keep.contains(from_fd + 1)) {
+            close(from_fd + 1);
+        }
 
         if ((dp = opendir(FD_DIR)) == nullptr) {
             return false;
@@ -111,7 +199,8 @@ namespace mpp_impl {
             int fd;
             if (std::isdigit(dirp->d_name[0])
                 && (fd = strtol(dirp->d_name, nullptr, 10)) >= from_fd + 2
-                && fd != fail_fd) {
+                && fd != dirfd(dp)
+                && !keep.contains(fd)) {
                 close(fd);
             }
         }
@@ -310,6 +399,12 @@ namespace mpp_impl {
         } while ((result == -1) && (errno == EINTR));
     }
 
+    /**
+     * Sent on the fail pipe before falling back to /bin/sh after ENOEXEC,
+     * errno values are positive.
+     */
+    static constexpr int EXEC_FELL_BACK_TO_SHELL = -1;
+
     __attribute__((noreturn))
     static void exit_with_error(int fail_fd) {
         // the child failed to exec, tell our parent.
@@ -319,23 +414,100 @@ namespace mpp_impl {
         _exit(-1);
     }
 
+    bool bind_null(stdio_binding &b, int stream) {
+        b._child = open("/dev/null", (stream == 0 ? O_RDONLY : O_WRONLY) | O_CLOEXEC);
+        b._owned = true;
+        return b._child != FD_INVALID;
+    }
+
+    bool bind_inherit(stdio_binding &b, int stream) {
+        // standard streams survive fork(), installing them
+        // again in the child is a no-op.
+        b._child = stream;
+        b._owned = false;
+        return true;
+    }
+
+    /**
+     * Opening the descriptor through /proc gives a new open file
+     * description: children do not share the file offset.
+     */
+    static int reopen_sealed(const mpp::sealed_input &input) {
+        std::string path = "/proc/self/fd/" + std::to_string(input.fd());
+        return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    bool bind_shared_input(const mpp::sealed_input &input, stdio_binding &b) {
+        b._child = reopen_sealed(input);
+        b._owned = true;
+        return b._child != FD_INVALID;
+    }
+
+    void bind_detached(const process_startup &startup, stdio_binding *stdio) {
+        std::string dir(startup._detach_dir.data(), startup._detach_dir.size());
+        const char *names[3] = {nullptr, "/stdout", "/stderr"};
+        int streams = startup.merge_outputs ? 2 : 3;
+
+        if (!bind_null(stdio[0], 0)) {
+            mpp::throw_ex<mpp::runtime_error>("unable to bind stdin");
+        }
+
+        for (int i = 1; i < streams; ++i) {
+            std::string path = dir + names[i];
+            stdio[i]._child = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            stdio[i]._owned = true;
+            stdio[i]._parent = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+            if (stdio[i]._child == FD_INVALID || stdio[i]._parent == FD_INVALID) {
+                int saved_errno = errno;
+                for (int j = 0; j <= i; ++j) {
+                    release_stdio(stdio[j]);
+                }
+                mpp::throw_ex<mpp::runtime_error>("unable to create " + path + ": "
+                                                  + std::string(strerror(saved_errno)));
+            }
+        }
+    }
+
+    /**
+     * Write a small value to a file in a cgroup directory.
+     * Only uses a stack buffer, so it is safe to call after fork().
+     */
+    static bool write_cgroup_file(const char *dir, std::size_t dirlen,
+                                  const char *file, const char *value) {
+        char path[PATH_MAX] = {0};
+        std::size_t filelen = strlen(file);
+        if (dirlen + filelen + 2 >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        memcpy(path, dir, dirlen);
+        path[dirlen] = '/';
+        memcpy(path + dirlen + 1, file, filelen);
+
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        std::size_t len = strlen(value);
+        bool ok = write(fd, value, len) == static_cast<ssize_t>(len);
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return ok;
+    }
+
     __attribute__((noreturn))
-    static void child_proc(const process_startup &startup, process_info &info,
-                           fd_type *pstdin, fd_type *pstdout, fd_type *pstderr,
-                           fd_type *pfail) {
+    static void child_proc(const process_startup &startup, const stdio_binding *stdio,
+                           fd_type *pfail, const child_extras &extras) {
         // close child side of read pipe
         close_fd(pfail[PIPE_READ]);
         int fail_fd = pfail[PIPE_WRITE];
 
-        if (!startup._stdin.redirected()) {
-            close_fd(pstdin[PIPE_WRITE]);
-        }
-        if (!startup._stdout.redirected()) {
-            close_fd(pstdout[PIPE_READ]);
-        }
-
-        dup2(pstdin[PIPE_READ], STDIN_FILENO);
-        dup2(pstdout[PIPE_WRITE], STDOUT_FILENO);
+        // parent ends of pipes and the original descriptors
+        // will be closed together with other inherited ones.
+        dup2(stdio[0]._child, STDIN_FILENO);
+        dup2(stdio[1]._child, STDOUT_FILENO);
 
         /*
          * pay special attention to stderr,
@@ -345,55 +517,18 @@ namespace mpp_impl {
          */
         if (startup.merge_outputs) {
             // redirect stderr to stdout
-            dup2(pstdout[PIPE_WRITE], STDERR_FILENO);
+            dup2(stdio[1]._child, STDERR_FILENO);
         } else {
-            // redirect stderr to a file
-            if (!startup._stderr.redirected()) {
-                close_fd(pstderr[PIPE_READ]);
-            }
-            dup2(pstderr[PIPE_WRITE], STDERR_FILENO);
-        }
-
-        close_fd(pstdin[PIPE_READ]);
-        close_fd(pstdout[PIPE_WRITE]);
-        close_fd(pstderr[PIPE_WRITE]);
-
-        // command-line and environments
-        size_t asize = startup._cmdline.size();
-        size_t esize = startup._env.size();
-        char *argv[asize + 1];
-        char *envp[esize + 1];
-
-        // argv and envp are always terminated with a nullptr
-        argv[asize] = nullptr;
-        envp[esize] = nullptr;
-
-        // copy command-line arguments
-        for (std::size_t i = 0; i < asize; ++i) {
-            argv[i] = const_cast<char *>(startup._cmdline[i].c_str());
-        }
-
-        // copy environment variables
-        std::vector<std::string> envs;
-        std::stringstream buffer;
-        for (const auto &e : startup._env) {
-            buffer.str("");
-            buffer.clear();
-            buffer << e.first << "=" << e.second;
-            envs.emplace_back(buffer.str());
-        }
-
-        for (std::size_t i = 0; i < esize; ++i) {
-            envp[i] = const_cast<char *>(envs[i].c_str());
+            dup2(stdio[2]._child, STDERR_FILENO);
         }
 
         // close everything
-        if (!close_all_descriptors(STDERR_FILENO + 1, fail_fd)) {
+        if (!close_all_descriptors(STDERR_FILENO + 1, extras._inherit)) {
             // try luck failed, close the old way
             int max_fd = static_cast<int>(sysconf(_SC_OPEN_MAX));
             for (int fd = STDERR_FILENO + 1; fd < max_fd; fd++) {
-                // do not close fail pipe
-                if (fd == fail_fd) {
+                // do not close fail pipe and inherited ones
+                if (extras._inherit.contains(fd)) {
                     continue;
                 }
                 if (close(fd) == -1 && errno != EBADF) {
@@ -404,6 +539,27 @@ namespace mpp_impl {
             }
         }
 
+        // inherited descriptors must survive exec
+        for (int i = 0; i < extras._inherit._count; ++i) {
+            int fd = extras._inherit._fds[i];
+            if (fd != fail_fd && fcntl(fd, F_SETFD, 0) == -1) {
+                exit_with_error(fail_fd);
+                // never return
+            }
+        }
+
+        if (startup._new_process_group && setpgid(0, 0) != 0) {
+            exit_with_error(fail_fd);
+            // never return
+        }
+
+        // "0" stands for the writing process itself
+        if (!startup._cgroup.empty()
+            && !write_cgroup_file(startup._cgroup.c_str(), startup._cgroup.size(), "cgroup.procs", "0")) {
+            exit_with_error(fail_fd);
+            // never return
+        }
+
         // change cwd
         if (chdir(startup._cwd.c_str()) != 0) {
             exit_with_error(fail_fd);
@@ -419,15 +575,334 @@ namespace mpp_impl {
         }
 
         // run subprocess
-        mpp_execvpe(argv[0], const_cast<const char **>(argv), envp);
+        // the copy of the image in the child is ours to modify
+        auto argv = const_cast<const char **>(extras._image._argv.data());
+        auto envp = const_cast<char **>(extras._image._envp.data());
+        if (extras._resolved_script) {
+            execve("/bin/sh", const_cast<char **>(argv), envp);
+        } else if (!extras._resolved.empty()) {
+            execve(extras._resolved.c_str(), const_cast<char **>(argv), envp);
+            if (errno == ENOEXEC) {
+                // the parent runs it with /bin/sh right away from now on
+                restartable_write_error(fail_fd, EXEC_FELL_BACK_TO_SHELL);
+                execve_without_shebang(extras._resolved.c_str(), argv, envp);
+            }
+            // only retried when the file changed after it was classified
+            mpp_execvpe(argv[0], argv, envp);
+        } else {
+            mpp_execvpe(argv[0], argv, envp);
+        }
 
         // exec failed
         exit_with_error(fail_fd);
         // never return
     }
 
+    enum class exec_kind {
+        /**
+         * Left to the kernel: ELF, Mach-O, or anything binary
+         * that binfmt_misc may know about.
+         */
+        native,
+        /**
+         * Starts with "#!", the kernel runs the interpreter.
+         */
+        shebang,
+        /**
+         * Refused by the kernel with ENOEXEC when a child ran it, run by
+         * /bin/sh right away like execvp(3) does after that refusal.
+         */
+        script,
+    };
+
+    /**
+     * Kinds of executable files, so the header of a file is read once
+     * rather than by every child through a failing execve(). An entry is
+     * used as long as a stat() of the file matches it.
+     */
+    class exec_cache {
+    private:
+        static constexpr std::size_t MAX_ENTRIES = 1024;
+
+        struct entry {
+            dev_t _dev;
+            ino_t _ino;
+            off_t _size;
+            time_t _mtime;
+            long _mtime_ns;
+            exec_kind _kind;
+
+            bool matches(const struct stat &st) const {
+                return _dev == st.st_dev && _ino == st.st_ino && _size == st.st_size
+                       && _mtime == st.st_mtime && _mtime_ns == mtime_ns(st);
+            }
+        };
+
+        std::mutex _lock;
+        std::unordered_map<std::string, entry> _entries;
+
+        static long mtime_ns(const struct stat &st) {
+#ifdef MOZART_PLATFORM_DARWIN
+            return st.st_mtimespec.tv_nsec;
+#else
+            return st.st_mtim.tv_nsec;
+#endif
+        }
+
+        static exec_kind classify(const char *path) {
+            char header[2];
+            ssize_t n = -1;
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                n = read_fully(fd, header, sizeof(header));
+                close(fd);
+            }
+            if (n >= 2 && header[0] == '#' && header[1] == '!') {
+                return exec_kind::shebang;
+            }
+            // Anything else, text without shebang included, goes to the kernel
+            // first: binfmt_misc may know it by magic or extension. It becomes
+            // a script once a child reports the kernel refused it.
+            return exec_kind::native;
+        }
+
+    public:
+        /**
+         * A child fell back to /bin/sh for path, as long as it didn't change.
+         */
+        void refused_by_kernel(const std::string &path) {
+            struct stat st{};
+            if (stat(path.c_str(), &st) != 0) {
+                return;
+            }
+            std::lock_guard<std::mutex> guard(_lock);
+            auto it = _entries.find(path);
+            if (it != _entries.end() && it->second.matches(st)) {
+                it->second._kind = exec_kind::script;
+            }
+        }
+
+        /**
+         * @return false when path is not an executable regular file
+         */
+        bool lookup(const std::string &path, exec_kind &kind) {
+            struct stat st{};
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)
+                || access(path.c_str(), X_OK) != 0) {
+                return false;
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                auto it = _entries.find(path);
+                if (it != _entries.end() && it->second.matches(st)) {
+                    kind = it->second._kind;
+                    return true;
+                }
+            }
+
+            kind = classify(path.c_str());
+            std::lock_guard<std::mutex> guard(_lock);
+            if (_entries.size() >= MAX_ENTRIES) {
+                _entries.clear();
+            }
+            _entries[path] = entry{st.st_dev, st.st_ino, st.st_size, st.st_mtime, mtime_ns(st), kind};
+            return true;
+        }
+
+        static exec_cache &get() {
+            static exec_cache cache;
+            return cache;
+        }
+    };
+
+    /**
+     * Search PATH and classify the executable in the parent, so the child
+     * issues a single execve() with an argv allocated here. extras is left
+     * alone when nothing is found, the child then searches like execvpe(3)
+     * and fails with the right errno.
+     */
+    static void resolve_executable(const process_startup &startup, child_extras &extras) {
+        std::vector<const char *> &argv = extras._image._argv;
+        const char *file = argv.front();
+        if (*file == '\0') {
+            return;
+        }
+
+        // relative paths are run from the cwd of the child
+        std::string cwd(startup._cwd.data(), startup._cwd.size());
+        exec_kind kind = exec_kind::native;
+        auto lookup = [&](const std::string &path) {
+            extras._cache_key = path[0] == '/' || cwd == "." ? path : cwd + "/" + path;
+            return exec_cache::get().lookup(extras._cache_key, kind);
+        };
+
+        std::string path;
+        if (strchr(file, '/') != nullptr) {
+            path = file;
+            if (!lookup(path)) {
+                return;
+            }
+        } else {
+            const char *const *pathv = effective_pathv();
+            if (pathv == nullptr) {
+                return;
+            }
+            bool found = false;
+            for (auto dirs = pathv; *dirs != nullptr && !found; ++dirs) {
+                path = *dirs;
+                if (path.back() != '/') {
+                    path += '/';
+                }
+                path += file;
+                found = lookup(path);
+            }
+            free(const_cast<const char **>(pathv));
+            if (!found) {
+                extras._cache_key.clear();
+                return;
+            }
+        }
+
+        extras._resolved = std::move(path);
+        if (kind == exec_kind::script) {
+            // "/bin/sh file args...", what execve_without_shebang() does
+            argv.front() = extras._resolved.c_str();
+            argv.insert(argv.begin(), "/bin/sh");
+            extras._resolved_script = true;
+        }
+    }
+
+    /**
+     * Paths the keeper of a detached child writes to, prepared by
+     * the parent: the keeper must not allocate after fork().
+     */
+    struct keeper_paths {
+        std::string _status;
+        std::string _status_tmp;
+    };
+
+    static std::string detached_status_path(const std::string &dir) {
+        return dir + "/exit";
+    }
+
+    /**
+     * Written by the keeper, only async-signal-safe calls.
+     */
+    static void write_detached_status(const keeper_paths &paths, int code) {
+        char buf[16];
+        int len = 0;
+        char digits[12];
+        int ndigits = 0;
+        do {
+            digits[ndigits++] = static_cast<char>('0' + code % 10);
+            code /= 10;
+        } while (code != 0);
+        while (ndigits > 0) {
+            buf[len++] = digits[--ndigits];
+        }
+        buf[len++] = '\n';
+
+        // renamed when complete, so readers never see a partial status
+        int fd = open(paths._status_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            bool ok = write(fd, buf, len) == len;
+            ok = close(fd) == 0 && ok;
+            if (ok) {
+                rename(paths._status_tmp.c_str(), paths._status.c_str());
+            }
+        }
+    }
+
+    /**
+     * Runs in the child of fork(): starts a session, forks the real child,
+     * reports its pid and waits for it, then writes its exit status
+     * unless it could not be read.
+     * Our copy of the fail pipe is closed right away, so the parent only
+     * hears from the real child about exec.
+     */
+    __attribute__((noreturn))
+    static void keeper_proc(const process_startup &startup, const stdio_binding *stdio,
+                            fd_type *pfail, const child_extras &extras,
+                            int pid_fd, const keeper_paths &paths) {
+        setsid();
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            child_proc(startup, stdio, pfail, extras);
+            // child never returns
+        }
+        if (pid < 0) {
+            exit_with_error(pfail[PIPE_WRITE]);
+            // never return
+        }
+
+        // descriptors of the parent, including parent ends of pipes
+        // of other children, must not be kept open by us.
+        inherit_list keep;
+        keep.add(pid_fd);
+        if (!close_all_descriptors(0, keep)) {
+            int max_fd = static_cast<int>(sysconf(_SC_OPEN_MAX));
+            for (int fd = 0; fd < max_fd; fd++) {
+                if (fd != pid_fd) {
+                    close(fd);
+                }
+            }
+        }
+
+        ssize_t result = 0;
+        do {
+            result = write(pid_fd, &pid, sizeof(pid));
+        } while (result == -1 && errno == EINTR);
+        close(pid_fd);
+
+        // The child stays unreaped until its status is written: while it
+        // is a zombie its pid can't be reused, and terminate_process()
+        // only signals it when there is no status file yet.
+        int code = 0;
+        do {
+            code = poll_process_status(pid, true);
+        } while (code == PROCESS_STILL_ALIVE || (code == PROCESS_POLL_FAILED && errno == EINTR));
+        if (code >= 0) {
+            write_detached_status(paths, code);
+        }
+        // otherwise the status is unknown, and no status file says so:
+        // waiting gives -1, adopting fails
+        while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+            // keep reaping
+        }
+        _exit(0);
+    }
+
+    static fd_type open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+        return static_cast<fd_type>(syscall(SYS_pidfd_open, pid, 0));
+#else
+        errno = ENOSYS;
+        return FD_INVALID;
+#endif
+    }
+
+    /**
+     * MAKEFLAGS of the startup is kept with ours appended, make uses the
+     * last jobserver. Descriptors of a pipe-style jobserver are inherited
+     * by the caller.
+     */
+    static void pass_jobserver(const mpp::jobserver &server, child_extras &extras) {
+        std::string flags = server.makeflags();
+        std::vector<const char *> &envp = extras._image._envp;
+        for (auto it = envp.begin(); it != envp.end() && *it != nullptr; ++it) {
+            if (strncmp(*it, "MAKEFLAGS=", 10) == 0) {
+                flags = std::string(*it + 10) + " " + flags;
+                envp.erase(it);
+                break;
+            }
+        }
+        extras._env.push_back("MAKEFLAGS=" + flags);
+    }
+
     void create_process_impl(const process_startup &startup, process_info &info,
-                             fd_type *pstdin, fd_type *pstdout, fd_type *pstderr) {
+                             stdio_binding *stdio) {
         // the child_proc will use this pipe to
         // tell parent whether the process has started.
         fd_type pfail[2] = {FD_INVALID, FD_INVALID};
@@ -435,14 +910,103 @@ namespace mpp_impl {
             mpp::throw_ex<mpp::runtime_error>("unable to create communication pipe");
         }
 
+        child_extras extras;
+        extras._inherit.add(pfail[PIPE_WRITE]);
+        build_exec_image(startup, extras._image);
+        if (extras._image._argv.front() == nullptr) {
+            close_pipe(pfail);
+            mpp::throw_ex<mpp::runtime_error>("empty command line");
+        }
+
+        fd_type pnotify[2] = {FD_INVALID, FD_INVALID};
+        fd_type shared_fd = FD_INVALID;
+
+        // the child is told about these descriptors, it must find them open
+        auto inherit = [&](int fd) {
+            if (!extras._inherit.add(fd)) {
+                close_pipe(pfail);
+                close_pipe(pnotify);
+                close_fd(shared_fd);
+                mpp::throw_ex<mpp::runtime_error>("too many descriptors inherited by the child");
+            }
+        };
+
+        // readiness channel: the child writes "READY=1" to MPP_NOTIFY_FD
+        if (startup._notify_ready) {
+            if (pipe2(pnotify, O_CLOEXEC) != 0) {
+                close_pipe(pfail);
+                mpp::throw_ex<mpp::runtime_error>("unable to create notification pipe");
+            }
+            inherit(pnotify[PIPE_WRITE]);
+            extras._env.push_back("MPP_NOTIFY_FD=" + std::to_string(pnotify[PIPE_WRITE]));
+        }
+
+        // shared input passed as an extra descriptor
+        if (startup._shared_input && !startup._shared_input_stdin) {
+            shared_fd = reopen_sealed(*startup._shared_input);
+            if (shared_fd == FD_INVALID) {
+                close_pipe(pfail);
+                close_pipe(pnotify);
+                mpp::throw_ex<mpp::runtime_error>("unable to open shared input");
+            }
+            inherit(shared_fd);
+            extras._env.push_back("MPP_SHARED_INPUT_FD=" + std::to_string(shared_fd));
+        }
+
+        if (startup._jobserver) {
+            if (startup._jobserver->read_fd() != FD_INVALID) {
+                inherit(startup._jobserver->read_fd());
+                inherit(startup._jobserver->write_fd());
+            }
+            pass_jobserver(*startup._jobserver, extras);
+        }
+
+        resolve_executable(startup, extras);
+
+        if (!extras._env.empty()) {
+            std::vector<const char *> &envp = extras._image._envp;
+            envp.pop_back();
+            for (const auto &e : extras._env) {
+                envp.push_back(e.c_str());
+            }
+            envp.push_back(nullptr);
+        }
+
+        // detached children report their pid through the keeper
+        bool detached = !startup._detach_dir.empty();
+        keeper_paths paths;
+        fd_type ppid[2] = {FD_INVALID, FD_INVALID};
+        if (detached) {
+            paths._status = detached_status_path(std::string(startup._detach_dir.data(),
+                                                             startup._detach_dir.size()));
+            paths._status_tmp = paths._status + ".tmp";
+            // left by a previous child in the same directory
+            unlink(paths._status.c_str());
+
+            if (pipe2(ppid, O_CLOEXEC) != 0) {
+                close_pipe(pfail);
+                close_pipe(pnotify);
+                close_fd(shared_fd);
+                mpp::throw_ex<mpp::runtime_error>("unable to create communication pipe");
+            }
+        }
+
         pid_t pid = fork();
 
         if (pid < 0) {
+            close_pipe(pfail);
+            close_pipe(pnotify);
+            close_pipe(ppid);
+            close_fd(shared_fd);
             mpp::throw_ex<mpp::runtime_error>("unable to fork subprocess");
 
         } else if (pid == 0) {
+            if (detached) {
+                keeper_proc(startup, stdio, pfail, extras, ppid[PIPE_WRITE], paths);
+            }
+
             // in child process, pfail will be closed in child_proc
-            child_proc(startup, info, pstdin, pstdout, pstderr, pfail);
+            child_proc(startup, stdio, pfail, extras);
 
             // child never returns
 
@@ -451,51 +1015,71 @@ namespace mpp_impl {
 
             // receive exec call result form child
             close_fd(pfail[PIPE_WRITE]);
+            close_fd(pnotify[PIPE_WRITE]);
+            close_fd(ppid[PIPE_WRITE]);
+            close_fd(shared_fd);
             int child_errno = 0;
+            ssize_t status = read_fully(pfail[PIPE_READ], &child_errno, sizeof(child_errno));
+            if (status == sizeof(child_errno) && child_errno == EXEC_FELL_BACK_TO_SHELL) {
+                exec_cache::get().refused_by_kernel(extras._cache_key);
+                status = read_fully(pfail[PIPE_READ], &child_errno, sizeof(child_errno));
+            }
 
-            switch (read_fully(pfail[PIPE_READ], &child_errno, sizeof(child_errno))) {
+            switch (status) {
                 case 0:
                     // child exec succeeded.
                     break;
                 case sizeof(child_errno):
                     // child failed to exec, we will wait it.
+                    close_fd(pfail[PIPE_READ]);
+                    close_fd(pnotify[PIPE_READ]);
+                    close_fd(ppid[PIPE_READ]);
+                    // the keeper exits after the child
                     waitpid(pid, nullptr, 0);
                     mpp::throw_ex<mpp::runtime_error>("child exec failed: " + std::string(strerror(child_errno)));
                     break;
                 default:
+                    close_fd(pfail[PIPE_READ]);
+                    close_fd(pnotify[PIPE_READ]);
+                    close_fd(ppid[PIPE_READ]);
                     mpp::throw_ex<mpp::runtime_error>("read failed: " + std::string(strerror(errno)));
                     break;
             }
 
             close_fd(pfail[PIPE_READ]);
 
-            if (!startup._stdin.redirected()) {
-                close_fd(pstdin[PIPE_READ]);
+            if (detached) {
+                pid_t keeper = pid;
+                bool ok = read_fully(ppid[PIPE_READ], &pid, sizeof(pid)) == sizeof(pid);
+                close_fd(ppid[PIPE_READ]);
+                if (!ok) {
+                    close_fd(pnotify[PIPE_READ]);
+                    waitpid(keeper, nullptr, 0);
+                    mpp::throw_ex<mpp::runtime_error>("keeper of detached child failed");
+                }
+                info._keeper_pid = keeper;
+                info._keeper = open_pidfd(keeper);
             }
-            if (!startup._stdout.redirected()) {
-                close_fd(pstdout[PIPE_WRITE]);
+
+            if (startup._new_process_group) {
+                // also done by the child, whoever comes first wins the race
+                // against signals sent to the group. Fails harmlessly
+                // when the child has already exec'ed.
+                setpgid(pid, pid);
             }
 
-            /*
-             * pay special attention to stderr,
-             * there are 2 cases:
-             *      1. redirect stderr to stdout
-             *      2. redirect stderr to a file
-             */
-            if (startup.merge_outputs) {
-                // redirect stderr to stdout
-                // do nothing
-            } else {
-                // redirect stderr to a file
-                if (!startup._stderr.redirected()) {
-                    close_fd(pstderr[PIPE_WRITE]);
+            // the child has its own copies now
+            for (int i = 0; i < 3; ++i) {
+                if (stdio[i]._owned) {
+                    close_fd(stdio[i]._child);
                 }
             }
 
             info._pid = pid;
-            info._stdin = pstdin[PIPE_WRITE];
-            info._stdout = pstdout[PIPE_READ];
-            info._stderr = pstderr[PIPE_READ];
+            info._stdin = stdio[0]._parent;
+            info._stdout = stdio[1]._parent;
+            info._stderr = stdio[2]._parent;
+            info._notify = pnotify[PIPE_READ];
 
             // on *nix systems, fork() doesn't create threads to run process
             info._tid = FD_INVALID;
@@ -503,42 +1087,505 @@ namespace mpp_impl {
     }
 
     void close_process(process_info &info) {
+        if (info._backend != nullptr) {
+            info._backend->close(info);
+            return;
+        }
         mpp_impl::close_fd(info._stdin);
         mpp_impl::close_fd(info._stdout);
         mpp_impl::close_fd(info._stderr);
+        mpp_impl::close_fd(info._notify);
+        mpp_impl::close_fd(info._keeper);
+        mpp_impl::close_fd(info._exit_fd);
     }
 
-    int wait_for(const process_info &info) {
-        while (true) {
-            int status = poll_process_status(info._pid);
-            if (status == PROCESS_STILL_ALIVE) {
-                // continue waiting
-                continue;
+    fd_type exit_fd(process_info &info) {
+        if (info._backend != nullptr) {
+            return FD_INVALID;
+        }
+        if (!info._detach_dir.empty()) {
+            // the keeper exits once the child has
+            return info._keeper;
+        }
+        // the pid can't be reused before we reap it
+        if (info._exit_fd == FD_INVALID && !info._reaped) {
+            info._exit_fd = open_pidfd(static_cast<pid_t>(info._pid));
+        }
+        return info._exit_fd;
+    }
 
-            } else if (status == PROCESS_POLL_FAILED) {
-                switch (errno) {
-                    case ECHILD:
-                        // The process specified by pid does not exist
-                        // or is not a child of the calling process.
-                        return 0;
-                    default:
-                        // cannot get exit code
-                        return -1;
+    int wait_ready(process_info &info, std::string &buffer, int timeout_ms) {
+        if (info._notify == FD_INVALID) {
+            return -1;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (true) {
+            // messages are newline separated assignments, like sd_notify(3)
+            std::size_t pos = 0;
+            while (pos < buffer.size()) {
+                std::size_t eol = buffer.find('\n', pos);
+                std::string line = buffer.substr(pos, eol == std::string::npos ? std::string::npos : eol - pos);
+                if (line == "READY=1" || line == "READY") {
+                    buffer.clear();
+                    return 1;
+                }
+                if (eol == std::string::npos) {
+                    break;
+                }
+                pos = eol + 1;
+            }
+            buffer.erase(0, pos);
+
+            int wait_ms = -1;
+            if (timeout_ms >= 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                if (left < 0) {
+                    return 0;
                 }
+                wait_ms = static_cast<int>(left);
+            }
 
-            } else {
-                // the process has exited.
-                return status;
+            pollfd pfd{info._notify, POLLIN, 0};
+            int n = poll(&pfd, 1, wait_ms);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n == 0) {
+                return 0;
+            } else if (n < 0) {
+                return -1;
+            }
+
+            char chunk[256];
+            ssize_t r = read(info._notify, chunk, sizeof(chunk));
+            if (r < 0 && errno == EINTR) {
+                continue;
+            } else if (r <= 0) {
+                // the child closed the channel (or exited) without being ready
+                close_fd(info._notify);
+                return -1;
             }
+            buffer.append(chunk, static_cast<std::size_t>(r));
         }
     }
 
-    void terminate_process(const process_info &info, bool force) {
-        kill(info._pid, force ? SIGKILL : SIGTERM);
+    static bool read_detached_status(const process_info &info, int &code) {
+        FILE *fp = fopen(detached_status_path(info._detach_dir).c_str(), "r");
+        if (fp == nullptr) {
+            return false;
+        }
+        bool ok = fscanf(fp, "%d", &code) == 1;
+        fclose(fp);
+        return ok;
     }
 
-    bool process_exited(const process_info &info) {
-        // if WNOHANG was specified and one or more child(ren)
+    /**
+     * A detached child has exited once its keeper has written the
+     * status and exited.
+     * @param timeout_ms negative for no timeout
+     * @return exit code, PROCESS_STILL_ALIVE on timeout, or -1 when
+     *         the keeper died without recording the status
+     */
+    static int wait_detached(const process_info &info, int timeout_ms) {
+        auto keeper = static_cast<pid_t>(info._keeper_pid);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+        while (true) {
+            int code = 0;
+            if (read_detached_status(info, code)) {
+                // reap the keeper if it is our child
+                if (keeper > 0) {
+                    waitpid(keeper, nullptr, WNOHANG);
+                }
+                return code;
+            }
+
+            int remaining = -1;
+            if (timeout_ms >= 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                remaining = left > 0 ? static_cast<int>(left) : 0;
+            }
+
+            bool gone = false;
+            if (info._keeper != FD_INVALID) {
+                // readable once the keeper has exited
+                struct pollfd pfd{info._keeper, POLLIN, 0};
+                int n = poll(&pfd, 1, remaining);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                gone = n != 0;
+            } else {
+                gone = keeper <= 0
+                       || waitpid(keeper, nullptr, WNOHANG) == keeper
+                       || (kill(keeper, 0) != 0 && errno == ESRCH);
+                if (!gone && remaining != 0) {
+                    // no pidfd, poll the status every few milliseconds
+                    int nap = remaining < 0 || remaining > 10 ? 10 : remaining;
+                    poll(nullptr, 0, nap);
+                    continue;
+                }
+            }
+
+            if (gone) {
+                if (keeper > 0) {
+                    waitpid(keeper, nullptr, WNOHANG);
+                }
+                return read_detached_status(info, code) ? code : -1;
+            }
+            if (remaining == 0) {
+                return PROCESS_STILL_ALIVE;
+            }
+        }
+    }
+
+    /**
+     * Start time of a process in clock ticks since boot, to tell
+     * a process from a later one reusing its pid. 0 when unknown.
+     */
+    static unsigned long long process_start_time(long pid) {
+#ifdef MOZART_PLATFORM_LINUX
+        std::string path = "/proc/" + std::to_string(pid) + "/stat";
+        FILE *fp = fopen(path.c_str(), "r");
+        if (fp == nullptr) {
+            return 0;
+        }
+        char buf[1024];
+        std::size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+        fclose(fp);
+        buf[n] = '\0';
+
+        // the command may contain anything, fields follow the last ')'
+        const char *p = strrchr(buf, ')');
+        unsigned long long start = 0;
+        if (p == nullptr || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                                          "%*u %*u %*d %*d %*d %*d %*d %*d %llu", &start) != 1) {
+            return 0;
+        }
+        return start;
+#else
+        return 0;
+#endif
+    }
+
+    std::string detach_state(const process_info &info) {
+        if (info._detach_dir.empty()) {
+            mpp::throw_ex<mpp::runtime_error>("process is not detached");
+        }
+
+        std::string state = "mpp-detached 1\n";
+        state += "pid " + std::to_string(info._pid) + "\n";
+        state += "keeper " + std::to_string(info._keeper_pid) + " "
+                 + std::to_string(process_start_time(info._keeper_pid)) + "\n";
+        state += "group " + std::to_string(info._group_leader ? 1 : 0) + "\n";
+        state += "cgroup " + info._cgroup + "\n";
+        state += "dir " + info._detach_dir + "\n";
+        return state;
+    }
+
+    void adopt_process(long pid, const std::string &state, process_info &info) {
+        std::istringstream in(state);
+        std::string line;
+        long keeper = 0;
+        unsigned long long keeper_start = 0;
+        long recorded_pid = 0;
+        bool versioned = false;
+
+        while (std::getline(in, line)) {
+            std::size_t space = line.find(' ');
+            std::string key = line.substr(0, space);
+            std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+            if (key == "mpp-detached") {
+                versioned = value == "1";
+            } else if (key == "pid") {
+                recorded_pid = std::strtol(value.c_str(), nullptr, 10);
+            } else if (key == "keeper") {
+                std::istringstream(value) >> keeper >> keeper_start;
+            } else if (key == "group") {
+                info._group_leader = value == "1";
+            } else if (key == "cgroup") {
+                info._cgroup = value;
+            } else if (key == "dir") {
+                info._detach_dir = value;
+            }
+        }
+
+        if (!versioned || recorded_pid != pid || keeper <= 0 || info._detach_dir.empty()) {
+            mpp::throw_ex<mpp::runtime_error>("not a detached process state");
+        }
+
+        info._pid = static_cast<pid_t>(pid);
+        info._keeper_pid = keeper;
+
+        // while the keeper is alive, the child is either running or
+        // a zombie waiting for it, so its pid can't have been reused.
+        // The pidfd pins the keeper before checking that it is the same.
+        int code = 0;
+        info._keeper = open_pidfd(static_cast<pid_t>(keeper));
+        unsigned long long start = process_start_time(keeper);
+        if (start == 0 || start != keeper_start) {
+            // The pid may belong to anything now, or we can't tell without
+            // a start time: only a child that has finished is adopted.
+            close_fd(info._keeper);
+            info._keeper_pid = -1;
+            if (!read_detached_status(info, code)) {
+                mpp::throw_ex<mpp::runtime_error>(
+                    "detached process " + std::to_string(pid)
+                    + (keeper_start == 0 ? " can't be verified on this platform" : " no longer exists"));
+            }
+        }
+
+        std::string out = info._detach_dir + "/stdout";
+        std::string err = info._detach_dir + "/stderr";
+        info._stdout = open(out.c_str(), O_RDONLY | O_CLOEXEC);
+        info._stderr = open(err.c_str(), O_RDONLY | O_CLOEXEC);
+        info._tid = FD_INVALID;
+    }
+
+    int wait_for(const process_info &info) {
+        if (info._backend != nullptr) {
+            return info._backend->wait_for(info);
+        }
+        if (!info._detach_dir.empty()) {
+            return wait_detached(info, -1);
+        }
+
+        while (true) {
+            int status = poll_process_status(info._pid, true);
+            if (status == PROCESS_STILL_ALIVE) {
+                // continue waiting
+                continue;
+
+            } else if (status == PROCESS_POLL_FAILED) {
+                switch (errno) {
+                    case EINTR:
+                        continue;
+                    case ECHILD:
+                        // The process specified by pid does not exist
+                        // or is not a child of the calling process.
+                        return 0;
+                    default:
+                        // cannot get exit code
+                        return -1;
+                }
+
+            } else {
+                // the process has exited.
+                return status;
+            }
+        }
+    }
+
+    bool reap_process(process_info &info, resource_usage &usage) {
+        if (info._backend != nullptr || !info._detach_dir.empty()) {
+            // nothing of ours, or the keeper was reaped by wait_detached()
+            return false;
+        }
+        struct rusage ru{};
+        pid_t r = 0;
+        while ((r = wait4(info._pid, nullptr, WNOHANG, &ru)) == -1 && errno == EINTR) {
+            // keep reaping
+        }
+        info._reaped = true;
+        if (r != info._pid) {
+            return false;
+        }
+
+        auto ns = [](const timeval &tv) {
+            return static_cast<std::uint64_t>(tv.tv_sec) * 1000000000ull
+                   + static_cast<std::uint64_t>(tv.tv_usec) * 1000ull;
+        };
+        usage._user_ns = ns(ru.ru_utime);
+        usage._system_ns = ns(ru.ru_stime);
+#ifdef MOZART_PLATFORM_DARWIN
+        // bytes on Darwin
+        usage._max_rss_kb = static_cast<std::uint64_t>(ru.ru_maxrss) / 1024;
+#else
+        usage._max_rss_kb = static_cast<std::uint64_t>(ru.ru_maxrss);
+#endif
+        usage._minor_faults = static_cast<std::uint64_t>(ru.ru_minflt);
+        usage._major_faults = static_cast<std::uint64_t>(ru.ru_majflt);
+        usage._voluntary_switches = static_cast<std::uint64_t>(ru.ru_nvcsw);
+        usage._involuntary_switches = static_cast<std::uint64_t>(ru.ru_nivcsw);
+        return true;
+    }
+
+    /**
+     * Reaps children whose handles are gone, on a thread started with
+     * the first of them. A pidfd per child wakes it up when one exits;
+     * without pidfds it checks them every REAP_INTERVAL_MS.
+     */
+    class reaper {
+    private:
+        static constexpr int REAP_INTERVAL_MS = 50;
+
+        struct child {
+            pid_t _pid;
+            fd_type _pidfd;
+
+            /**
+             * Jobserver slot of the child, given back once it is reaped.
+             */
+            std::shared_ptr<mpp::jobserver_token> _token;
+        };
+
+        std::mutex _lock;
+        std::vector<child> _pending;
+        fd_type _wake[2] = {FD_INVALID, FD_INVALID};
+
+        static void set_flags(fd_type fd, int fl) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | fl);
+        }
+
+        void run() {
+            std::vector<child> children;
+            std::vector<pollfd> fds;
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    for (auto &c : _pending) {
+                        c._pidfd = open_pidfd(c._pid);
+                        children.push_back(std::move(c));
+                    }
+                    _pending.clear();
+                }
+
+                bool polling = false;
+                for (std::size_t i = 0; i < children.size();) {
+                    pid_t r = waitpid(children[i]._pid, nullptr, WNOHANG);
+                    if (r == 0 || (r == -1 && errno == EINTR)) {
+                        polling = polling || children[i]._pidfd == FD_INVALID;
+                        ++i;
+                        continue;
+                    }
+                    // reaped, or not our child any more
+                    close_fd(children[i]._pidfd);
+                    children[i] = std::move(children.back());
+                    children.pop_back();
+                }
+
+                fds.clear();
+                fds.push_back(pollfd{_wake[PIPE_READ], POLLIN, 0});
+                for (const auto &c : children) {
+                    if (c._pidfd != FD_INVALID) {
+                        fds.push_back(pollfd{c._pidfd, POLLIN, 0});
+                    }
+                }
+                if (poll(fds.data(), fds.size(), polling ? REAP_INTERVAL_MS : -1) > 0
+                    && fds[0].revents != 0) {
+                    char buf[64];
+                    while (read(_wake[PIPE_READ], buf, sizeof(buf)) > 0) {
+                    }
+                }
+            }
+        }
+
+    public:
+        reaper() {
+            if (!create_pipe(_wake)) {
+                mpp::throw_ex<mpp::runtime_error>("unable to create reaper pipe");
+            }
+            set_flags(_wake[PIPE_READ], O_NONBLOCK);
+            set_flags(_wake[PIPE_WRITE], O_NONBLOCK);
+            std::thread(&reaper::run, this).detach();
+        }
+
+        void reap(pid_t pid, std::shared_ptr<mpp::jobserver_token> token) {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _pending.push_back(child{pid, FD_INVALID, std::move(token)});
+            }
+            // a full pipe means a wakeup is pending anyway
+            char c = 0;
+            while (write(_wake[PIPE_WRITE], &c, 1) == -1 && errno == EINTR) {
+            }
+        }
+
+        /**
+         * Never destroyed: children may be handed over during exit.
+         */
+        static reaper &get() {
+            static reaper *instance = new reaper();
+            return *instance;
+        }
+    };
+
+    void release_process(const process_info &info) {
+        if (info._destroy_policy == destroy_policy::abandon) {
+            return;
+        }
+        if (info._destroy_policy == destroy_policy::kill_and_reap) {
+            terminate_process(info, true);
+        }
+        if (info._backend != nullptr) {
+            return;
+        }
+        // the keeper of a detached child is ours, the child is not
+        long pid = info._detach_dir.empty() ? info._pid : info._keeper_pid;
+        if (pid > 0) {
+            reaper::get().reap(static_cast<pid_t>(pid), info._job_token);
+        }
+    }
+
+    void terminate_process(const process_info &info, bool force) {
+        if (info._backend != nullptr) {
+            info._backend->terminate(info, force);
+            return;
+        }
+        if (info._reaped) {
+            // the pid may belong to someone else now
+            return;
+        }
+        if (!info._detach_dir.empty() && process_exited(info)) {
+            // the pid of a detached child is no longer reserved for it
+            return;
+        }
+        kill(info._pid, force ? SIGKILL : SIGTERM);
+    }
+
+    static bool freeze_or_signal(const process_info &info, bool freeze) {
+        if (info._reaped) {
+            return false;
+        }
+        if (!info._cgroup.empty()
+            && write_cgroup_file(info._cgroup.c_str(), info._cgroup.size(),
+                                 "cgroup.freeze", freeze ? "1" : "0")) {
+            return true;
+        }
+        // fall back to signals when the cgroup freezer is unavailable
+        pid_t target = info._group_leader ? -info._pid : info._pid;
+        return kill(target, freeze ? SIGSTOP : SIGCONT) == 0;
+    }
+
+    bool suspend_process(const process_info &info) {
+        if (info._backend != nullptr) {
+            return info._backend->suspend(info);
+        }
+        return freeze_or_signal(info, true);
+    }
+
+    bool resume_process(const process_info &info) {
+        if (info._backend != nullptr) {
+            return info._backend->resume(info);
+        }
+        return freeze_or_signal(info, false);
+    }
+
+    bool process_exited(const process_info &info) {
+        if (info._backend != nullptr) {
+            return info._backend->exited(info);
+        }
+        if (!info._detach_dir.empty()) {
+            return wait_detached(info, 0) != PROCESS_STILL_ALIVE;
+        }
+        if (info._reaped) {
+            return true;
+        }
+
+        // if WNOHANG was specified and one or more child(ren)
         // specified by pid exist, but have not yet changed state,
         // then 0 is returned. On error, -1 is returned.
         int status = poll_process_status(info._pid);
@@ -589,6 +1636,738 @@ namespace mpp_impl {
 
         return status != PROCESS_STILL_ALIVE;
     }
+
+    bool read_io_counters(const process_info &info, io_counters &io) {
+        if (info._backend != nullptr) {
+            return false;
+        }
+#ifdef MOZART_PLATFORM_LINUX
+        std::string path = std::string("/proc/") + std::to_string(info._pid) + "/io";
+        FILE *fp = fopen(path.c_str(), "r");
+        if (fp == nullptr) {
+            return false;
+        }
+
+        char key[32] = {0};
+        unsigned long long value = 0;
+        while (fscanf(fp, "%31[^:]: %llu ", key, &value) == 2) {
+            if (strcmp(key, "rchar") == 0) {
+                io._rchar = value;
+            } else if (strcmp(key, "wchar") == 0) {
+                io._wchar = value;
+            } else if (strcmp(key, "read_bytes") == 0) {
+                io._read_bytes = value;
+            } else if (strcmp(key, "write_bytes") == 0) {
+                io._write_bytes = value;
+            }
+        }
+        fclose(fp);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+#ifdef MOZART_PLATFORM_LINUX
+    /**
+     * A generic netlink request with room for a few attributes.
+     */
+    struct genl_request {
+        struct nlmsghdr _nlh;
+        struct genlmsghdr _genl;
+        char _attrs[64];
+    };
+
+    static void genl_init(genl_request &req, std::uint16_t family, std::uint8_t cmd, std::uint8_t version) {
+        memset(&req, 0, sizeof(req));
+        req._nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+        req._nlh.nlmsg_type = family;
+        req._nlh.nlmsg_flags = NLM_F_REQUEST;
+        req._genl.cmd = cmd;
+        req._genl.version = version;
+    }
+
+    static void genl_put_attr(genl_request &req, std::uint16_t type, const void *data, std::size_t size) {
+        auto nla = reinterpret_cast<struct nlattr *>(
+            reinterpret_cast<char *>(&req) + NLMSG_ALIGN(req._nlh.nlmsg_len));
+        nla->nla_type = type;
+        nla->nla_len = static_cast<std::uint16_t>(NLA_HDRLEN + size);
+        memcpy(reinterpret_cast<char *>(nla) + NLA_HDRLEN, data, size);
+        req._nlh.nlmsg_len = NLMSG_ALIGN(req._nlh.nlmsg_len) + NLA_ALIGN(nla->nla_len);
+    }
+
+    /**
+     * Send the request and receive the reply.
+     * @return attributes of the reply and their size, nullptr on error
+     */
+    static const char *genl_transact(int sock, const genl_request &req, char *buf, std::size_t size,
+                                     std::size_t &attrs_size) {
+        struct sockaddr_nl kernel{};
+        kernel.nl_family = AF_NETLINK;
+        if (sendto(sock, &req, req._nlh.nlmsg_len, 0,
+                   reinterpret_cast<struct sockaddr *>(&kernel), sizeof(kernel)) < 0) {
+            return nullptr;
+        }
+
+        ssize_t n = 0;
+        do {
+            n = recv(sock, buf, size, 0);
+        } while (n < 0 && errno == EINTR);
+
+        auto nlh = reinterpret_cast<const struct nlmsghdr *>(buf);
+        if (n < 0 || !NLMSG_OK(nlh, static_cast<std::size_t>(n))
+            || nlh->nlmsg_type == NLMSG_ERROR
+            || nlh->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)) {
+            return nullptr;
+        }
+        attrs_size = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+        return buf + NLMSG_LENGTH(GENL_HDRLEN);
+    }
+
+    static const struct nlattr *genl_find_attr(const char *attrs, std::size_t size, std::uint16_t type) {
+        while (size >= NLA_HDRLEN) {
+            auto nla = reinterpret_cast<const struct nlattr *>(attrs);
+            if (nla->nla_len < NLA_HDRLEN || nla->nla_len > size) {
+                return nullptr;
+            }
+            if ((nla->nla_type & NLA_TYPE_MASK) == type) {
+                return nla;
+            }
+            std::size_t step = NLA_ALIGN(nla->nla_len);
+            if (step >= size) {
+                break;
+            }
+            attrs += step;
+            size -= step;
+        }
+        return nullptr;
+    }
+
+    static const char *genl_attr_data(const struct nlattr *nla) {
+        return reinterpret_cast<const char *>(nla) + NLA_HDRLEN;
+    }
+
+    /**
+     * Generic netlink family ids are assigned at runtime, resolve it once.
+     */
+    static std::uint16_t taskstats_family(int sock) {
+        static std::atomic<std::uint16_t> family{0};
+        std::uint16_t id = family.load(std::memory_order_relaxed);
+        if (id != 0) {
+            return id;
+        }
+
+        genl_request req;
+        genl_init(req, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1);
+        genl_put_attr(req, CTRL_ATTR_FAMILY_NAME, TASKSTATS_GENL_NAME, sizeof(TASKSTATS_GENL_NAME));
+
+        char buf[1024];
+        std::size_t size = 0;
+        const char *attrs = genl_transact(sock, req, buf, sizeof(buf), size);
+        const struct nlattr *nla = attrs ? genl_find_attr(attrs, size, CTRL_ATTR_FAMILY_ID) : nullptr;
+        if (nla == nullptr || nla->nla_len < NLA_HDRLEN + sizeof(std::uint16_t)) {
+            return 0;
+        }
+        memcpy(&id, genl_attr_data(nla), sizeof(id));
+        family.store(id, std::memory_order_relaxed);
+        return id;
+    }
+#endif
+
+    bool read_delay_counters(const process_info &info, delay_counters &delays) {
+        if (info._backend != nullptr) {
+            return false;
+        }
+#ifdef MOZART_PLATFORM_LINUX
+        int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+        if (sock < 0) {
+            return false;
+        }
+
+        std::uint16_t family = taskstats_family(sock);
+        if (family == 0) {
+            close(sock);
+            return false;
+        }
+
+        // the main thread only: thread group queries skip exited threads,
+        // and the whole group of a zombie has exited.
+        genl_request req;
+        genl_init(req, family, TASKSTATS_CMD_GET, TASKSTATS_GENL_VERSION);
+        auto pid = static_cast<std::uint32_t>(info._pid);
+        genl_put_attr(req, TASKSTATS_CMD_ATTR_PID, &pid, sizeof(pid));
+
+        char buf[4096];
+        std::size_t size = 0;
+        const char *attrs = genl_transact(sock, req, buf, sizeof(buf), size);
+        close(sock);
+
+        const struct nlattr *aggr = attrs ? genl_find_attr(attrs, size, TASKSTATS_TYPE_AGGR_PID) : nullptr;
+        const struct nlattr *nla = aggr ? genl_find_attr(genl_attr_data(aggr), aggr->nla_len - NLA_HDRLEN,
+                                                         TASKSTATS_TYPE_STATS) : nullptr;
+        if (nla == nullptr) {
+            return false;
+        }
+
+        // older kernels send a shorter struct
+        struct taskstats stats{};
+        memcpy(&stats, genl_attr_data(nla), std::min<std::size_t>(nla->nla_len - NLA_HDRLEN, sizeof(stats)));
+        delays._cpu_count = stats.cpu_count;
+        delays._cpu_delay_ns = stats.cpu_delay_total;
+        delays._blkio_count = stats.blkio_count;
+        delays._blkio_delay_ns = stats.blkio_delay_total;
+        delays._swapin_count = stats.swapin_count;
+        delays._swapin_delay_ns = stats.swapin_delay_total;
+        delays._cpu_run_ns = stats.cpu_run_real_total;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    mpp::ssize_t read_some(fd_type fd, void *buf, std::size_t size) {
+        while (true) {
+            ssize_t n = read(fd, buf, size);
+            if (n >= 0 || errno != EINTR) {
+                return n;
+            }
+        }
+    }
+
+    static bool write_all(int fd, const char *data, std::size_t size) {
+        while (size > 0) {
+            ssize_t n = write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += n;
+            size -= static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    /**
+     * SIGPIPE goes to the thread writing into a pipe without readers,
+     * blocking it leaves us with EPIPE and the rest of the program alive.
+     */
+    static void block_sigpipe() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+
+    static constexpr std::size_t PUMP_CHUNK = 64 * 1024;
+
+    static void relay_copy(int from, std::vector<int> &to) {
+        std::vector<char> buf(PUMP_CHUNK);
+        while (!to.empty()) {
+            ssize_t n = read_some(from, buf.data(), buf.size());
+            if (n <= 0) {
+                break;
+            }
+            for (auto it = to.begin(); it != to.end();) {
+                if (write_all(*it, buf.data(), static_cast<std::size_t>(n))) {
+                    ++it;
+                } else {
+                    // the reader went away
+                    close(*it);
+                    it = to.erase(it);
+                }
+            }
+        }
+    }
+
+#ifdef MOZART_PLATFORM_LINUX
+
+    /**
+     * The first size bytes of a pipe, without consuming them:
+     * tee(2) them into an empty pipe of the same capacity and read it.
+     */
+    static bool peek_pipe(int from, int scratch[2], std::vector<char> &buf, std::size_t size) {
+        if (scratch[PIPE_READ] == -1) {
+            if (pipe2(scratch, O_CLOEXEC) != 0) {
+                return false;
+            }
+            int capacity = fcntl(from, F_GETPIPE_SZ);
+            if (capacity > 0) {
+                fcntl(scratch[PIPE_WRITE], F_SETPIPE_SZ, capacity);
+            }
+        }
+
+        ssize_t n;
+        do {
+            n = tee(from, scratch[PIPE_WRITE], size, 0);
+        } while (n < 0 && errno == EINTR);
+
+        buf.resize(size);
+        std::size_t got = 0;
+        std::size_t expected = n > 0 ? static_cast<std::size_t>(n) : 0;
+        while (got < expected) {
+            ssize_t r = read_some(scratch[PIPE_READ], buf.data() + got, expected - got);
+            if (r <= 0) {
+                return false;
+            }
+            got += static_cast<std::size_t>(r);
+        }
+        return got == size;
+    }
+
+    /**
+     * Every round tee(2)s what the first output accepts into the others,
+     * then splice(2)s it into the last one, which consumes it. An output
+     * taking only a part of the round gets the rest with write(2).
+     * @return false when tee(2) is unsupported before anything was moved
+     */
+    static bool relay_splice(int from, std::vector<int> &to) {
+        static constexpr std::size_t ROUND_MAX = 1u << 20u;
+        int scratch[2] = {-1, -1};
+        std::vector<char> peeked;
+        bool moved = false;
+
+        while (!to.empty()) {
+            ssize_t n = to.size() == 1
+                        ? splice(from, nullptr, to[0], nullptr, ROUND_MAX, SPLICE_F_MOVE)
+                        : tee(from, to[0], ROUND_MAX, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EINVAL && !moved) {
+                    return false;
+                }
+                if (errno != EPIPE) {
+                    break;
+                }
+                close(to[0]);
+                to.erase(to.begin());
+                continue;
+            }
+            if (n == 0) {
+                // end of file
+                break;
+            }
+            moved = true;
+            if (to.size() == 1) {
+                continue;
+            }
+
+            auto round = static_cast<std::size_t>(n);
+            bool have_peeked = false;
+            for (std::size_t i = 1; i + 1 < to.size();) {
+                ssize_t m;
+                do {
+                    m = tee(from, to[i], round, 0);
+                } while (m < 0 && errno == EINTR);
+
+                auto done = static_cast<std::size_t>(m < 0 ? 0 : m);
+                if (m >= 0 && done < round) {
+                    // the output is full, the rest goes the slow way
+                    have_peeked = have_peeked || peek_pipe(from, scratch, peeked, round);
+                }
+                if (m < 0 || (done < round && (!have_peeked
+                                               || !write_all(to[i], peeked.data() + done, round - done)))) {
+                    close(to[i]);
+                    to.erase(to.begin() + i);
+                    continue;
+                }
+                ++i;
+            }
+
+            // the round must be consumed even if the last output went away
+            std::size_t left = round;
+            while (left > 0) {
+                ssize_t m = splice(from, nullptr, to.back(), nullptr, left, SPLICE_F_MOVE);
+                if (m > 0) {
+                    left -= static_cast<std::size_t>(m);
+                    continue;
+                }
+                if (m < 0 && errno == EINTR) {
+                    continue;
+                }
+                close(to.back());
+                to.pop_back();
+
+                char sink[4096];
+                while (left > 0) {
+                    ssize_t r = read_some(from, sink, std::min(left, sizeof(sink)));
+                    if (r <= 0) {
+                        break;
+                    }
+                    left -= static_cast<std::size_t>(r);
+                }
+                break;
+            }
+        }
+
+        if (scratch[PIPE_READ] != -1) {
+            close(scratch[PIPE_READ]);
+            close(scratch[PIPE_WRITE]);
+        }
+        return true;
+    }
+
+#endif
+
+    void relay_fanout(fd_type from, std::vector<fd_type> to) {
+        block_sigpipe();
+#ifdef MOZART_PLATFORM_LINUX
+        if (!relay_splice(from, to))
+#endif
+        {
+            relay_copy(from, to);
+        }
+
+        // readers left see end of file, the writer sees
+        // a broken pipe if every reader went away
+        close(from);
+        for (int fd : to) {
+            close(fd);
+        }
+    }
+
+    void merge_fanin(std::vector<fd_type> from, fd_type to) {
+        block_sigpipe();
+        std::vector<pollfd> fds;
+        for (int fd : from) {
+            fds.push_back(pollfd{fd, POLLIN, 0});
+        }
+
+        // incomplete lines, by input
+        std::vector<std::string> pending(fds.size());
+        std::vector<char> buf(PUMP_CHUNK);
+        bool writable = true;
+
+        while (writable && !fds.empty()) {
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            for (std::size_t i = 0; writable && i < fds.size();) {
+                if (fds[i].revents == 0) {
+                    ++i;
+                    continue;
+                }
+
+                ssize_t n = read_some(fds[i].fd, buf.data(), buf.size());
+                if (n <= 0) {
+                    // end of file, the last line may be without newline
+                    writable = write_all(to, pending[i].data(), pending[i].size());
+                    close(fds[i].fd);
+                    fds.erase(fds.begin() + i);
+                    pending.erase(pending.begin() + i);
+                    continue;
+                }
+
+                const char *begin = buf.data();
+                const char *end = begin + n;
+                const char *complete = end;
+                while (complete > begin && complete[-1] != '\n') {
+                    --complete;
+                }
+
+                std::string &p = pending[i];
+                if (complete > begin) {
+                    if (!p.empty()) {
+                        p.append(begin, complete);
+                        writable = write_all(to, p.data(), p.size());
+                        p.clear();
+                    } else {
+                        writable = write_all(to, begin, complete - begin);
+                    }
+                }
+                p.append(complete, end);
+                if (writable && p.size() >= PUMP_CHUNK) {
+                    // too long to keep in one piece
+                    writable = write_all(to, p.data(), p.size());
+                    p.clear();
+                }
+                ++i;
+            }
+        }
+
+        // the reader went away, so will the writers
+        for (const auto &p : fds) {
+            close(p.fd);
+        }
+        close(to);
+    }
+
+    int wait_readable(const std::vector<fd_type> &fds, std::vector<char> &ready, int timeout_ms) {
+        std::vector<pollfd> pfds(fds.size());
+        for (std::size_t i = 0; i < fds.size(); ++i) {
+            pfds[i] = pollfd{fds[i], POLLIN, 0};
+        }
+
+        int n = poll(pfds.data(), pfds.size(), timeout_ms);
+        ready.assign(fds.size(), 0);
+        if (n <= 0) {
+            // interrupted counts as a timeout, callers loop anyway
+            return 0;
+        }
+        for (std::size_t i = 0; i < fds.size(); ++i) {
+            // hang up and errors are ready too, read() tells what happened
+            ready[i] = pfds[i].revents != 0;
+        }
+        return n;
+    }
+
+    static int create_memfd() {
+#if defined(MOZART_PLATFORM_LINUX) && defined(SYS_memfd_create) && defined(MFD_ALLOW_SEALING)
+        return static_cast<int>(syscall(SYS_memfd_create, "mpp-shared-input", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+
+    /**
+     * A description of a pipe of our own, its flags do not change
+     * the one shared with children. Linux only, FD_INVALID elsewhere.
+     */
+    static int reopen_nonblocking(int fd) {
+#ifdef MOZART_PLATFORM_LINUX
+        std::string path = "/proc/self/fd/" + std::to_string(fd);
+        return open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+#else
+        return FD_INVALID;
+#endif
+    }
+
+    static bool seal_memfd(int fd) {
+#ifdef F_ADD_SEALS
+        return fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+#else
+        errno = ENOSYS;
+        return false;
+#endif
+    }
+}
+
+namespace mpp {
+    sealed_input::~sealed_input() {
+        close_fd(_fd);
+    }
+
+    std::shared_ptr<const sealed_input> sealed_input::from_memfd(fd_type fd) {
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || !mpp_impl::seal_memfd(fd)) {
+            std::string reason = strerror(errno);
+            close(fd);
+            mpp::throw_ex<mpp::runtime_error>("unable to seal shared input: " + reason);
+        }
+        return std::shared_ptr<const sealed_input>(new sealed_input(fd, static_cast<std::size_t>(st.st_size)));
+    }
+
+    std::shared_ptr<const sealed_input> sealed_input::from_buffer(const void *data, std::size_t size) {
+        int fd = mpp_impl::create_memfd();
+        if (fd < 0) {
+            mpp::throw_ex<mpp::runtime_error>("unable to create memfd: " + std::string(strerror(errno)));
+        }
+        // sized up front, pages are not reallocated while writing
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0
+            || !mpp_impl::write_all(fd, static_cast<const char *>(data), size)) {
+            std::string reason = strerror(errno);
+            close(fd);
+            mpp::throw_ex<mpp::runtime_error>("unable to fill shared input: " + reason);
+        }
+        return from_memfd(fd);
+    }
+
+    std::shared_ptr<const sealed_input> sealed_input::from_file(const std::string &path) {
+        int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st{};
+        if (in < 0 || fstat(in, &st) != 0) {
+            std::string reason = strerror(errno);
+            if (in >= 0) {
+                close(in);
+            }
+            mpp::throw_ex<mpp::runtime_error>("unable to open " + path + ": " + reason);
+        }
+
+        int fd = mpp_impl::create_memfd();
+        if (fd < 0) {
+            close(in);
+            mpp::throw_ex<mpp::runtime_error>("unable to create memfd: " + std::string(strerror(errno)));
+        }
+
+        bool ok = ftruncate(fd, st.st_size) == 0;
+#ifdef MOZART_PLATFORM_LINUX
+        // copied within the kernel
+        auto left = static_cast<std::size_t>(st.st_size);
+        while (ok && left > 0) {
+            ssize_t n = sendfile(fd, in, nullptr, left);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = n > 0;
+            left -= ok ? static_cast<std::size_t>(n) : 0;
+        }
+#endif
+        std::string reason = strerror(errno);
+        close(in);
+        if (!ok) {
+            close(fd);
+            mpp::throw_ex<mpp::runtime_error>("unable to fill shared input: " + reason);
+        }
+        return from_memfd(fd);
+    }
+}
+
+namespace mpp {
+    jobserver::~jobserver() {
+        if (_reader != _read) {
+            close_fd(_reader);
+        }
+        if (!_fifo.empty()) {
+            close_fd(_write);
+            if (_owned) {
+                unlink(_fifo.c_str());
+                rmdir(_fifo.substr(0, _fifo.find_last_of('/')).c_str());
+            }
+        } else if (_owned) {
+            close_fd(_read);
+            close_fd(_write);
+        }
+        close_fd(_wake[PIPE_READ]);
+        close_fd(_wake[PIPE_WRITE]);
+    }
+
+    void jobserver::open_wake() {
+        if (pipe2(_wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+            mpp::throw_ex<mpp::runtime_error>("unable to create jobserver pipe");
+        }
+    }
+
+    void jobserver::wake() {
+        // a full pipe wakes up waiters as well
+        char c = 0;
+        while (write(_wake[PIPE_WRITE], &c, 1) == -1 && errno == EINTR) {
+        }
+    }
+
+    void jobserver::drain_wake() {
+        char buf[64];
+        while (read(_wake[PIPE_READ], buf, sizeof(buf)) > 0) {
+        }
+    }
+
+    int jobserver::read_token(char &byte, int timeout_ms) {
+        struct pollfd fds[2] = {{_reader, POLLIN, 0}, {_wake[PIPE_READ], POLLIN, 0}};
+        int n = poll(fds, 2, timeout_ms);
+        if (n < 0) {
+            return errno == EINTR ? 2 : -1;
+        } else if (n == 0) {
+            return 0;
+        } else if (fds[1].revents != 0) {
+            return 2;
+        }
+
+        // without a description of our own, this blocks
+        // when another process takes the byte first
+        ssize_t r = read(_reader, &byte, 1);
+        if (r == 1) {
+            return 1;
+        }
+        // someone else was faster, or end of file when every writer is gone
+        return r < 0 && (errno == EAGAIN || errno == EINTR) ? 2 : -1;
+    }
+
+    void jobserver::write_token(char byte) {
+        while (write(_write, &byte, 1) == -1 && errno == EINTR) {
+        }
+    }
+
+    std::shared_ptr<jobserver> jobserver::create(std::size_t slots, style s) {
+        if (slots == 0) {
+            mpp::throw_ex<mpp::runtime_error>("jobserver needs at least one slot");
+        }
+        std::shared_ptr<jobserver> server(new jobserver());
+        server->_slots = slots;
+        server->_owned = true;
+
+        if (s == style::pipe) {
+            fd_type fds[2] = {FD_INVALID, FD_INVALID};
+            if (pipe2(fds, O_CLOEXEC) != 0) {
+                mpp::throw_ex<mpp::runtime_error>("unable to create jobserver pipe");
+            }
+            server->_read = fds[PIPE_READ];
+            server->_write = fds[PIPE_WRITE];
+            server->_reader = mpp_impl::reopen_nonblocking(server->_read);
+            if (server->_reader == FD_INVALID) {
+                server->_reader = server->_read;
+            }
+        } else {
+            char dir[] = "/tmp/mpp-jobserver-XXXXXX";
+            if (mkdtemp(dir) == nullptr) {
+                mpp::throw_ex<mpp::runtime_error>("unable to create jobserver directory");
+            }
+            std::string path = std::string(dir) + "/fifo";
+            if (mkfifo(path.c_str(), 0600) != 0) {
+                rmdir(dir);
+                mpp::throw_ex<mpp::runtime_error>("unable to create jobserver fifo");
+            }
+            server->_fifo = path;
+            // the reader first, opening for writing blocks without one
+            server->_reader = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            server->_write = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+            if (server->_reader == FD_INVALID || server->_write == FD_INVALID) {
+                mpp::throw_ex<mpp::runtime_error>("unable to open jobserver fifo");
+            }
+        }
+
+        server->open_wake();
+        for (std::size_t i = 1; i < slots; ++i) {
+            server->write_token('+');
+        }
+        return server;
+    }
+
+    std::shared_ptr<jobserver> jobserver::from_environment() {
+        const char *makeflags = getenv("MAKEFLAGS");
+        std::string auth;
+        std::size_t slots = 0;
+        if (makeflags == nullptr || !mpp_impl::parse_makeflags(makeflags, auth, slots)) {
+            return nullptr;
+        }
+
+        std::shared_ptr<jobserver> server(new jobserver());
+        server->_slots = slots;
+        if (auth.compare(0, 5, "fifo:") == 0) {
+            server->_fifo = auth.substr(5);
+            server->_reader = open(server->_fifo.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (server->_reader == FD_INVALID) {
+                return nullptr;
+            }
+            server->_write = open(server->_fifo.c_str(), O_WRONLY | O_CLOEXEC);
+            if (server->_write == FD_INVALID) {
+                return nullptr;
+            }
+        } else {
+            // make passes negative descriptors to commands it does not
+            // consider recursive, and closes them
+            int r = -1;
+            int w = -1;
+            if (sscanf(auth.c_str(), "%d,%d", &r, &w) != 2 || r < 0 || w < 0
+                || fcntl(r, F_GETFD) == -1 || fcntl(w, F_GETFD) == -1) {
+                return nullptr;
+            }
+            server->_read = r;
+            server->_write = w;
+            server->_reader = mpp_impl::reopen_nonblocking(r);
+            if (server->_reader == FD_INVALID) {
+                server->_reader = r;
+            }
+        }
+        server->open_wake();
+        return server;
+    }
 }
 
 #endif
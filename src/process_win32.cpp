@@ -9,16 +9,63 @@
 #ifdef MOZART_PLATFORM_WIN32
 
 #include <mozart++/process>
+#include <mozart++/process_graph>
+#include <mozart++/drain_loop>
+#include <mozart++/shared_input>
+#include <mozart++/jobserver>
+#include <chrono>
+#include <mutex>
+#include <thread>
 
 #include <Windows.h>
 
 namespace mpp_impl {
+    bool bind_null(stdio_binding &b, int stream) {
+        SECURITY_ATTRIBUTES sa;
+        sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+        sa.bInheritHandle = true;
+        sa.lpSecurityDescriptor = nullptr;
+
+        HANDLE h = CreateFileA("NUL", stream == 0 ? GENERIC_READ : GENERIC_WRITE,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        b._child = h;
+        b._owned = true;
+        return true;
+    }
+
+    bool bind_inherit(stdio_binding &b, int stream) {
+        static const DWORD std_handles[] = {STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE};
+        b._child = GetStdHandle(std_handles[stream]);
+        b._owned = false;
+        return b._child != INVALID_HANDLE_VALUE;
+    }
+
+    bool bind_shared_input(const mpp::sealed_input &input, stdio_binding &b) {
+        mpp::throw_ex<mpp::runtime_error>("shared inputs are not supported on Windows");
+        return false;
+    }
+
+    void bind_detached(const process_startup &startup, stdio_binding *stdio) {
+        mpp::throw_ex<mpp::runtime_error>("detached processes are not supported on Windows");
+    }
+
     void create_process_impl(const process_startup &startup,
-                              process_info &info,
-                              fd_type *pstdin, fd_type *pstdout, fd_type *pstderr) {
+                             process_info &info,
+                             stdio_binding *stdio) {
         STARTUPINFO si;
         PROCESS_INFORMATION pi;
 
+        if (startup._notify_ready) {
+            mpp::throw_ex<mpp::runtime_error>("readiness notification is not supported on Windows");
+        }
+        if (startup._shared_input) {
+            mpp::throw_ex<mpp::runtime_error>("shared inputs are not supported on Windows");
+        }
+
         ZeroMemory(&si, sizeof(si));
         si.cb = sizeof(si);
         si.dwFlags |= STARTF_USESTDHANDLES;
@@ -28,12 +75,16 @@ namespace mpp_impl {
         sa.bInheritHandle = true;
         sa.lpSecurityDescriptor = nullptr;
 
-        if (!SetHandleInformation(pstdin[PIPE_WRITE], HANDLE_FLAG_INHERIT, 0)) {
-            mpp::throw_ex<mpp::runtime_error>("unable to set handle information on stdin");
+        // parent ends of pipes should not be inherited by the child
+        for (int i = 0; i < 3; ++i) {
+            if (stdio[i]._parent != FD_INVALID
+                && !SetHandleInformation(stdio[i]._parent, HANDLE_FLAG_INHERIT, 0)) {
+                mpp::throw_ex<mpp::runtime_error>("unable to set handle information on stdio");
+            }
         }
 
-        si.hStdInput = pstdin[PIPE_READ];
-        si.hStdOutput = pstdout[PIPE_WRITE];
+        si.hStdInput = stdio[0]._child;
+        si.hStdOutput = stdio[1]._child;
 
         /*
          * pay special attention to stderr,
@@ -43,94 +94,335 @@ namespace mpp_impl {
          */
         if (startup.merge_outputs) {
             // redirect stderr to stdout
-            si.hStdError = pstdout[PIPE_WRITE];
+            si.hStdError = stdio[1]._child;
         } else {
             // redirect stderr to a file
-            si.hStdError = pstderr[PIPE_WRITE];
+            si.hStdError = stdio[2]._child;
         }
 
         ZeroMemory(&pi, sizeof(pi));
 
-        std::stringstream ss;
-        for (const auto &s : startup._cmdline) {
-            ss << s << " ";
-        }
+        exec_image image;
+        build_exec_image(startup, image);
 
-        std::string command = ss.str();
+        std::string command;
+        for (auto arg = image._argv.data(); *arg != nullptr; ++arg) {
+            command.append(*arg).push_back(' ');
+        }
 
+        // "key=value" strings back to back, terminated by an empty one.
+        // No environments means inheriting ours.
+        std::string env_block;
         char *envs = nullptr;
-
-        if (!startup._env.empty()) {
-            // starting from 1, which is the block terminator '\0'
-            size_t env_size = 1;
-            for (const auto &e : startup._env) {
-                // need 2 more, which is the '=' and variable terminator '\0'
-                env_size += e.first.length() + e.second.length() + 2;
-            }
-
-            envs = new char[env_size]{0};
-            char *p = envs;
-
-            for (const auto &e : startup._env) {
-                strncat(p, e.first.c_str(), e.first.length());
-                p += e.first.length();
-                *p++ = '=';
-                strncat(p, e.second.c_str(), e.second.length());
-                p += e.second.length();
-                *p++ = '\0'; // variable terminator
-            }
-            *p++ = '\0'; // block terminator
-
-            // ensure envs are copied correctly
-            if (p != envs + env_size) {
-                delete[] envs;
-                mpp::throw_ex<mpp::runtime_error>("unable to copy environment variables");
+        if (image._envp.front() != nullptr) {
+            for (auto env = image._envp.data(); *env != nullptr; ++env) {
+                env_block.append(*env).push_back('\0');
             }
+            env_block.push_back('\0');
+            envs = &env_block[0];
         }
 
         if (!CreateProcess(nullptr, const_cast<char *>(command.c_str()),
                            nullptr, nullptr, true, CREATE_NO_WINDOW, envs,
                            startup._cwd.c_str(), &si, &pi)) {
-            delete[] envs;
             mpp::throw_ex<mpp::runtime_error>("unable to fork subprocess");
         }
 
-        delete[] envs;
-        CloseHandle(pstdin[PIPE_READ]);
-        CloseHandle(pstdout[PIPE_WRITE]);
-        CloseHandle(pstderr[PIPE_WRITE]);
+        // the child has its own copies now
+        for (int i = 0; i < 3; ++i) {
+            if (stdio[i]._owned) {
+                close_fd(stdio[i]._child);
+            }
+        }
 
         info._pid = pi.hProcess;
         info._tid = pi.hThread;
-        info._stdin = pstdin[PIPE_WRITE];
-        info._stdout = pstdout[PIPE_READ];
-        info._stderr = pstderr[PIPE_READ];
+        info._stdin = stdio[0]._parent;
+        info._stdout = stdio[1]._parent;
+        info._stderr = stdio[2]._parent;
     }
 
     void close_process(process_info &info) {
+        if (info._backend != nullptr) {
+            info._backend->close(info);
+            return;
+        }
         mpp_impl::close_fd(info._pid);
         mpp_impl::close_fd(info._tid);
         mpp_impl::close_fd(info._stdin);
         mpp_impl::close_fd(info._stdout);
         mpp_impl::close_fd(info._stderr);
+        mpp_impl::close_fd(info._notify);
+    }
+
+    fd_type exit_fd(process_info &info) {
+        // process handles are signaled when the process exits
+        return info._backend != nullptr ? FD_INVALID : info._pid;
+    }
+
+    int wait_ready(process_info &info, std::string &buffer, int timeout_ms) {
+        return -1;
     }
 
     int wait_for(const process_info &info) {
+        if (info._backend != nullptr) {
+            return info._backend->wait_for(info);
+        }
         WaitForSingleObject(info._pid, INFINITE);
         DWORD code = 0;
         GetExitCodeProcess(info._pid, &code);
         return code;
     }
 
+    bool reap_process(process_info &info, resource_usage &usage) {
+        // nothing to reap, the handle keeps the pid until close_process()
+        if (info._backend != nullptr) {
+            return false;
+        }
+        FILETIME created, exited, kernel, user;
+        if (!GetProcessTimes(info._pid, &created, &exited, &kernel, &user)) {
+            return false;
+        }
+        // in 100 ns units
+        auto ns = [](const FILETIME &t) {
+            return ((static_cast<std::uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) * 100;
+        };
+        usage._user_ns = ns(user);
+        usage._system_ns = ns(kernel);
+        return true;
+    }
+
+    void release_process(const process_info &info) {
+        // closing the handle is all there is to reaping on Windows
+        if (info._destroy_policy == destroy_policy::kill_and_reap) {
+            terminate_process(info, true);
+        }
+    }
+
     void terminate_process(const process_info &info, bool force) {
+        if (info._backend != nullptr) {
+            info._backend->terminate(info, force);
+            return;
+        }
         TerminateProcess(info._pid, 0);
     }
 
+    /**
+     * NtSuspendProcess and NtResumeProcess are undocumented but stable,
+     * and suspend every thread of the process at once.
+     */
+    using nt_process_op = LONG (NTAPI *)(HANDLE);
+
+    static bool call_ntdll(const char *name, const process_info &info) {
+        static HMODULE ntdll = GetModuleHandleA("ntdll.dll");
+        if (ntdll == nullptr) {
+            return false;
+        }
+        auto op = reinterpret_cast<nt_process_op>(GetProcAddress(ntdll, name));
+        return op != nullptr && op(info._pid) >= 0;
+    }
+
+    bool suspend_process(const process_info &info) {
+        if (info._backend != nullptr) {
+            return info._backend->suspend(info);
+        }
+        return call_ntdll("NtSuspendProcess", info);
+    }
+
+    bool resume_process(const process_info &info) {
+        if (info._backend != nullptr) {
+            return info._backend->resume(info);
+        }
+        return call_ntdll("NtResumeProcess", info);
+    }
+
     bool process_exited(const process_info &info) {
+        if (info._backend != nullptr) {
+            return info._backend->exited(info);
+        }
         DWORD code = 0;
         GetExitCodeProcess(info._pid, &code);
         return code != STILL_ACTIVE;
     }
+
+    bool read_io_counters(const process_info &info, io_counters &io) {
+        if (info._backend != nullptr) {
+            return false;
+        }
+        IO_COUNTERS counters;
+        if (!GetProcessIoCounters(info._pid, &counters)) {
+            return false;
+        }
+        io._rchar = counters.ReadTransferCount;
+        io._wchar = counters.WriteTransferCount;
+        return true;
+    }
+
+    std::string detach_state(const process_info &info) {
+        mpp::throw_ex<mpp::runtime_error>("detached processes are not supported on Windows");
+        return std::string();
+    }
+
+    void adopt_process(long pid, const std::string &state, process_info &info) {
+        mpp::throw_ex<mpp::runtime_error>("detached processes are not supported on Windows");
+    }
+
+    bool read_delay_counters(const process_info &info, delay_counters &delays) {
+        // no delay accounting on Windows
+        return false;
+    }
+
+    mpp::ssize_t read_some(fd_type fd, void *buf, std::size_t size) {
+        DWORD n = 0;
+        if (!ReadFile(fd, buf, static_cast<DWORD>(size), &n, nullptr)) {
+            // the write end of a pipe is closed
+            return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+        }
+        return static_cast<mpp::ssize_t>(n);
+    }
+
+    static bool write_all(HANDLE h, const char *data, std::size_t size) {
+        while (size > 0) {
+            DWORD n = 0;
+            if (!WriteFile(h, data, static_cast<DWORD>(size), &n, nullptr)) {
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static constexpr std::size_t PUMP_CHUNK = 64 * 1024;
+
+    void relay_fanout(fd_type from, std::vector<fd_type> to) {
+        // no tee on Windows, copy through user space
+        std::vector<char> buf(PUMP_CHUNK);
+        while (!to.empty()) {
+            mpp::ssize_t n = read_some(from, buf.data(), buf.size());
+            if (n <= 0) {
+                break;
+            }
+            for (auto it = to.begin(); it != to.end();) {
+                if (write_all(*it, buf.data(), static_cast<std::size_t>(n))) {
+                    ++it;
+                } else {
+                    close_fd(*it);
+                    it = to.erase(it);
+                }
+            }
+        }
+        close_fd(from);
+        for (auto h : to) {
+            close_fd(h);
+        }
+    }
+
+    void merge_fanin(std::vector<fd_type> from, fd_type to) {
+        // anonymous pipes cannot be waited for together,
+        // every input gets a reader of its own
+        std::mutex lock;
+        std::vector<std::thread> readers;
+        for (auto h : from) {
+            readers.emplace_back([&lock, h, to]() {
+                std::vector<char> buf(PUMP_CHUNK);
+                std::string pending;
+                mpp::ssize_t n;
+                while ((n = read_some(h, buf.data(), buf.size())) > 0) {
+                    const char *begin = buf.data();
+                    const char *complete = begin + n;
+                    while (complete > begin && complete[-1] != '\n') {
+                        --complete;
+                    }
+                    if (complete > begin || pending.size() >= PUMP_CHUNK) {
+                        pending.append(begin, complete);
+                        std::lock_guard<std::mutex> guard(lock);
+                        write_all(to, pending.data(), pending.size());
+                        pending.clear();
+                    }
+                    pending.append(complete, begin + n);
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                write_all(to, pending.data(), pending.size());
+                close_fd(h);
+            });
+        }
+        for (auto &t : readers) {
+            t.join();
+        }
+        close_fd(to);
+    }
+
+    int wait_readable(const std::vector<fd_type> &fds, std::vector<char> &ready, int timeout_ms) {
+        // anonymous pipes cannot be waited for, peek at them until something arrives
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        ready.assign(fds.size(), 0);
+        while (true) {
+            int n = 0;
+            for (std::size_t i = 0; i < fds.size(); ++i) {
+                DWORD avail = 0;
+                // a broken pipe is ready, ReadFile() reports the end of file
+                ready[i] = !PeekNamedPipe(fds[i], nullptr, 0, nullptr, &avail, nullptr) || avail > 0;
+                n += ready[i];
+            }
+            if (n > 0 || timeout_ms == 0
+                || (timeout_ms > 0 && std::chrono::steady_clock::now() >= deadline)) {
+                return n;
+            }
+            Sleep(1);
+        }
+    }
+}
+
+namespace mpp {
+    sealed_input::~sealed_input() {
+        close_fd(_fd);
+    }
+
+    std::shared_ptr<const sealed_input> sealed_input::from_memfd(fd_type fd) {
+        mpp::throw_ex<mpp::runtime_error>("shared inputs are not supported on Windows");
+        return nullptr;
+    }
+
+    std::shared_ptr<const sealed_input> sealed_input::from_buffer(const void *data, std::size_t size) {
+        mpp::throw_ex<mpp::runtime_error>("shared inputs are not supported on Windows");
+        return nullptr;
+    }
+
+    std::shared_ptr<const sealed_input> sealed_input::from_file(const std::string &path) {
+        mpp::throw_ex<mpp::runtime_error>("shared inputs are not supported on Windows");
+        return nullptr;
+    }
+}
+
+namespace mpp {
+    jobserver::~jobserver() = default;
+
+    void jobserver::open_wake() {
+    }
+
+    void jobserver::wake() {
+    }
+
+    void jobserver::drain_wake() {
+    }
+
+    int jobserver::read_token(char &byte, int timeout_ms) {
+        return -1;
+    }
+
+    void jobserver::write_token(char byte) {
+    }
+
+    std::shared_ptr<jobserver> jobserver::create(std::size_t slots, style s) {
+        mpp::throw_ex<mpp::runtime_error>("jobserver is not supported on Windows");
+        return nullptr;
+    }
+
+    std::shared_ptr<jobserver> jobserver::from_environment() {
+        // make on Windows passes a semaphore, which we do not speak
+        return nullptr;
+    }
 }
 
 #endif
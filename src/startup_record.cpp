@@ -0,0 +1,323 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/startup_record>
+
+#ifdef MOZART_PLATFORM_WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace mpp_impl {
+    static constexpr char STARTUP_FILE_MAGIC[8] = {'M', 'P', 'P', 'Q', 0, 0, 0, 0};
+
+    static void put_u16(std::string &out, std::uint16_t v) {
+        out.push_back(static_cast<char>(v & 0xffu));
+        out.push_back(static_cast<char>(v >> 8u));
+    }
+
+    static void put_u32(std::string &out, std::uint32_t v) {
+        for (unsigned shift = 0; shift < 32; shift += 8) {
+            out.push_back(static_cast<char>((v >> shift) & 0xffu));
+        }
+    }
+
+    static void put_i64(std::string &out, std::int64_t value) {
+        auto v = static_cast<std::uint64_t>(value);
+        for (unsigned shift = 0; shift < 64; shift += 8) {
+            out.push_back(static_cast<char>((v >> shift) & 0xffu));
+        }
+    }
+
+    static std::uint64_t get_le(const char *p, std::size_t n) {
+        std::uint64_t v = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            v |= static_cast<std::uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+        }
+        return v;
+    }
+
+    static void put_string(std::string &out, const char *s, std::size_t n) {
+        out.append(s, n);
+        out.push_back('\0');
+    }
+
+    static std::int64_t encode_target(const redirect_info &r) {
+        if (!r.redirected()) {
+            return -1;
+        }
+#ifdef MOZART_PLATFORM_WIN32
+        return static_cast<std::int64_t>(reinterpret_cast<std::intptr_t>(r._target));
+#else
+        return r._target;
+#endif
+    }
+
+    static void decode_target(std::int64_t target, redirect_info &r) {
+        if (target < 0) {
+            r._target = FD_INVALID;
+            return;
+        }
+#ifdef MOZART_PLATFORM_WIN32
+        r._target = reinterpret_cast<fd_type>(static_cast<std::intptr_t>(target));
+#else
+        r._target = static_cast<fd_type>(target);
+#endif
+    }
+}
+
+namespace mpp {
+    void startup_record::encode(const mpp_impl::process_startup &startup, std::string &out) {
+        std::size_t begin = out.size();
+
+        // argv and envp of a loaded record are already in place
+        mpp_impl::exec_image image;
+        mpp_impl::build_exec_image(startup, image);
+        std::uint32_t argc = 0;
+        std::uint32_t envc = 0;
+        while (image._argv[argc] != nullptr) {
+            ++argc;
+        }
+        while (image._envp[envc] != nullptr) {
+            ++envc;
+        }
+
+        std::uint16_t flags = (startup.merge_outputs ? static_cast<unsigned>(STARTUP_MERGE_OUTPUTS) : 0u)
+                              | (startup._new_process_group ? static_cast<unsigned>(STARTUP_NEW_PROCESS_GROUP) : 0u)
+                              | (startup._low_priority ? static_cast<unsigned>(STARTUP_LOW_PRIORITY) : 0u)
+                              | (startup._notify_ready ? static_cast<unsigned>(STARTUP_NOTIFY_READY) : 0u)
+                              | (startup._exit_accounting ? static_cast<unsigned>(STARTUP_EXIT_ACCOUNTING) : 0u);
+
+        // size is filled in at the end
+        mpp_impl::put_u32(out, 0);
+        mpp_impl::put_u16(out, VERSION);
+        mpp_impl::put_u16(out, flags);
+        mpp_impl::put_u32(out, argc);
+        mpp_impl::put_u32(out, envc);
+        mpp_impl::put_i64(out, mpp_impl::encode_target(startup._stdin));
+        mpp_impl::put_i64(out, mpp_impl::encode_target(startup._stdout));
+        mpp_impl::put_i64(out, mpp_impl::encode_target(startup._stderr));
+
+        mpp_impl::put_string(out, startup._cwd.data(), startup._cwd.size());
+        mpp_impl::put_string(out, startup._cgroup.data(), startup._cgroup.size());
+        mpp_impl::put_string(out, startup._job_class.data(), startup._job_class.size());
+        for (std::uint32_t i = 0; i < argc; ++i) {
+            mpp_impl::put_string(out, image._argv[i], std::strlen(image._argv[i]));
+        }
+        for (std::uint32_t i = 0; i < envc; ++i) {
+            mpp_impl::put_string(out, image._envp[i], std::strlen(image._envp[i]));
+        }
+
+        out.append((4 - (out.size() - begin) % 4) % 4, '\0');
+        auto size = static_cast<std::uint32_t>(out.size() - begin);
+        for (unsigned i = 0; i < 4; ++i) {
+            out[begin + i] = static_cast<char>((size >> (8 * i)) & 0xffu);
+        }
+    }
+
+    std::size_t startup_record::parse(const char *data, std::size_t size) {
+        *this = startup_record();
+        if (size < HEADER_SIZE) {
+            return 0;
+        }
+
+        auto record_size = static_cast<std::size_t>(mpp_impl::get_le(data, 4));
+        if (record_size < HEADER_SIZE || record_size > size || record_size % 4 != 0
+            || mpp_impl::get_le(data + 4, 2) != VERSION) {
+            return 0;
+        }
+
+        auto flags = static_cast<std::uint16_t>(mpp_impl::get_le(data + 6, 2));
+        auto argc = static_cast<std::uint32_t>(mpp_impl::get_le(data + 8, 4));
+        auto envc = static_cast<std::uint32_t>(mpp_impl::get_le(data + 12, 4));
+
+        // every string must be terminated inside the record,
+        // only padding may follow the last one
+        const char *p = data + HEADER_SIZE;
+        const char *end = data + record_size;
+        const char *strings[3];
+        const char *args = nullptr;
+        const char *envs = nullptr;
+        std::uint64_t count = 3ull + argc + envc;
+        for (std::uint64_t i = 0; i < count; ++i) {
+            auto nul = static_cast<const char *>(std::memchr(p, '\0', end - p));
+            if (nul == nullptr) {
+                return 0;
+            }
+            if (i < 3) {
+                strings[i] = p;
+            } else if (i == 3) {
+                args = p;
+            }
+            if (i == 3ull + argc) {
+                envs = p;
+            }
+            p = nul + 1;
+        }
+        if (end - p >= 4) {
+            return 0;
+        }
+
+        _data = data;
+        _size = record_size;
+        _flags = flags;
+        _argc = argc;
+        _envc = envc;
+        for (int i = 0; i < 3; ++i) {
+            _redirect[i] = static_cast<std::int64_t>(mpp_impl::get_le(data + 16 + 8 * i, 8));
+        }
+        _cwd = strings[0];
+        _cgroup = strings[1];
+        _job_class = strings[2];
+        _args = args;
+        _envs = envs;
+        return record_size;
+    }
+
+    void startup_record::build_image(mpp_impl::exec_image &image) const {
+        image._storage.clear();
+        image._argv.clear();
+        image._argv.reserve(_argc + 2);
+        for_each_arg([&](const char *arg) {
+            image._argv.push_back(arg);
+        });
+        image._argv.push_back(nullptr);
+        image._argv.push_back(nullptr);
+
+        image._envp.clear();
+        image._envp.reserve(_envc + 1);
+        for_each_env([&](const char *env) {
+            image._envp.push_back(env);
+        });
+        image._envp.push_back(nullptr);
+    }
+
+    void process_builder::save(std::string &out) const {
+        startup_record::encode(_startup, out);
+    }
+
+    process_builder &process_builder::load(const startup_record &record) {
+        if (!record.valid()) {
+            mpp::throw_ex<mpp::runtime_error>("invalid startup record");
+        }
+
+        auto image = std::make_shared<mpp_impl::exec_image>();
+        record.build_image(*image);
+        _startup._image = std::move(image);
+
+        _startup._cwd = record.cwd();
+        _startup._cgroup = record.cgroup();
+        _startup._job_class = record.job_class();
+        mpp_impl::decode_target(record.redirect_target(0), _startup._stdin);
+        mpp_impl::decode_target(record.redirect_target(1), _startup._stdout);
+        mpp_impl::decode_target(record.redirect_target(2), _startup._stderr);
+
+        std::uint16_t flags = record.flags();
+        _startup.merge_outputs = (flags & STARTUP_MERGE_OUTPUTS) != 0;
+        _startup._new_process_group = (flags & STARTUP_NEW_PROCESS_GROUP) != 0;
+        _startup._low_priority = (flags & STARTUP_LOW_PRIORITY) != 0;
+        _startup._notify_ready = (flags & STARTUP_NOTIFY_READY) != 0;
+        _startup._exit_accounting = (flags & STARTUP_EXIT_ACCOUNTING) != 0;
+        return *this;
+    }
+
+    startup_file::startup_file(const std::string &path) {
+#ifdef MOZART_PLATFORM_WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            mpp::throw_ex<mpp::runtime_error>("unable to open startup file: " + path);
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart < sizeof(mpp_impl::STARTUP_FILE_MAGIC)) {
+            CloseHandle(file);
+            mpp::throw_ex<mpp::runtime_error>("not a startup file: " + path);
+        }
+
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        void *data = mapping == nullptr ? nullptr : MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data == nullptr) {
+            if (mapping != nullptr) {
+                CloseHandle(mapping);
+            }
+            mpp::throw_ex<mpp::runtime_error>("unable to map startup file: " + path);
+        }
+        _mapping = mapping;
+        _size = static_cast<std::size_t>(size.QuadPart);
+#else
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            mpp::throw_ex<mpp::runtime_error>("unable to open startup file: " + path);
+        }
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(mpp_impl::STARTUP_FILE_MAGIC))) {
+            close(fd);
+            mpp::throw_ex<mpp::runtime_error>("not a startup file: " + path);
+        }
+
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            mpp::throw_ex<mpp::runtime_error>("unable to map startup file: " + path);
+        }
+        _size = static_cast<std::size_t>(st.st_size);
+#endif
+        _data = static_cast<const char *>(data);
+
+        if (std::memcmp(_data, mpp_impl::STARTUP_FILE_MAGIC, sizeof(mpp_impl::STARTUP_FILE_MAGIC)) != 0) {
+            unmap();
+            mpp::throw_ex<mpp::runtime_error>("not a startup file: " + path);
+        }
+        rewind();
+    }
+
+    startup_file::~startup_file() {
+        unmap();
+    }
+
+    void startup_file::unmap() {
+        if (_data == nullptr) {
+            return;
+        }
+#ifdef MOZART_PLATFORM_WIN32
+        UnmapViewOfFile(_data);
+        CloseHandle(_mapping);
+#else
+        munmap(const_cast<char *>(_data), _size);
+#endif
+        _data = nullptr;
+    }
+
+    bool startup_file::next(startup_record &record) {
+        if (_offset == _size) {
+            return false;
+        }
+        std::size_t n = record.parse(_data + _offset, _size - _offset);
+        if (n == 0) {
+            mpp::throw_ex<mpp::runtime_error>("corrupted startup record at offset "
+                                              + std::to_string(_offset));
+        }
+        _offset += n;
+        return true;
+    }
+
+    void startup_file::rewind() {
+        _offset = sizeof(mpp_impl::STARTUP_FILE_MAGIC);
+    }
+
+    void startup_file::write_header(std::string &out) {
+        out.append(mpp_impl::STARTUP_FILE_MAGIC, sizeof(mpp_impl::STARTUP_FILE_MAGIC));
+    }
+}
@@ -0,0 +1,232 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/stdio_replay>
+#include <mozart++/process_trace>
+#include <algorithm>
+#include <cstring>
+#include <streambuf>
+
+namespace mpp_impl {
+    /**
+     * Stdio recordings start with "MPPR" and a version byte, followed
+     * by chunks: the kind byte, the time as varint, then the size
+     * and the bytes of data, or the zigzagged exit code.
+     */
+    static constexpr char STDIO_RECORDING_MAGIC[4] = {'M', 'P', 'P', 'R'};
+    static constexpr std::uint8_t STDIO_RECORDING_VERSION = 1;
+
+    /**
+     * Largest chunk accepted by the reader, larger ones are corrupted.
+     */
+    static constexpr std::uint64_t MAX_CHUNK_SIZE = 64u << 20u;
+
+    /**
+     * Passes reads through the stream buffer of fdistream,
+     * or of a filter, taking whatever the last read brought in.
+     */
+    class recording_inbuf : public std::streambuf {
+    private:
+        static constexpr std::size_t BUFFER_SIZE = 64 * 1024;
+
+        std::streambuf *_inner;
+        std::unique_ptr<std::streambuf> _owned;
+        std::shared_ptr<mpp::stdio_recorder> _recorder;
+        mpp::stdio_chunk_kind _kind;
+        char _buffer[BUFFER_SIZE];
+
+    protected:
+        int_type underflow() override {
+            if (gptr() < egptr()) {
+                return traits_type::to_int_type(*gptr());
+            }
+
+            // blocks until the inner buffer has something
+            if (traits_type::eq_int_type(_inner->sgetc(), traits_type::eof())) {
+                return traits_type::eof();
+            }
+            std::streamsize avail = std::max<std::streamsize>(_inner->in_avail(), 1);
+            std::streamsize n = _inner->sgetn(_buffer, std::min<std::streamsize>(avail, BUFFER_SIZE));
+            if (n <= 0) {
+                return traits_type::eof();
+            }
+
+            _recorder->write(_kind, _buffer, static_cast<std::size_t>(n));
+            setg(_buffer, _buffer, _buffer + n);
+            return traits_type::to_int_type(*gptr());
+        }
+
+    public:
+        recording_inbuf(std::streambuf *inner, std::unique_ptr<std::streambuf> owned,
+                        std::shared_ptr<mpp::stdio_recorder> recorder, mpp::stdio_chunk_kind kind)
+            : _inner(inner), _owned(std::move(owned)), _recorder(std::move(recorder)), _kind(kind) {}
+    };
+
+    /**
+     * Unbuffered: the stream of stdin goes away together with
+     * its fd, there would be no chance to flush at destruction.
+     */
+    class recording_outbuf : public std::streambuf {
+    private:
+        std::streambuf *_inner;
+        std::unique_ptr<std::streambuf> _owned;
+        std::shared_ptr<mpp::stdio_recorder> _recorder;
+
+    protected:
+        int_type overflow(int_type c) override {
+            if (traits_type::eq_int_type(c, traits_type::eof())) {
+                return traits_type::not_eof(c);
+            }
+            char ch = traits_type::to_char_type(c);
+            return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+        }
+
+        std::streamsize xsputn(const char *s, std::streamsize n) override {
+            std::streamsize written = _inner->sputn(s, n);
+            if (written > 0) {
+                _recorder->write(mpp::STDIO_CHUNK_STDIN, s, static_cast<std::size_t>(written));
+            }
+            return written;
+        }
+
+        int sync() override {
+            return _inner->pubsync();
+        }
+
+    public:
+        recording_outbuf(std::streambuf *inner, std::unique_ptr<std::streambuf> owned,
+                         std::shared_ptr<mpp::stdio_recorder> recorder)
+            : _inner(inner), _owned(std::move(owned)), _recorder(std::move(recorder)) {}
+    };
+
+    std::shared_ptr<mpp::stdio_recorder> open_stdio_recorder(const std::string &path) {
+        return std::make_shared<mpp::stdio_recorder>(path);
+    }
+
+    std::unique_ptr<std::streambuf> make_recording_buf(std::streambuf *inner,
+                                                       std::unique_ptr<std::streambuf> owned,
+                                                       std::shared_ptr<mpp::stdio_recorder> recorder,
+                                                       int stream) {
+        if (stream == 0) {
+            return std::make_unique<recording_outbuf>(inner, std::move(owned), std::move(recorder));
+        }
+        return std::make_unique<recording_inbuf>(inner, std::move(owned), std::move(recorder),
+                                                 static_cast<mpp::stdio_chunk_kind>(stream));
+    }
+
+    void record_exit(mpp::stdio_recorder &recorder, int exit_code) {
+        recorder.exited(exit_code);
+    }
+
+    void finish_recording(mpp::stdio_recorder &recorder) {
+        recorder.finish();
+    }
+}
+
+namespace mpp {
+    stdio_recorder::stdio_recorder(const std::string &path)
+        : _epoch(clock::now()) {
+        _file = std::fopen(path.c_str(), "wb");
+        if (_file == nullptr) {
+            mpp::throw_ex<mpp::runtime_error>("unable to create stdio recording: " + path);
+        }
+        std::fwrite(mpp_impl::STDIO_RECORDING_MAGIC, 1, sizeof(mpp_impl::STDIO_RECORDING_MAGIC), _file);
+        std::fputc(mpp_impl::STDIO_RECORDING_VERSION, _file);
+    }
+
+    stdio_recorder::~stdio_recorder() {
+        std::fclose(_file);
+    }
+
+    std::uint64_t stdio_recorder::elapsed_us(clock::time_point now) const {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - _epoch).count());
+    }
+
+    void stdio_recorder::write(stdio_chunk_kind kind, const char *data, std::size_t size) {
+        auto now = clock::now();
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_finished) {
+            return;
+        }
+        // threads may take the lock out of order
+        _last_us = std::max(_last_us, elapsed_us(now));
+        std::fputc(kind, _file);
+        mpp_impl::write_varint(_file, _last_us);
+        mpp_impl::write_varint(_file, size);
+        std::fwrite(data, 1, size, _file);
+    }
+
+    void stdio_recorder::exited(int exit_code) {
+        auto now = clock::now();
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_exited) {
+            return;
+        }
+        _exited = true;
+        _exit_code = exit_code;
+        _exit_us = elapsed_us(now);
+    }
+
+    void stdio_recorder::finish() {
+        auto now = clock::now();
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_finished) {
+            return;
+        }
+        _finished = true;
+        std::fputc(STDIO_CHUNK_EXIT, _file);
+        mpp_impl::write_varint(_file, std::max(_last_us, _exited ? _exit_us : elapsed_us(now)));
+        mpp_impl::write_varint(_file, mpp_impl::zigzag(_exit_code));
+        std::fflush(_file);
+    }
+
+    stdio_replay_reader::stdio_replay_reader(const std::string &path) {
+        _file = std::fopen(path.c_str(), "rb");
+        if (_file == nullptr) {
+            mpp::throw_ex<mpp::runtime_error>("unable to open stdio recording: " + path);
+        }
+
+        char magic[sizeof(mpp_impl::STDIO_RECORDING_MAGIC)] = {0};
+        if (std::fread(magic, 1, sizeof(magic), _file) != sizeof(magic)
+            || std::memcmp(magic, mpp_impl::STDIO_RECORDING_MAGIC, sizeof(magic)) != 0
+            || std::fgetc(_file) != mpp_impl::STDIO_RECORDING_VERSION) {
+            std::fclose(_file);
+            mpp::throw_ex<mpp::runtime_error>("not a stdio recording: " + path);
+        }
+    }
+
+    stdio_replay_reader::~stdio_replay_reader() {
+        std::fclose(_file);
+    }
+
+    bool stdio_replay_reader::next(stdio_chunk &chunk) {
+        int kind = std::fgetc(_file);
+        if (kind == EOF || kind > STDIO_CHUNK_EXIT) {
+            return false;
+        }
+        chunk._kind = static_cast<std::uint8_t>(kind);
+        if (!mpp_impl::read_varint(_file, chunk._time_us)) {
+            return false;
+        }
+
+        std::uint64_t value = 0;
+        if (!mpp_impl::read_varint(_file, value)) {
+            return false;
+        }
+        if (kind == STDIO_CHUNK_EXIT) {
+            chunk._data.clear();
+            chunk._exit_code = mpp_impl::unzigzag(value);
+            return true;
+        }
+        if (value > mpp_impl::MAX_CHUNK_SIZE) {
+            return false;
+        }
+        chunk._data.resize(static_cast<std::size_t>(value));
+        return value == 0 || std::fread(&chunk._data[0], 1, chunk._data.size(), _file) == chunk._data.size();
+    }
+}
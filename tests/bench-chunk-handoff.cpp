@@ -0,0 +1,170 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/chunk_queue>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Hands output from one draining thread to parser threads, comparing
+ * std::string copies through a mutex-protected queue with pooled chunks
+ * through a lock-free queue. Draining is simulated by memcpy from a
+ * prepared buffer, parsing counts newlines.
+ *
+ * usage: bench-chunk-handoff [MiB=512] [parsers=4] [chunk KiB=64]
+ */
+
+using bench_clock = std::chrono::steady_clock;
+
+static std::uint64_t count_lines(const char *data, std::size_t size) {
+    std::uint64_t n = 0;
+    for (const char *p = data, *end = data + size;
+         (p = static_cast<const char *>(std::memchr(p, '\n', end - p))) != nullptr; ++p) {
+        ++n;
+    }
+    return n;
+}
+
+static double run_locked(const std::string &source, std::size_t chunks, int parsers, std::uint64_t &lines) {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<std::string> queue;
+    bool done = false;
+    std::atomic<std::uint64_t> counted{0};
+
+    auto begin = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < parsers; ++i) {
+        threads.emplace_back([&]() {
+            while (true) {
+                std::string s;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    cv.wait(guard, [&]() { return done || !queue.empty(); });
+                    if (queue.empty()) {
+                        return;
+                    }
+                    s = std::move(queue.front());
+                    queue.pop_front();
+                }
+                cv.notify_all();
+                counted += count_lines(s.data(), s.size());
+            }
+        });
+    }
+
+    for (std::size_t i = 0; i < chunks; ++i) {
+        std::string s(source);
+        std::unique_lock<std::mutex> guard(lock);
+        // bounded like the lock-free one
+        cv.wait(guard, [&]() { return queue.size() < 64; });
+        queue.push_back(std::move(s));
+        guard.unlock();
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
+    }
+    cv.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+    lines = counted;
+    return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+static double run_lock_free(const std::string &source, std::size_t chunks, int parsers, std::uint64_t &lines) {
+    mpp::chunk_pool pool(128, source.size());
+    mpp::mpmc_queue<mpp::chunk_ref> queue(64);
+    std::atomic<bool> done{false};
+    std::atomic<std::uint64_t> counted{0};
+
+    auto begin = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < parsers; ++i) {
+        threads.emplace_back([&]() {
+            mpp::chunk_ref chunk;
+            std::uint64_t n = 0;
+            while (true) {
+                bool finished = done.load();
+                if (!queue.try_pop(chunk)) {
+                    if (finished) {
+                        break;
+                    }
+                    std::this_thread::yield();
+                    continue;
+                }
+                n += count_lines(chunk.data(), chunk.size());
+                chunk.reset();
+            }
+            counted += n;
+        });
+    }
+
+    for (std::size_t i = 0; i < chunks; ++i) {
+        mpp::chunk_ref chunk;
+        while (!(chunk = pool.acquire())) {
+            std::this_thread::yield();
+        }
+        std::memcpy(chunk.data(), source.data(), source.size());
+        chunk.resize(source.size());
+        while (!queue.try_push(std::move(chunk))) {
+            std::this_thread::yield();
+        }
+    }
+    done = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+    lines = counted;
+    return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+int main(int argc, const char **argv) {
+    std::size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 512;
+    int parsers = argc > 2 ? std::atoi(argv[2]) : 4;
+    std::size_t chunk_size = (argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 64) * 1024;
+    if (parsers <= 0) {
+        parsers = 1;
+    }
+    if (chunk_size == 0) {
+        chunk_size = 1024;
+    }
+
+    std::string source;
+    while (source.size() < chunk_size) {
+        source += "[info] worker " + std::to_string(source.size() % 97) + " processed a request\n";
+    }
+    source.resize(chunk_size);
+    std::size_t chunks = mib * 1024 * 1024 / chunk_size;
+
+    std::uint64_t locked_lines = 0;
+    std::uint64_t lock_free_lines = 0;
+    double locked_s = run_locked(source, chunks, parsers, locked_lines);
+    double lock_free_s = run_lock_free(source, chunks, parsers, lock_free_lines);
+    double mb = static_cast<double>(chunks) * chunk_size / 1048576.0;
+
+    printf("{\n");
+    printf("  \"mib\": %.0f,\n", mb);
+    printf("  \"parsers\": %d,\n", parsers);
+    printf("  \"chunk_kib\": %zu,\n", chunk_size / 1024);
+    printf("  \"locked_mib_per_s\": %.1f,\n", mb / locked_s);
+    printf("  \"lock_free_mib_per_s\": %.1f\n", mb / lock_free_s);
+    printf("}\n");
+
+    return locked_lines == lock_free_lines ? 0 : 1;
+}
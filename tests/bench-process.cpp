@@ -0,0 +1,159 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/process>
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <vector>
+
+/**
+ * Hot-path benchmarks of the process module.
+ * Results are printed as a single flat JSON object so that
+ * tests/perf-check.cmake can compare them against tests/perf-baseline.json.
+ */
+
+#ifdef MOZART_PLATFORM_WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+using mpp::process;
+using mpp::process_builder;
+using bench_clock = std::chrono::steady_clock;
+
+static double elapsed_us(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+static double cpu_time_us() {
+    return static_cast<double>(std::clock()) * 1000000.0 / CLOCKS_PER_SEC;
+}
+
+/**
+ * Mean time of start() + wait_for() on a child that exits immediately.
+ */
+static double bench_spawn(int times) {
+    auto start = bench_clock::now();
+    for (int i = 0; i < times; ++i) {
+        process p = process_builder().command("true").start();
+        p.wait_for();
+    }
+    return elapsed_us(start) / times;
+}
+
+/**
+ * Throughput of draining a child's stdout through process::out(), in MiB/s.
+ */
+static double bench_pipe_read(std::size_t bytes) {
+    std::vector<char> buffer(64 * 1024);
+    std::size_t total = 0;
+
+    auto start = bench_clock::now();
+    process p = process_builder().command("head")
+        .arguments(std::vector<std::string>{"-c", std::to_string(bytes), "/dev/zero"})
+        .start();
+
+    while (p.out().read(buffer.data(), buffer.size()) || p.out().gcount() > 0) {
+        total += static_cast<std::size_t>(p.out().gcount());
+    }
+    p.wait_for();
+
+    if (total != bytes) {
+        fprintf(stderr, "bench-process: short read: %zu of %zu bytes\n", total, bytes);
+        exit(1);
+    }
+    return static_cast<double>(bytes) / (1024.0 * 1024.0) / (elapsed_us(start) / 1000000.0);
+}
+
+/**
+ * Throughput of feeding a child's stdin through process::in(), in MiB/s.
+ */
+static double bench_pipe_write(std::size_t bytes) {
+    std::vector<char> buffer(64 * 1024, 'x');
+    FILE *null_out = fopen(NULL_DEVICE, "w");
+    if (null_out == nullptr) {
+        fprintf(stderr, "bench-process: unable to open " NULL_DEVICE ": %s\n", strerror(errno));
+        exit(1);
+    }
+
+    auto start = bench_clock::now();
+    process p = process_builder().command("head")
+        .arguments(std::vector<std::string>{"-c", std::to_string(bytes)})
+        .redirect_stdout(fileno(null_out))
+        .start();
+
+    for (std::size_t written = 0; written < bytes; written += buffer.size()) {
+        std::size_t n = std::min(buffer.size(), bytes - written);
+        p.in().write(buffer.data(), static_cast<std::streamsize>(n));
+    }
+    p.in().flush();
+    p.wait_for();
+
+    double used = elapsed_us(start);
+    fclose(null_out);
+    return static_cast<double>(bytes) / (1024.0 * 1024.0) / (used / 1000000.0);
+}
+
+/**
+ * How late wait_for() returns after a child that sleeps for 20ms,
+ * and how much parent CPU time is burnt while waiting.
+ */
+static void bench_wait(int times, double &overshoot_us, double &cpu_us) {
+    constexpr double SLEEP_US = 20000;
+    overshoot_us = 0;
+    cpu_us = 0;
+
+    for (int i = 0; i < times; ++i) {
+        process p = process_builder().command("sleep")
+            .arguments(std::vector<std::string>{"0.02"})
+            .start();
+
+        auto start = bench_clock::now();
+        double cpu_start = cpu_time_us();
+        p.wait_for();
+        cpu_us += cpu_time_us() - cpu_start;
+        overshoot_us += std::max(0.0, elapsed_us(start) - SLEEP_US);
+    }
+
+    overshoot_us /= times;
+    cpu_us /= times;
+}
+
+int main(int argc, const char **argv) {
+    // scale factor for quick local runs: bench-process 0.1
+    double scale = argc > 1 ? atof(argv[1]) : 1.0;
+    if (scale <= 0) {
+        scale = 1.0;
+    }
+
+    int spawn_times = std::max(1, static_cast<int>(200 * scale));
+    int wait_times = std::max(1, static_cast<int>(20 * scale));
+    auto pipe_bytes = static_cast<std::size_t>(256 * 1024 * 1024 * scale);
+
+    double spawn_us = bench_spawn(spawn_times);
+    double read_mibps = bench_pipe_read(pipe_bytes);
+    double write_mibps = bench_pipe_write(pipe_bytes);
+    double wait_overshoot_us = 0;
+    double wait_cpu_us = 0;
+    bench_wait(wait_times, wait_overshoot_us, wait_cpu_us);
+
+    printf("{\n");
+    printf("  \"spawn_us\": %.2f,\n", spawn_us);
+    printf("  \"pipe_read_mibps\": %.2f,\n", read_mibps);
+    printf("  \"pipe_write_mibps\": %.2f,\n", write_mibps);
+    printf("  \"wait_overshoot_us\": %.2f,\n", wait_overshoot_us);
+    printf("  \"wait_cpu_us\": %.2f\n", wait_cpu_us);
+    printf("}\n");
+    return 0;
+}
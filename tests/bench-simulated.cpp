@@ -0,0 +1,94 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/process_sim>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Runs a simple fixed-concurrency scheduler over simulated processes:
+ * keeps up to N jobs running, reaps whatever has exited, and starts more.
+ * Reports the throughput of the scheduling and reaping path of the
+ * library with process creation itself taken out of the picture.
+ *
+ * usage: bench-simulated [jobs=1000000] [concurrency=256]
+ *
+ * Runtimes are drawn from a fixed-seed generator, the virtual makespan
+ * is the same on every run.
+ */
+
+using mpp::process;
+using mpp::process_builder;
+using bench_clock = std::chrono::steady_clock;
+
+int main(int argc, const char **argv) {
+    std::uint64_t jobs = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::size_t concurrency = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 256;
+    if (concurrency == 0) {
+        concurrency = 1;
+    }
+
+    // 1 ms to ~1 s, a few percent of the jobs fail
+    std::uint64_t seed = 88172645463325252ull;
+    mpp::simulated_backend sim([&seed](const mpp::process_startup &) {
+        seed ^= seed << 13u;
+        seed ^= seed >> 7u;
+        seed ^= seed << 17u;
+        mpp::simulated_outcome o;
+        o._runtime_us = 1000 + seed % 1000000;
+        o._exit_code = seed % 97 == 0 ? 1 : 0;
+        return o;
+    });
+    sim.install();
+
+    process_builder builder;
+    builder.command("job").arguments(std::vector<std::string>{"--simulated"});
+
+    // the backend tells which processes exited, no handle is polled
+    std::unordered_map<mpp::fd_type, process> running;
+    std::vector<mpp::fd_type> exited;
+    std::uint64_t started = 0;
+    std::uint64_t reaped = 0;
+    std::uint64_t failed = 0;
+
+    auto begin = bench_clock::now();
+    while (reaped < jobs) {
+        while (running.size() < concurrency && started < jobs) {
+            process p = builder.start();
+            mpp::fd_type pid = p.pid();
+            running.emplace(pid, std::move(p));
+            ++started;
+        }
+
+        exited.clear();
+        sim.advance_to_next_exit(exited);
+        for (auto pid : exited) {
+            auto it = running.find(pid);
+            failed += it->second.wait_for() != 0 ? 1 : 0;
+            ++reaped;
+            running.erase(it);
+        }
+    }
+    double wall_s = std::chrono::duration<double>(bench_clock::now() - begin).count();
+
+    printf("{\n");
+    printf("  \"jobs\": %llu,\n", static_cast<unsigned long long>(jobs));
+    printf("  \"concurrency\": %zu,\n", concurrency);
+    printf("  \"failed\": %llu,\n", static_cast<unsigned long long>(failed));
+    printf("  \"virtual_makespan_s\": %.3f,\n", sim.now_us() / 1e6);
+    printf("  \"wall_s\": %.3f,\n", wall_s);
+    printf("  \"jobs_per_s\": %.0f\n", jobs / wall_s);
+    printf("}\n");
+
+    sim.uninstall();
+    return sim.open_processes() == 0 ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/process>
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#ifndef MOZART_PLATFORM_WIN32
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+/**
+ * Keeps up to N sleeping children alive through process_builder and reports
+ * the per-child overhead of the library:
+ *      - parent memory (RSS) per handle
+ *      - parent file descriptors per handle
+ *      - spawn rate as the number of live children grows
+ *      - reap throughput when all children exit together
+ *
+ * usage: bench-stress-children [max-children=100000] [--null-stdio]
+ *
+ * Spawning stops early at the first failure (usually RLIMIT_NPROC,
+ * RLIMIT_NOFILE or pid_max), the report covers the children we got.
+ */
+
+using mpp::process;
+using mpp::process_builder;
+using bench_clock = std::chrono::steady_clock;
+
+#ifndef MOZART_PLATFORM_WIN32
+
+static long resident_bytes() {
+    long pages = 0;
+    long resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr) {
+        return 0;
+    }
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static long open_descriptors() {
+    long count = 0;
+    DIR *dp = opendir("/proc/self/fd");
+    if (dp == nullptr) {
+        return 0;
+    }
+    while (readdir(dp) != nullptr) {
+        ++count;
+    }
+    closedir(dp);
+    // ".", ".." and the descriptor used by opendir() itself
+    return count - 3;
+}
+
+static void raise_fd_limit() {
+    struct rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, const char **argv) {
+    std::size_t max_children = 100000;
+    bool null_stdio = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--null-stdio") == 0) {
+            null_stdio = true;
+        } else {
+            max_children = strtoul(argv[i], nullptr, 10);
+        }
+    }
+
+    raise_fd_limit();
+    FILE *null_dev = fopen("/dev/null", "r+");
+    if (null_dev == nullptr) {
+        fprintf(stderr, "bench-stress-children: unable to open /dev/null: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // report spawn rate every 1% of the target, but not too often
+    std::size_t bucket = std::max<std::size_t>(100, max_children / 100);
+
+    std::vector<process> children;
+    children.reserve(max_children);
+
+    long base_rss = resident_bytes();
+    long base_fds = open_descriptors();
+
+    printf("# live-children spawn-rate(/s) rss-per-handle(B) fds-per-handle\n");
+
+    auto bucket_start = bench_clock::now();
+    auto spawn_start = bucket_start;
+    while (children.size() < max_children) {
+        try {
+            process_builder builder;
+            builder.command("sleep").arguments(std::vector<std::string>{"3600"});
+            if (null_stdio) {
+                builder.redirect_stdin(fileno(null_dev))
+                    .redirect_stdout(fileno(null_dev))
+                    .redirect_stderr(fileno(null_dev));
+            }
+            children.emplace_back(builder.start());
+        } catch (const mpp::runtime_error &e) {
+            printf("# spawn stopped at %zu children: %s\n", children.size(), e.what());
+            break;
+        }
+
+        if (children.size() % bucket == 0) {
+            auto now = bench_clock::now();
+            double secs = std::chrono::duration<double>(now - bucket_start).count();
+            printf("%zu %.1f %.1f %.2f\n", children.size(), bucket / secs,
+                   static_cast<double>(resident_bytes() - base_rss) / children.size(),
+                   static_cast<double>(open_descriptors() - base_fds) / children.size());
+            fflush(stdout);
+            bucket_start = bench_clock::now();
+        }
+    }
+
+    double spawn_secs = std::chrono::duration<double>(bench_clock::now() - spawn_start).count();
+    std::size_t live = children.size();
+    if (live == 0) {
+        return 1;
+    }
+
+    printf("# children:         %zu\n", live);
+    printf("# spawn rate:       %.1f children/s\n", live / spawn_secs);
+    printf("# rss per handle:   %.1f bytes\n",
+           static_cast<double>(resident_bytes() - base_rss) / live);
+    printf("# fds per handle:   %.2f\n",
+           static_cast<double>(open_descriptors() - base_fds) / live);
+
+    // make them all exit together, then reap
+    for (auto &p : children) {
+        p.interrupt(true);
+    }
+
+    auto reap_start = bench_clock::now();
+    for (auto &p : children) {
+        p.wait_for();
+    }
+    double reap_secs = std::chrono::duration<double>(bench_clock::now() - reap_start).count();
+    printf("# reap throughput:  %.1f children/s\n", live / reap_secs);
+
+    auto release_start = bench_clock::now();
+    children.clear();
+    double release_secs = std::chrono::duration<double>(bench_clock::now() - release_start).count();
+    printf("# handle release:   %.1f handles/s\n", live / release_secs);
+
+    fclose(null_dev);
+    return 0;
+}
+
+#else
+
+int main() {
+    printf("bench-stress-children: not supported on this platform\n");
+    return 0;
+}
+
+#endif
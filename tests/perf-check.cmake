@@ -0,0 +1,75 @@
+# Mozart++ System Module: performance regression gate
+#
+# Runs a benchmark that prints a flat JSON object of metrics and compares
+# every metric listed in the baseline file against its tolerance band:
+#
+#   "metric": { "baseline": 100, "tolerance": 50, "better": "lower" }
+#
+# baseline is an integer in the unit of the metric, tolerance is in percent.
+# A "lower" metric fails above baseline * (100 + tolerance) / 100,
+# a "higher" metric fails below baseline * (100 - tolerance) / 100.
+#
+# Usage:
+#   cmake -DBENCH=<executable> -DBASELINE=<json> [-DBENCH_ARGS=<args>] -P perf-check.cmake
+#
+# Configure with -DMOZART_PERF_TESTS=ON to run it as: ctest -L perf
+
+cmake_minimum_required(VERSION 3.19)
+
+if(NOT BENCH OR NOT BASELINE)
+    message(FATAL_ERROR "perf-check: BENCH and BASELINE are required")
+endif()
+
+execute_process(COMMAND ${BENCH} ${BENCH_ARGS}
+        OUTPUT_VARIABLE result
+        RESULT_VARIABLE exit_code)
+if(NOT exit_code EQUAL 0)
+    message(FATAL_ERROR "perf-check: ${BENCH} exited with ${exit_code}")
+endif()
+
+file(READ ${BASELINE} baseline)
+string(JSON metric_count LENGTH "${baseline}")
+math(EXPR last_metric "${metric_count} - 1")
+
+set(regressions 0)
+foreach(i RANGE ${last_metric})
+    string(JSON name MEMBER "${baseline}" ${i})
+    string(JSON expected GET "${baseline}" ${name} baseline)
+    string(JSON tolerance GET "${baseline}" ${name} tolerance)
+    string(JSON better GET "${baseline}" ${name} better)
+    string(JSON actual ERROR_VARIABLE missing GET "${result}" ${name})
+    if(missing)
+        message(SEND_ERROR "perf-check: ${name}: not reported by benchmark")
+        math(EXPR regressions "${regressions} + 1")
+        continue()
+    endif()
+
+    # CMake math is integer only, fractional digits are not significant here
+    string(REGEX REPLACE "\\..*" "" actual_int "${actual}")
+    math(EXPR scaled "${actual_int} * 100")
+    if(better STREQUAL "lower")
+        math(EXPR limit "${expected} * (100 + ${tolerance})")
+        if(scaled GREATER limit)
+            set(verdict "REGRESSION")
+        else()
+            set(verdict "ok")
+        endif()
+    else()
+        math(EXPR limit "${expected} * (100 - ${tolerance})")
+        if(scaled LESS limit)
+            set(verdict "REGRESSION")
+        else()
+            set(verdict "ok")
+        endif()
+    endif()
+
+    message(STATUS "perf-check: ${name} = ${actual} "
+            "(baseline ${expected}, ${better} is better, +/-${tolerance}%): ${verdict}")
+    if(verdict STREQUAL "REGRESSION")
+        math(EXPR regressions "${regressions} + 1")
+    endif()
+endforeach()
+
+if(regressions GREATER 0)
+    message(FATAL_ERROR "perf-check: ${regressions} metric(s) regressed")
+endif()
@@ -0,0 +1,233 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <mozart++/process>
+#include <mozart++/chunk_queue>
+
+using mpp::chunk_pool;
+using mpp::chunk_ref;
+
+void test_spsc_order() {
+    constexpr std::uint64_t count = 1000000;
+    mpp::spsc_queue<std::uint64_t> q(1000);
+    if (q.capacity() != 1024) {
+        printf("chunk-queue: test-spsc-order: capacity failed\n");
+        exit(1);
+    }
+
+    std::thread producer([&q]() {
+        for (std::uint64_t i = 0; i < count;) {
+            std::uint64_t v = i;
+            if (q.try_push(std::move(v))) {
+                ++i;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    for (std::uint64_t expected = 0; expected < count;) {
+        std::uint64_t v = 0;
+        if (!q.try_pop(v)) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (v != expected) {
+            printf("chunk-queue: test-spsc-order: got %llu for %llu\n",
+                   static_cast<unsigned long long>(v), static_cast<unsigned long long>(expected));
+            exit(1);
+        }
+        ++expected;
+    }
+    producer.join();
+}
+
+void test_mpmc_sum() {
+    constexpr std::uint64_t per_producer = 200000;
+    constexpr int producers = 4;
+    constexpr int consumers = 2;
+    mpp::mpmc_queue<std::uint64_t> q(256);
+    std::atomic<std::uint64_t> sum{0};
+    std::atomic<std::uint64_t> popped{0};
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&q]() {
+            for (std::uint64_t i = 1; i <= per_producer;) {
+                std::uint64_t v = i;
+                if (q.try_push(std::move(v))) {
+                    ++i;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&]() {
+            while (popped.load() < per_producer * producers) {
+                std::uint64_t v = 0;
+                if (q.try_pop(v)) {
+                    sum += v;
+                    ++popped;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (sum != producers * per_producer * (per_producer + 1) / 2) {
+        printf("chunk-queue: test-mpmc-sum: failed\n");
+        exit(1);
+    }
+}
+
+void test_pool_recycle() {
+    chunk_pool pool(2, 16);
+    chunk_ref a = pool.acquire();
+    chunk_ref b = pool.acquire();
+    if (!a || !b || pool.acquire() || a.capacity() != 16) {
+        printf("chunk-queue: test-pool-recycle: exhaustion failed\n");
+        exit(1);
+    }
+
+    a.set_tag(7);
+    a.resize(3);
+    chunk_ref shared = a;
+    a.reset();
+    if (pool.acquire() || shared.tag() != 7 || shared.size() != 3) {
+        printf("chunk-queue: test-pool-recycle: sharing failed\n");
+        exit(1);
+    }
+
+    // the last handle gives the buffer back, cleared
+    shared.reset();
+    chunk_ref c = pool.acquire();
+    if (!c || c.size() != 0 || c.tag() != 0) {
+        printf("chunk-queue: test-pool-recycle: recycling failed\n");
+        exit(1);
+    }
+}
+
+void test_pool_churn() {
+    // fewer buffers than threads want, pops and pushes race all the time
+    chunk_pool pool(4, 16);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&pool] {
+            for (int i = 0; i < 200000; ++i) {
+                chunk_ref a = pool.acquire();
+                chunk_ref b = pool.acquire();
+                // released by another reference than the one that took it
+                chunk_ref copy = a;
+                a.reset();
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    std::vector<chunk_ref> all;
+    for (std::size_t i = 0; i < pool.chunks(); ++i) {
+        all.push_back(pool.acquire());
+        if (!all.back()) {
+            printf("chunk-queue: test-pool-churn: buffer %zu lost\n", i);
+            exit(1);
+        }
+    }
+}
+
+void test_drain_handoff() {
+    // the reader hands chunks of a child's output to two parsers
+    chunk_pool pool(8, 4096);
+    mpp::mpmc_queue<chunk_ref> q(8);
+    std::atomic<bool> done{false};
+    std::atomic<std::uint64_t> lines{0};
+
+    std::vector<std::thread> parsers;
+    for (int i = 0; i < 2; ++i) {
+        parsers.emplace_back([&]() {
+            chunk_ref chunk;
+            while (true) {
+                // everything pushed before done is visible after it
+                bool finished = done.load();
+                if (!q.try_pop(chunk)) {
+                    if (finished) {
+                        break;
+                    }
+                    std::this_thread::yield();
+                    continue;
+                }
+                std::uint64_t n = 0;
+                for (std::size_t j = 0; j < chunk.size(); ++j) {
+                    n += chunk.data()[j] == '\n';
+                }
+                lines += n;
+                chunk.reset();
+            }
+        });
+    }
+
+#ifdef MOZART_PLATFORM_WIN32
+    mpp::process p = mpp::process::exec("cmd", {"/c", "for /l %i in (1,1,20000) do @echo %i"});
+#else
+    mpp::process p = mpp::process::exec("/bin/sh", {"-c", "seq 1 20000"});
+#endif
+    while (true) {
+        chunk_ref chunk = pool.acquire();
+        if (!chunk) {
+            // every buffer is with the parsers
+            std::this_thread::yield();
+            continue;
+        }
+        if (mpp::read_chunk(p.out(), chunk) <= 0) {
+            break;
+        }
+        while (!q.try_push(std::move(chunk))) {
+            std::this_thread::yield();
+        }
+    }
+    done = true;
+    for (auto &t : parsers) {
+        t.join();
+    }
+    p.wait_for();
+
+    if (lines != 20000) {
+        printf("chunk-queue: test-drain-handoff: %llu lines\n", static_cast<unsigned long long>(lines.load()));
+        exit(1);
+    }
+
+    // all buffers are back
+    std::vector<chunk_ref> all;
+    while (chunk_ref c = pool.acquire()) {
+        all.push_back(c);
+    }
+    if (all.size() != pool.chunks()) {
+        printf("chunk-queue: test-drain-handoff: leaked buffers\n");
+        exit(1);
+    }
+}
+
+int main() {
+    test_spsc_order();
+    test_mpmc_sum();
+    test_pool_recycle();
+    test_pool_churn();
+    test_drain_handoff();
+    return 0;
+}
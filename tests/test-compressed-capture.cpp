@@ -0,0 +1,107 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <mozart++/process>
+#include <mozart++/compressed_capture>
+
+using mpp::compressed_capture;
+
+void test_roundtrip() {
+    std::mt19937 rng(20201018);
+    std::string data;
+
+    // a mix of repetitive and random parts
+    for (int i = 0; i < 2000; ++i) {
+        data += "[info] job " + std::to_string(i % 17) + " finished in 12ms\n";
+        if (i % 100 == 0) {
+            for (int j = 0; j < 300; ++j) {
+                data += static_cast<char>(rng());
+            }
+        }
+    }
+
+    // odd append sizes, crossing block boundaries
+    compressed_capture c(4096);
+    for (std::size_t pos = 0; pos < data.size();) {
+        std::size_t n = std::min<std::size_t>(data.size() - pos, rng() % 9000 + 1);
+        c.append(data.data() + pos, n);
+        pos += n;
+    }
+
+    if (c.str() != data) {
+        printf("compressed-capture: test-roundtrip: pending failed\n");
+        exit(1);
+    }
+
+    c.finish();
+    if (c.str() != data || c.size() != data.size()
+        || c.block_count() != (data.size() + 4095) / 4096) {
+        printf("compressed-capture: test-roundtrip: failed\n");
+        exit(1);
+    }
+
+    // random access
+    if (c.block(3) != data.substr(3 * 4096, 4096)) {
+        printf("compressed-capture: test-roundtrip: random access failed\n");
+        exit(1);
+    }
+}
+
+void test_codec_edges() {
+    const char *inputs[] = {"", "a", "aaaa", "aaaaaaaaaa", "abcabcabcabcabcabcabcabcabcabc"};
+    for (const char *in : inputs) {
+        std::string s(in);
+        std::string out(mpp_impl::lz_compress_bound(s.size()), '\0');
+        std::size_t n = mpp_impl::lz_compress(s.data(), s.size(), &out[0]);
+
+        std::string back(s.size(), '\0');
+        if (mpp_impl::lz_decompress(out.data(), n, &back[0], back.size()) != static_cast<mpp::ssize_t>(s.size())
+            || back != s) {
+            printf("compressed-capture: test-codec-edges: failed on \"%s\"\n", in);
+            exit(1);
+        }
+    }
+
+    // corrupted input must not overflow
+    std::string garbage(64, '\xff');
+    char small[16];
+    if (mpp_impl::lz_decompress(garbage.data(), garbage.size(), small, sizeof(small)) != -1) {
+        printf("compressed-capture: test-codec-edges: garbage accepted\n");
+        exit(1);
+    }
+}
+
+void test_drain_process() {
+#ifndef MOZART_PLATFORM_WIN32
+    mpp::process p = mpp::process_builder().command("/bin/sh")
+        .arguments(std::vector<std::string>{
+            "-c", "i=0; while [ $i -lt 5000 ]; do echo \"[info] worker heartbeat ok\"; i=$((i+1)); done"})
+        .start();
+
+    compressed_capture c;
+    c.drain(p.out());
+    c.finish();
+    p.wait_for();
+
+    if (c.size() != 5000 * 27 || c.memory_size() * 5 > c.size()) {
+        printf("compressed-capture: test-drain-process: failed, %zu bytes in memory for %zu\n",
+               c.memory_size(), static_cast<std::size_t>(c.size()));
+        exit(1);
+    }
+#endif
+}
+
+int main() {
+    test_roundtrip();
+    test_codec_edges();
+    test_drain_process();
+    return 0;
+}
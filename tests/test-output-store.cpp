@@ -0,0 +1,252 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <mozart++/process>
+#include <mozart++/output_store>
+
+#ifndef MOZART_PLATFORM_WIN32
+
+#include <unistd.h>
+
+#endif
+
+using mpp::output_store;
+
+static std::string make_dir() {
+#ifndef MOZART_PLATFORM_WIN32
+    char dir[] = "/tmp/mpp-outputs-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        printf("output-store: mkdtemp failed\n");
+        exit(1);
+    }
+    return dir;
+#else
+    return ".";
+#endif
+}
+
+static void remove_dir(const std::string &dir) {
+    for (int i = 0;; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "/seg-%06d", i);
+        std::string base = dir + name;
+        if (std::remove((base + ".data").c_str()) != 0) {
+            break;
+        }
+        std::remove((base + ".index").c_str());
+    }
+#ifndef MOZART_PLATFORM_WIN32
+    rmdir(dir.c_str());
+#endif
+}
+
+struct job_output {
+    std::string key;
+    std::string data;
+};
+
+static std::vector<job_output> make_outputs(int count) {
+    std::mt19937 rng(20201018);
+    const char *words[] = {"compile", "link", "error", "warning", "test", "passed", "failed", "cache"};
+    std::vector<job_output> outputs;
+    for (int i = 0; i < count; ++i) {
+        job_output o;
+        o.key = "job-" + std::to_string(i);
+        int lines = static_cast<int>(rng() % 20);
+        for (int l = 0; l < lines; ++l) {
+            o.data += "[" + o.key + "] ";
+            for (int w = rng() % 6; w >= 0; --w) {
+                o.data += words[rng() % 8];
+                o.data += ' ';
+            }
+            o.data += std::to_string(rng() % 100000) + "\n";
+        }
+        outputs.push_back(std::move(o));
+    }
+    return outputs;
+}
+
+/**
+ * Every line containing needle, in order.
+ */
+static std::vector<std::string> brute_force(const std::vector<job_output> &outputs, const std::string &needle) {
+    std::vector<std::string> lines;
+    for (const auto &o : outputs) {
+        std::size_t begin = 0;
+        while (begin < o.data.size()) {
+            std::size_t end = o.data.find('\n', begin);
+            end = end == std::string::npos ? o.data.size() : end;
+            std::string line = o.data.substr(begin, end - begin);
+            if (line.find(needle) != std::string::npos) {
+                lines.push_back(o.key + ": " + line);
+            }
+            begin = end + 1;
+        }
+    }
+    return lines;
+}
+
+static std::vector<std::string> search(const output_store &store, const std::string &needle) {
+    std::vector<std::string> lines;
+    for (const auto &m : store.search(needle, 1u << 30u)) {
+        lines.push_back(m._key + ": " + m._line);
+    }
+    return lines;
+}
+
+static void check_searches(const output_store &store, const std::vector<job_output> &outputs, const char *test) {
+    const char *needles[] = {"error", "passed cache", "[job-17]", "job-1", "12345", "ca", "e", "not there"};
+    for (const char *needle : needles) {
+        if (search(store, needle) != brute_force(outputs, needle)) {
+            printf("output-store: %s: search for \"%s\" failed\n", test, needle);
+            exit(1);
+        }
+    }
+}
+
+void test_search() {
+    std::string dir = make_dir();
+    std::vector<job_output> outputs = make_outputs(2000);
+    {
+        output_store store(dir, 16 * 1024);
+        std::mt19937 rng(42);
+        for (const auto &o : outputs) {
+            output_store::writer w = store.open(o.key);
+            // odd append sizes, trigrams cross appends
+            for (std::size_t pos = 0; pos < o.data.size();) {
+                std::size_t n = std::min<std::size_t>(o.data.size() - pos, rng() % 7 + 1);
+                w.append(o.data.data() + pos, n);
+                pos += n;
+            }
+            w.finish();
+        }
+        if (store.output_count() != outputs.size() || store.segment_count() < 10) {
+            printf("output-store: test-search: %zu segments\n", store.segment_count());
+            exit(1);
+        }
+        // sealed segments and the active one
+        check_searches(store, outputs, "test-search");
+
+        auto m = store.search("[job-5] ", 1);
+        if (m.size() != 1 || m[0]._key != "job-5" || m[0]._stream != 1
+            || outputs[5].data.compare(m[0]._offset, m[0]._line.size(), m[0]._line) != 0) {
+            printf("output-store: test-search: limit failed\n");
+            exit(1);
+        }
+    }
+
+    // everything indexed when reopened
+    {
+        output_store store(dir, 16 * 1024);
+        check_searches(store, outputs, "test-search: reopened");
+
+        std::vector<job_output> more = make_outputs(1);
+        more[0].key = "later";
+        store.open("later").append(more[0].data.data(), more[0].data.size());
+        outputs.push_back(more[0]);
+        check_searches(store, outputs, "test-search: appended");
+    }
+    remove_dir(dir);
+}
+
+void test_recover() {
+    std::string dir = make_dir();
+    std::vector<job_output> outputs = make_outputs(300);
+    {
+        output_store store(dir, 1024 * 1024);
+        for (const auto &o : outputs) {
+            store.open(o.key, 2).append(o.data.data(), o.data.size());
+        }
+    }
+
+    // a crash: the index is lost and the last output is torn
+    std::remove((dir + "/seg-000000.index").c_str());
+    FILE *fp = fopen((dir + "/seg-000000.data").c_str(), "ab");
+    fputs("\x05job-x\x01\x7f" "partial", fp);
+    fclose(fp);
+
+    output_store store(dir, 1024 * 1024);
+    if (store.output_count() != outputs.size()) {
+        printf("output-store: test-recover: %zu outputs\n", static_cast<std::size_t>(store.output_count()));
+        exit(1);
+    }
+    check_searches(store, outputs, "test-recover");
+    for (const auto &m : store.search("error", 10)) {
+        if (m._stream != 2) {
+            printf("output-store: test-recover: wrong stream\n");
+            exit(1);
+        }
+    }
+    remove_dir(dir);
+}
+
+void test_spool() {
+    std::string dir = make_dir();
+    {
+        // larger than a writer keeps in memory, 1MiB is reached
+        // in the middle of "needle", by append 10381
+        std::string line(100, 'x');
+        std::string crossing = std::string(90, 'x') + " spooled ne";
+        output_store store(dir);
+        output_store::writer w = store.open("big");
+        std::uint64_t size = 0;
+        for (int i = 0; i < 50000; ++i) {
+            std::string l = i == 10381 ? crossing : i == 10382 ? "edle\n" : i == 49999 ? "last needle" : line + "\n";
+            w.append(l.data(), l.size());
+            size += l.size();
+        }
+        w.finish();
+
+        auto m = store.search("needle");
+        if (m.size() != 2 || m[0]._line != crossing + "edle" || m[1]._line != "last needle"
+            || m[1]._offset != size - 11) {
+            printf("output-store: test-spool: %zu matches\n", m.size());
+            exit(1);
+        }
+    }
+    remove_dir(dir);
+}
+
+void test_drain_process() {
+#ifndef MOZART_PLATFORM_WIN32
+    std::string dir = make_dir();
+    {
+        output_store store(dir);
+        for (int i = 0; i < 3; ++i) {
+            mpp::process p = mpp::process_builder().command("/bin/sh")
+                .arguments(std::vector<std::string>{
+                    "-c", "i=0; while [ $i -lt 1000 ]; do echo \"heartbeat $i\"; i=$((i+1)); done; echo done " +
+                          std::to_string(i)})
+                .start();
+            output_store::writer w = store.open("run-" + std::to_string(i));
+            w.drain(p.out());
+            w.finish();
+            p.wait_for();
+        }
+
+        auto m = store.search("done 1");
+        auto beats = store.search("heartbeat 999");
+        if (m.size() != 1 || m[0]._key != "run-1" || beats.size() != 3) {
+            printf("output-store: test-drain-process: failed\n");
+            exit(1);
+        }
+    }
+    remove_dir(dir);
+#endif
+}
+
+int main() {
+    test_search();
+    test_recover();
+    test_spool();
+    test_drain_process();
+    return 0;
+}
@@ -6,20 +6,52 @@
  * Github:  https://github.com/covariant-institute/
  */
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <mozart++/string>
 #include <mozart++/process>
+#include <mozart++/process_trace>
+#include <mozart++/pressure_monitor>
+#include <mozart++/line_filter>
+#include <mozart++/startup_record>
+#include <mozart++/process_sim>
+#include <mozart++/stdio_replay>
+#include <mozart++/process_graph>
+#include <mozart++/drain_loop>
+#include <mozart++/shared_input>
+#include <mozart++/jobserver>
 
 #ifdef MOZART_PLATFORM_WIN32
 #define SHELL "C:\\Windows\\System32\\WindowsPowerShell\\v1.0\\powershell.exe"
 #else
 #define SHELL "/bin/bash"
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <poll.h>
 #endif
 
 using mpp::process;
 using mpp::process_builder;
 
+/**
+ * A file for test output, outside of the working directory.
+ */
+static std::string scratch_file(const std::string &name) {
+#ifndef MOZART_PLATFORM_WIN32
+    const char *dir = getenv("TMPDIR");
+    return std::string(dir != nullptr ? dir : "/tmp") + "/mpp-" + std::to_string(getpid()) + "-" + name;
+#else
+    return name;
+#endif
+}
+
 void test_basic() {
     process p = process::exec(SHELL);
     p.in() << "ls /" << std::endl;
@@ -116,7 +148,8 @@ void test_env() {
 void test_r_file() {
     // VAR=fuckcpp bash <<< "echo $VAR; exit" > output-all.txt
 
-    FILE *fout = fopen("output-all.txt", "w");
+    std::string path = scratch_file("output-all.txt");
+    FILE *fout = fopen(path.c_str(), "w");
 
     process p = process_builder().command(SHELL)
 #ifndef MOZART_PLATFORM_WIN32
@@ -133,7 +166,8 @@ void test_r_file() {
 
     fclose(fout);
 
-    fout = fopen("output-all.txt", "r");
+    fout = fopen(path.c_str(), "r");
+    std::remove(path.c_str());
     mpp::fdistream fin(fileno(fout));
     std::string s;
     fin >> s;
@@ -163,6 +197,1115 @@ void test_exit_code() {
     }
 }
 
+void test_stdio_policy() {
+#ifndef MOZART_PLATFORM_WIN32
+    // stdin and stderr are compiled out, only stdout is a pipe
+    auto p = process_builder().command(SHELL)
+        .arguments(std::vector<std::string>{"-c", "echo fuckcpp; echo noise 1>&2"})
+        .start<mpp::stdio_null, mpp::stdio_pipe, mpp::stdio_null>();
+
+    std::string s;
+    p.out() >> s;
+    p.wait_for();
+
+    if (s != "fuckcpp") {
+        printf("process: test-stdio-policy: failed\n");
+        exit(1);
+    }
+
+    // stderr is a separate pipe of the dynamic process
+    process q = process_builder().command(SHELL)
+        .arguments(std::vector<std::string>{"-c", "echo fuckcpp 1>&2"})
+        .start();
+
+    q.err() >> s;
+    q.wait_for();
+
+    if (s != "fuckcpp") {
+        printf("process: test-stdio-policy: stderr failed\n");
+        exit(1);
+    }
+#endif
+}
+
+void test_pmr() {
+#if defined(MOZART_PROCESS_PMR) && !defined(MOZART_PLATFORM_WIN32)
+    // counts what the builder takes from the arena
+    struct counting_resource : public std::pmr::memory_resource {
+        std::pmr::memory_resource *_upstream;
+        std::size_t _bytes = 0;
+
+        explicit counting_resource(std::pmr::memory_resource *upstream)
+            : _upstream(upstream) {}
+
+        void *do_allocate(std::size_t bytes, std::size_t align) override {
+            _bytes += bytes;
+            return _upstream->allocate(bytes, align);
+        }
+
+        void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+            _upstream->deallocate(p, bytes, align);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    std::pmr::monotonic_buffer_resource arena;
+    counting_resource counter(&arena);
+
+    process p = process_builder(&counter).command(SHELL)
+        .arguments(std::vector<std::string>{"-c", "echo $VAR"})
+        .environment("VAR", "a-rather-long-value-to-defeat-small-string-optimization")
+        .directory("/")
+        .start();
+
+    std::string s;
+    p.out() >> s;
+    p.wait_for();
+
+    if (s != "a-rather-long-value-to-defeat-small-string-optimization" || counter._bytes == 0) {
+        printf("process: test-pmr: failed\n");
+        exit(1);
+    }
+#endif
+}
+
+void test_spawn_trace() {
+#ifndef MOZART_PLATFORM_WIN32
+    std::string path = scratch_file("spawn-trace.bin");
+    {
+        mpp::spawn_recorder recorder(path);
+        recorder.install();
+
+        process p = process_builder().command(SHELL)
+            .arguments(std::vector<std::string>{"-c", "echo fuckcpp; exit 3"})
+            .environment("VAR", "value")
+            .start();
+        std::string s;
+        p.out() >> s;
+        p.wait_for();
+
+        auto q = process_builder().command("true")
+            .start<mpp::stdio_null, mpp::stdio_pipe, mpp::stdio_inherit>();
+        q.wait_for();
+        recorder.uninstall();
+    }
+
+    mpp::spawn_trace_reader reader(path);
+    std::remove(path.c_str());
+    mpp::spawn_record r;
+    if (!reader.next(r) || r._command != SHELL || r._exit_code != 3
+        || r._argc != 2 || r._envc != 1 || r._env_bytes != 9 || r._stdio != 0) {
+        printf("process: test-spawn-trace: failed\n");
+        exit(1);
+    }
+    if (!reader.next(r) || r._stdio != (mpp::SPAWN_STDIN_NULL | mpp::SPAWN_STDERR_INHERITED) || reader.next(r)) {
+        printf("process: test-spawn-trace: stdio policies recorded as %u\n", r._stdio);
+        exit(1);
+    }
+
+    // uninstalling waits for callbacks already running in other threads
+    struct slow_observer : public mpp_impl::process_observer {
+        std::atomic<int> _running{0};
+
+        void on_start(const mpp::process_startup &, const mpp::process_info &) override {
+            ++_running;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            --_running;
+        }
+
+        void on_exit(const mpp::process_info &, int) override {
+        }
+    } slow;
+    mpp_impl::set_process_observer(&slow);
+    std::thread spawner([]() {
+        process_builder().command("true").start().wait_for();
+    });
+    while (slow._running == 0) {
+        std::this_thread::yield();
+    }
+    mpp_impl::set_process_observer(nullptr);
+    bool quiesced = slow._running == 0;
+    spawner.join();
+    if (!quiesced) {
+        printf("process: test-spawn-trace: uninstalled during a callback\n");
+        exit(1);
+    }
+#endif
+}
+
+void test_suspend() {
+#ifndef MOZART_PLATFORM_WIN32
+    process p = process_builder().command("sleep")
+        .arguments(std::vector<std::string>{"10"})
+        .new_process_group(true)
+        .job_class("batch")
+        .start();
+    process q = process_builder().command("sleep")
+        .arguments(std::vector<std::string>{"10"})
+        .job_class("batch")
+        .start();
+
+    // stopped children must not be mistaken for exited ones
+    if (!p.suspend() || !p.is_suspended() || p.has_exited()) {
+        printf("process: test-suspend: suspend failed\n");
+        exit(1);
+    }
+
+    // p is already suspended
+    if (mpp::suspend_job_class("batch") != 1 || !q.is_suspended() || q.has_exited()) {
+        printf("process: test-suspend: suspend class failed\n");
+        exit(1);
+    }
+
+    if (mpp::resume_job_class("batch") != 2 || p.is_suspended() || q.is_suspended()) {
+        printf("process: test-suspend: resume class failed\n");
+        exit(1);
+    }
+
+    p.suspend();
+    p.interrupt();
+    q.interrupt();
+    if (p.wait_for() != 0x80 + SIGTERM || q.wait_for() != 0x80 + SIGTERM) {
+        printf("process: test-suspend: interrupt failed\n");
+        exit(1);
+    }
+#endif
+}
+
+void test_pressure_shed() {
+#ifdef MOZART_PLATFORM_LINUX
+    process p = process_builder().command("sleep")
+        .arguments(std::vector<std::string>{"10"})
+        .low_priority(true)
+        .start();
+    process q = process_builder().command("sleep")
+        .arguments(std::vector<std::string>{"10"})
+        .start();
+
+    std::size_t notified = 0;
+    mpp::pressure_monitor monitor;
+    monitor.watch(mpp::pressure_resource::memory, std::chrono::milliseconds(150))
+        .action(mpp::shed_action::suspend)
+        .on_shed([&](mpp::pressure_resource, std::size_t n) { notified += n; });
+
+    try {
+        monitor.start();
+        monitor.stop();
+    } catch (const mpp::runtime_error &e) {
+        // kernels without PSI or without permission to register triggers
+        printf("process: test-pressure-shed: %s\n", e.what());
+    }
+
+    if (monitor.shed(mpp::pressure_resource::memory) != 1 || notified != 1
+        || !p.is_suspended() || q.is_suspended()) {
+        printf("process: test-pressure-shed: failed\n");
+        exit(1);
+    }
+
+    if (mpp::terminate_low_priority() != 1 || p.wait_for() != 0x80 + SIGTERM) {
+        printf("process: test-pressure-shed: terminate failed\n");
+        exit(1);
+    }
+
+    q.interrupt(true);
+    q.wait_for();
+
+    // a stall fed to the monitor thread: it sheds, then resumes what
+    // it suspended after a quiet period, not what was suspended by hand
+    process shed = process_builder().command("sleep")
+        .arguments(std::vector<std::string>{"10"})
+        .low_priority(true)
+        .start();
+    process manual = process_builder().command("sleep")
+        .arguments(std::vector<std::string>{"10"})
+        .low_priority(true)
+        .start();
+    manual.suspend();
+
+    std::atomic<std::size_t> fed{0};
+    std::atomic<bool> was_shed{false};
+    mpp::pressure_monitor fed_monitor;
+    fed_monitor.action(mpp::shed_action::suspend)
+        .resume_after(std::chrono::milliseconds(100))
+        .on_shed([&](mpp::pressure_resource, std::size_t n) {
+            was_shed = shed.is_suspended();
+            fed += n;
+        });
+    fed_monitor.start();
+    fed_monitor.report_stall(mpp::pressure_resource::cpu);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (fed == 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    while (shed.is_suspended() && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    fed_monitor.stop();
+    if (fed != 1 || !was_shed || shed.is_suspended() || !manual.is_suspended()) {
+        printf("process: test-pressure-shed: reported stall handled wrong\n");
+        exit(1);
+    }
+
+    mpp::terminate_low_priority(true);
+    shed.wait_for();
+    manual.wait_for();
+#endif
+}
+
+void test_wait_ready() {
+#ifndef MOZART_PLATFORM_WIN32
+    process p = process_builder().command(SHELL)
+        .arguments(std::vector<std::string>{"-c", "sleep 0.1; echo READY=1 >&$MPP_NOTIFY_FD; sleep 10"})
+        .notify_ready(true)
+        .start();
+
+    auto start = std::chrono::steady_clock::now();
+    bool ready = p.wait_ready(std::chrono::seconds(5));
+    auto used = std::chrono::steady_clock::now() - start;
+
+    if (!ready || used > std::chrono::seconds(2)) {
+        printf("process: test-wait-ready: failed\n");
+        exit(1);
+    }
+    p.interrupt(true);
+    p.wait_for();
+
+    // exits without being ready
+    process q = process_builder().command(SHELL)
+        .arguments(std::vector<std::string>{"-c", "exit 0"})
+        .notify_ready(true)
+        .start();
+
+    if (q.wait_ready(std::chrono::seconds(5))) {
+        printf("process: test-wait-ready: exited child reported ready\n");
+        exit(1);
+    }
+    q.wait_for();
+#endif
+}
+
+void test_line_filter() {
+#ifndef MOZART_PLATFORM_WIN32
+    const char *script = "for i in $(seq 1 2000); do echo \"INFO line $i\"; "
+                         "if [ $((i % 500)) -eq 0 ]; then echo \"ERROR at $i\"; fi; done; "
+                         "printf 'WARN no newline'";
+
+    auto run = [&](mpp::line_filter filter) {
+        process p = process_builder().command(SHELL)
+            .arguments(std::vector<std::string>{"-c", script})
+            .filter_stdout(std::move(filter))
+            .start();
+        std::string result, line;
+        while (std::getline(p.out(), line)) {
+            result += line + "|";
+        }
+        p.wait_for();
+        return result;
+    };
+
+    std::string selected = run(mpp::line_filter::contains({"ERROR", "WARN"}));
+    if (selected != "ERROR at 500|ERROR at 1000|ERROR at 1500|ERROR at 2000|WARN no newline|") {
+        printf("process: test-line-filter: contains: %s\n", selected.c_str());
+        exit(1);
+    }
+
+    selected = run(mpp::line_filter::prefix({"ERROR at 1"}));
+    if (selected != "ERROR at 1000|ERROR at 1500|") {
+        printf("process: test-line-filter: prefix: %s\n", selected.c_str());
+        exit(1);
+    }
+
+    selected = run(mpp::line_filter::regex("^INFO line 19[0-9]{2}$").discard().discard(false));
+    if (std::count(selected.begin(), selected.end(), '|') != 100) {
+        printf("process: test-line-filter: regex: %s\n", selected.c_str());
+        exit(1);
+    }
+
+    selected = run(mpp::line_filter::contains({"INFO"}).discard());
+    if (selected != "ERROR at 500|ERROR at 1000|ERROR at 1500|ERROR at 2000|WARN no newline|") {
+        printf("process: test-line-filter: discard: %s\n", selected.c_str());
+        exit(1);
+    }
+#endif
+
+    // literals straddling the 16 byte blocks of the prefilter
+    std::string hay(100, 'a');
+    hay.replace(37, 3, "xyz");
+    if (mpp_impl::find_literal(hay.data(), hay.size(), "xyz", 3) != 37
+        || mpp_impl::find_literal(hay.data(), hay.size(), "xyq", 3) != hay.size()
+        || mpp_impl::find_literal(hay.data(), 39, "xyz", 3) != 39) {
+        printf("process: test-line-filter: find_literal\n");
+        exit(1);
+    }
+}
+
+void test_startup_record() {
+#ifndef MOZART_PLATFORM_WIN32
+    std::string buffer;
+    mpp::startup_file::write_header(buffer);
+    for (int i = 0; i < 3; ++i) {
+        process_builder().command(SHELL)
+            .arguments(std::vector<std::string>{"-c", "echo $VAR" + std::to_string(i)})
+            .environment("VAR" + std::to_string(i), "fuckcpp" + std::to_string(i))
+            .directory("/")
+            .low_priority(i == 1)
+            .save(buffer);
+    }
+
+    std::string path = scratch_file("startup-records.bin");
+    FILE *fp = fopen(path.c_str(), "wb");
+    fwrite(buffer.data(), 1, buffer.size(), fp);
+    fclose(fp);
+
+    mpp::startup_file file(path);
+    std::remove(path.c_str());
+    mpp::startup_record r;
+    std::size_t offset = 8;
+    for (int i = 0; i < 3; ++i) {
+        if (!file.next(r) || r.argc() != 3 || r.envc() != 1 || std::string(r.cwd()) != "/"
+            || ((r.flags() & mpp::STARTUP_LOW_PRIORITY) != 0) != (i == 1)) {
+            printf("process: test-startup-record: record %d\n", i);
+            exit(1);
+        }
+
+        process_builder builder;
+        builder.load(r);
+
+        // a loaded startup encodes to the same bytes
+        std::string again;
+        builder.save(again);
+        if (again != buffer.substr(offset, r.size())) {
+            printf("process: test-startup-record: re-encoded %d\n", i);
+            exit(1);
+        }
+        offset += r.size();
+    }
+    if (file.next(r)) {
+        printf("process: test-startup-record: trailing record\n");
+        exit(1);
+    }
+
+    file.rewind();
+    file.next(r);
+    process_builder loaded;
+    loaded.load(r);
+    try {
+        loaded.environment("VAR0", "ignored");
+        printf("process: test-startup-record: environment() after load() accepted\n");
+        exit(1);
+    } catch (const mpp::runtime_error &) {
+        // expected
+    }
+    process p = loaded.start();
+    std::string s;
+    p.out() >> s;
+    p.wait_for();
+    if (s != "fuckcpp0") {
+        printf("process: test-startup-record: output %s\n", s.c_str());
+        exit(1);
+    }
+
+    // truncated or corrupted records are rejected
+    const char *first = buffer.data() + 8;
+    if (r.parse(first, r.size() - 4) != 0) {
+        printf("process: test-startup-record: truncated record accepted\n");
+        exit(1);
+    }
+    std::string broken(first, mpp::startup_record().parse(first, buffer.size() - 8));
+    broken.back() = 'x';
+    broken[broken.size() - 2] = 'x';
+    broken[broken.size() - 3] = 'x';
+    broken[broken.size() - 4] = 'x';
+    if (r.parse(broken.data(), broken.size()) != 0) {
+        printf("process: test-startup-record: unterminated record accepted\n");
+        exit(1);
+    }
+#endif
+}
+
+void test_exit_accounting() {
+#ifdef MOZART_PLATFORM_LINUX
+    // the writer itself, a shell would count only its own I/O
+    process p = process_builder().command("head")
+        .arguments(std::vector<std::string>{"-c", "100000", "/dev/zero"})
+        .exit_accounting(true)
+        .start();
+
+    std::string s;
+    while (std::getline(p.out(), s)) {
+    }
+    p.wait_for();
+
+    const mpp::exit_accounting &a = p.accounting();
+    if (!a._has_io || a._io._wchar < 100000) {
+        printf("process: test-exit-accounting: io failed\n");
+        exit(1);
+    }
+
+    // taskstats needs CAP_NET_ADMIN, only check what we got
+    if (a._has_delays) {
+        printf("process: test-exit-accounting: cpu delay %llu ns, blkio delay %llu ns, run %llu ns\n",
+               static_cast<unsigned long long>(a._delays._cpu_delay_ns),
+               static_cast<unsigned long long>(a._delays._blkio_delay_ns),
+               static_cast<unsigned long long>(a._delays._cpu_run_ns));
+    }
+#endif
+}
+
+void test_detach() {
+#ifndef MOZART_PLATFORM_WIN32
+    char dir[] = "/tmp/mpp-detach-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        printf("process: test-detach: mkdtemp failed\n");
+        exit(1);
+    }
+
+    long pid = 0;
+    std::string state;
+    {
+        process p = process_builder().command(SHELL)
+            .arguments(std::vector<std::string>{"-c", "echo started; sleep 0.5; echo done; exit 7"})
+            .detach(dir)
+            .start();
+        pid = p.pid();
+        state = p.detach_state();
+
+        if (getsid(pid) == getsid(0)) {
+            printf("process: test-detach: child is in our session\n");
+            exit(1);
+        }
+        // dropping the handle leaves the child running
+    }
+
+    if (kill(pid, 0) != 0) {
+        printf("process: test-detach: child died with the handle\n");
+        exit(1);
+    }
+
+    // a state whose keeper is gone or was replaced is refused
+    std::string stale = state;
+    std::size_t keeper = stale.find("keeper ");
+    stale.insert(stale.find('\n', keeper), "1");
+    try {
+        process::adopt(pid, stale);
+        printf("process: test-detach: stale state adopted\n");
+        exit(1);
+    } catch (const mpp::runtime_error &) {
+    }
+
+    process q = process::adopt(pid, state);
+    int code = q.wait_for();
+
+    std::string s, output;
+    while (q.out() >> s) {
+        output += s;
+    }
+    if (code != 7 || output != "starteddone" || !q.has_exited()) {
+        printf("process: test-detach: code %d, output %s\n", code, output.c_str());
+        exit(1);
+    }
+
+    std::string files[] = {"/stdout", "/stderr", "/exit"};
+    for (const auto &f : files) {
+        unlink((dir + f).c_str());
+    }
+    rmdir(dir);
+#endif
+}
+
+void test_simulated_backend() {
+    // "job <runtime ms> <exit code>"
+    mpp::simulated_backend sim([](const mpp::process_startup &startup) {
+        mpp::simulated_outcome o;
+        o._runtime_us = std::stoull(startup._cmdline[1].c_str()) * 1000;
+        o._exit_code = std::stoi(startup._cmdline[2].c_str());
+        o._stdout = "ran-" + std::string(startup._cmdline[1].c_str());
+        return o;
+    });
+    sim.install();
+
+    auto job = [](const char *ms, const char *code) {
+        return process_builder().command("job")
+            .arguments(std::vector<std::string>{ms, code})
+            .start();
+    };
+    process a = job("100", "3");
+    process b = job("50", "0");
+    process c = job("1000", "0");
+
+    if (a.has_exited() || !sim.advance_to_next_exit() || sim.now_us() != 50000
+        || !b.has_exited() || a.has_exited()) {
+        printf("process: test-simulated-backend: clock failed\n");
+        exit(1);
+    }
+
+    std::string s;
+    a.out() >> s;
+    if (a.wait_for() != 3 || sim.now_us() != 100000 || s != "ran-100") {
+        printf("process: test-simulated-backend: wait failed\n");
+        exit(1);
+    }
+
+    // suspended processes make no progress
+    c.suspend();
+    sim.advance(5000000);
+    c.resume();
+    if (c.has_exited() || !sim.advance_to_next_exit() || sim.now_us() != 6000000) {
+        printf("process: test-simulated-backend: suspend failed %llu\n",
+               static_cast<unsigned long long>(sim.now_us()));
+        exit(1);
+    }
+
+    process d = job("1000", "0");
+    d.interrupt();
+    if (d.wait_for() != 0x80 + 15 || sim.started() != 4) {
+        printf("process: test-simulated-backend: interrupt failed\n");
+        exit(1);
+    }
+
+    // exits are reported without polling handles
+    process e = job("10", "0");
+    process f = job("20", "0");
+    process g = job("10", "1");
+    std::vector<mpp::fd_type> exited;
+    if (!sim.advance_to_next_exit(exited) || exited.size() != 2
+        || std::find(exited.begin(), exited.end(), e.pid()) == exited.end()
+        || std::find(exited.begin(), exited.end(), g.pid()) == exited.end()
+        || !sim.advance_to_next_exit(exited) || exited.size() != 3 || exited[2] != f.pid()
+        || sim.advance_to_next_exit(exited)) {
+        printf("process: test-simulated-backend: exits not reported\n");
+        exit(1);
+    }
+
+    // real processes again
+    sim.uninstall();
+    process p = process::exec(SHELL);
+    p.in() << "exit 5" << std::endl;
+    if (p.wait_for() != 5) {
+        printf("process: test-simulated-backend: uninstall failed\n");
+        exit(1);
+    }
+}
+
+void test_stdio_replay(const std::string &tools_dir) {
+#ifndef MOZART_PLATFORM_WIN32
+    const char *script = "echo fuckcpp; echo err 1>&2; exit 4";
+    std::string path = scratch_file("stdio-recording.bin");
+    {
+        process p = process_builder().command(SHELL)
+            .record_stdio(path)
+            .start();
+        p.in() << script << std::endl;
+        std::string out, err;
+        std::getline(p.out(), out);
+        std::getline(p.err(), err);
+        if (p.wait_for() != 4 || out != "fuckcpp" || err != "err") {
+            printf("process: test-stdio-replay: recording run failed\n");
+            exit(1);
+        }
+    }
+
+    std::string streams[3];
+    mpp::stdio_replay_reader reader(path);
+    mpp::stdio_chunk chunk;
+    std::uint64_t last_us = 0;
+    int exit_code = -1;
+    while (reader.next(chunk)) {
+        if (chunk._time_us < last_us) {
+            printf("process: test-stdio-replay: time goes backwards\n");
+            exit(1);
+        }
+        last_us = chunk._time_us;
+        if (chunk._kind == mpp::STDIO_CHUNK_EXIT) {
+            exit_code = chunk._exit_code;
+        } else {
+            streams[chunk._kind] += chunk._data;
+        }
+    }
+    if (streams[0] != std::string(script) + "\n" || streams[1] != "fuckcpp\n"
+        || streams[2] != "err\n" || exit_code != 4) {
+        printf("process: test-stdio-replay: recording failed\n");
+        exit(1);
+    }
+
+    std::string standin = tools_dir + "/mpp-standin";
+    if (access(standin.c_str(), X_OK) != 0) {
+        // tools are not built
+        std::remove(path.c_str());
+        return;
+    }
+    process p = process_builder().command(SHELL)
+        .replay_stdio(path, standin, 0)
+        .start();
+    p.in() << script << std::endl;
+    std::string out, err;
+    std::getline(p.out(), out);
+    std::getline(p.err(), err);
+    if (p.wait_for() != 4 || out != "fuckcpp" || err != "err") {
+        printf("process: test-stdio-replay: replay failed\n");
+        exit(1);
+    }
+
+    // outputs read after wait_for() are recorded too, before the exit
+    {
+        process q = process_builder().command(SHELL)
+            .arguments(std::vector<std::string>{"-c", "echo late; exit 2"})
+            .record_stdio(path)
+            .start();
+        if (q.wait_for() != 2) {
+            printf("process: test-stdio-replay: late run failed\n");
+            exit(1);
+        }
+        std::getline(q.out(), out);
+    }
+    mpp::stdio_replay_reader late(path);
+    std::remove(path.c_str());
+    std::string recorded;
+    exit_code = -1;
+    while (late.next(chunk)) {
+        if (chunk._kind == mpp::STDIO_CHUNK_EXIT) {
+            exit_code = chunk._exit_code;
+        } else if (exit_code == -1 && chunk._kind == mpp::STDIO_CHUNK_STDOUT) {
+            recorded += chunk._data;
+        }
+    }
+    if (out != "late" || recorded != "late\n" || exit_code != 2) {
+        printf("process: test-stdio-replay: output read after wait_for() got '%s'\n", recorded.c_str());
+        exit(1);
+    }
+#endif
+}
+
+void test_process_graph() {
+#ifndef MOZART_PLATFORM_WIN32
+    auto sh = [](const char *script) {
+        return process_builder().command(SHELL)
+            .arguments(std::vector<std::string>{"-c", script});
+    };
+
+    {
+        // one producer, three consumers, one of them leaves early
+        mpp::process_graph g;
+        auto src = g.add(sh("seq 1 200000"));
+        auto a = g.add(sh("wc -l"));
+        auto b = g.add(sh("head -n 1; exit 3"));
+        auto c = g.add(sh("tail -n 1"));
+        g.connect(src, a).connect(src, b).connect(src, c);
+        g.start();
+
+        std::string sa, sb, sc;
+        g.node(a).out() >> sa;
+        g.node(b).out() >> sb;
+        g.node(c).out() >> sc;
+        auto codes = g.wait_for();
+        if (sa != "200000" || sb != "1" || sc != "200000"
+            || codes.size() != 4 || codes[0] != 0 || codes[b] != 3) {
+            printf("process: test-process-graph: fan-out failed\n");
+            exit(1);
+        }
+    }
+
+    {
+        // two producers merged, lines must stay whole
+        mpp::process_graph g;
+        auto p1 = g.add(sh("seq 1 100000"));
+        auto p2 = g.add(sh("seq 100001 200000"));
+        auto sink = g.add(sh("sort -n | awk 'NR != $1 { bad = 1 } END { print NR, bad + 0 }'"));
+        g.connect(p1, sink).connect(p2, sink);
+        g.start();
+
+        std::string line;
+        std::getline(g.node(sink).out(), line);
+        auto codes = g.wait_for();
+        if (line != "200000 0" || codes != std::vector<int>{0, 0, 0}) {
+            printf("process: test-process-graph: fan-in failed: %s\n", line.c_str());
+            exit(1);
+        }
+    }
+#endif
+}
+
+void test_drain_loop() {
+#ifndef MOZART_PLATFORM_WIN32
+    auto sh = [](const char *script) {
+        return process_builder().command(SHELL)
+            .arguments(std::vector<std::string>{"-c", script})
+            .start();
+    };
+
+    mpp::chunk_pool pool(16);
+    std::size_t bytes[2] = {0, 0};
+    std::string pings;
+    std::chrono::steady_clock::time_point ended[2];
+    auto begin = std::chrono::steady_clock::now();
+
+    mpp::drain_loop loop(pool, [&](std::size_t child, int stream, mpp::chunk_ref chunk) {
+        if (!chunk) {
+            if (stream == 1) {
+                ended[child] = std::chrono::steady_clock::now();
+            }
+            return;
+        }
+        bytes[child] += chunk.size();
+        if (child == 1) {
+            pings.append(chunk.data(), chunk.size());
+        }
+    });
+
+    // a flood held to 500 KB/s, and a child that must not wait behind it
+    process flood = sh("head -c 300000 /dev/zero");
+    process ping = sh("for i in 1 2 3 4 5; do echo ping; sleep 0.05; done");
+
+    mpp::drain_options low;
+    low._priority = mpp::drain_priority::low;
+    low._rate = 500000;
+    low._burst = 65536;
+    mpp::drain_options high;
+    high._priority = mpp::drain_priority::high;
+
+    loop.add(flood, low);
+    loop.add(ping, high);
+    loop.run();
+    flood.wait_for();
+    ping.wait_for();
+
+    double flood_s = std::chrono::duration<double>(ended[0] - begin).count();
+    if (bytes[0] != 300000 || pings != "ping\nping\nping\nping\nping\n"
+        || flood_s < 0.4 || ended[1] > ended[0]) {
+        printf("process: test-drain-loop: failed, %zu bytes in %.3fs\n", bytes[0], flood_s);
+        exit(1);
+    }
+
+    // reading the pipes would bypass the filter, or skip what out() buffered
+    process filtered = process_builder().command(SHELL)
+        .arguments(std::vector<std::string>{"-c", "echo one; echo two"})
+        .filter_stdout(mpp::line_filter::contains({"two"}))
+        .start();
+    process started = sh("echo one; echo two");
+    // both lines are in the pipe, one read takes them into out()
+    started.wait_for();
+    std::string line;
+    std::getline(started.out(), line);
+    for (process *p : {&filtered, &started}) {
+        try {
+            loop.add(*p);
+            printf("process: test-drain-loop: bypassing stream accepted\n");
+            exit(1);
+        } catch (const mpp::runtime_error &) {
+            // expected
+        }
+        p->wait_for();
+    }
+#endif
+}
+
+void test_shared_input() {
+#ifdef MOZART_PLATFORM_LINUX
+    std::string data;
+    for (int i = 0; i < 100000; ++i) {
+        data += "line " + std::to_string(i) + "\n";
+    }
+    auto input = mpp::sealed_input::from_buffer(data.data(), data.size());
+    if (input->size() != data.size() || write(input->fd(), "x", 1) != -1) {
+        printf("process: test-shared-input: sealing failed\n");
+        exit(1);
+    }
+
+    // every child reads all of it from an offset of its own
+    auto start = [&input](const char *script, mpp::shared_input_mode mode) {
+        return process_builder().command(SHELL)
+            .arguments(std::vector<std::string>{"-c", script})
+            .shared_input(input, mode)
+            .start();
+    };
+    std::vector<std::string> sums;
+    for (int i = 0; i < 3; ++i) {
+        process p = start("cksum", mpp::shared_input_mode::standard_input);
+        process q = start("cksum < /proc/self/fd/$MPP_SHARED_INPUT_FD",
+                          mpp::shared_input_mode::extra_descriptor);
+        std::string s;
+        std::getline(p.out(), s);
+        sums.push_back(s);
+        std::getline(q.out(), s);
+        sums.push_back(s);
+        p.wait_for();
+        q.wait_for();
+    }
+
+    std::string expected_size = " " + std::to_string(data.size());
+    for (const auto &s : sums) {
+        if (s != sums[0] || s.size() < expected_size.size()
+            || s.compare(s.size() - expected_size.size(), expected_size.size(), expected_size) != 0) {
+            printf("process: test-shared-input: got '%s'\n", s.c_str());
+            exit(1);
+        }
+    }
+#endif
+}
+
+void test_destroy_policy() {
+#ifndef MOZART_PLATFORM_WIN32
+    // a zombie still answers kill(pid, 0), only a reaped child is gone
+    auto gone_within = [](const std::vector<mpp::fd_type> &pids, int ms) {
+        for (int waited = 0; waited < ms; waited += 10) {
+            bool all = true;
+            for (mpp::fd_type pid : pids) {
+                all = all && kill(pid, 0) == -1 && errno == ESRCH;
+            }
+            if (all) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    };
+
+    process w = process::exec("/bin/sh", {"-c", "exit 3"});
+    mpp::fd_type waited = w.pid();
+    if (w.wait_for() != 3 || waitpid(waited, nullptr, WNOHANG) != -1 || errno != ECHILD
+        || !w.has_exited() || w.wait_for() != 3) {
+        printf("process: test-destroy-policy: wait_for did not reap\n");
+        exit(1);
+    }
+
+    std::vector<mpp::fd_type> reaped;
+    for (int i = 0; i < 20; ++i) {
+        process p = process::exec("/bin/sh", {"-c", "exit 0"});
+        reaped.push_back(p.pid());
+    }
+    if (!gone_within(reaped, 5000)) {
+        printf("process: test-destroy-policy: dropped children left zombies\n");
+        exit(1);
+    }
+
+    std::vector<mpp::fd_type> killed;
+    auto begin = std::chrono::steady_clock::now();
+    {
+        process p = process_builder().command("/bin/sh")
+            .arguments(std::vector<std::string>{"-c", "sleep 100"})
+            .on_destroy(mpp::destroy_policy::kill_and_reap)
+            .start();
+        killed.push_back(p.pid());
+    }
+    if (std::chrono::steady_clock::now() - begin > std::chrono::seconds(2)
+        || !gone_within(killed, 5000)) {
+        printf("process: test-destroy-policy: kill-and-reap failed\n");
+        exit(1);
+    }
+
+    mpp::fd_type abandoned = 0;
+    {
+        process p = process::exec("/bin/sh", {"-c", "exit 5"});
+        p.on_destroy(mpp::destroy_policy::abandon);
+        abandoned = p.pid();
+    }
+    int status = 0;
+    if (waitpid(abandoned, &status, 0) != abandoned || WEXITSTATUS(status) != 5) {
+        printf("process: test-destroy-policy: abandoned child was reaped\n");
+        exit(1);
+    }
+#endif
+}
+
+void test_jobserver() {
+#ifndef MOZART_PLATFORM_WIN32
+    auto js = mpp::jobserver::create(2);
+    if (js->makeflags().find("-j2 --jobserver-auth=") != 0) {
+        printf("process: test-jobserver: makeflags %s\n", js->makeflags().c_str());
+        exit(1);
+    }
+
+    // the child holds the implicit slot, leaving one in the pipe
+    process p = process_builder().command(SHELL)
+        .arguments(std::vector<std::string>{"-c",
+            "read go; auth=${MAKEFLAGS##*--jobserver-auth=}; r=${auth%%,*}; w=${auth##*,}; "
+            "t=$(dd bs=1 count=1 2>/dev/null <&$r); echo \"$t\"; printf %s \"$t\" >&$w"})
+        .environment("MAKEFLAGS", "k")
+        .use_jobserver(js)
+        .start();
+    {
+        mpp::jobserver_token t = js->acquire(std::chrono::milliseconds(0));
+        if (!t || js->acquire(std::chrono::milliseconds(0))) {
+            printf("process: test-jobserver: slots not counted\n");
+            exit(1);
+        }
+    }
+
+    // the token we gave back is read by the child, and returned
+    p.in() << "go" << std::endl;
+    std::string token;
+    std::getline(p.out(), token);
+    p.wait_for();
+    mpp::jobserver_token a = js->acquire(std::chrono::milliseconds(0));
+    mpp::jobserver_token b = js->acquire(std::chrono::milliseconds(1000));
+    if (token != "+" || !a || !b) {
+        printf("process: test-jobserver: token '%s'\n", token.c_str());
+        exit(1);
+    }
+
+    // a waiter is woken up when the implicit slot comes back
+    std::thread releaser([&a]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        a.release();
+    });
+    mpp::jobserver_token c = js->acquire(std::chrono::milliseconds(5000));
+    releaser.join();
+    if (!c) {
+        printf("process: test-jobserver: waiter not woken up\n");
+        exit(1);
+    }
+
+    // the user's MAKEFLAGS come first, a fifo is found by path
+    auto fifo = mpp::jobserver::create(3, mpp::jobserver::style::fifo);
+    process q = process_builder().command(SHELL)
+        .arguments(std::vector<std::string>{"-c",
+            "echo \"$MAKEFLAGS\"; f=${MAKEFLAGS##*fifo:}; dd bs=1 count=1 if=$f 2>/dev/null; echo"})
+        .environment("MAKEFLAGS", "k")
+        .use_jobserver(fifo)
+        .start();
+    std::string flags;
+    std::getline(q.out(), flags);
+    std::getline(q.out(), token);
+    q.wait_for();
+    if (flags != "k " + fifo->makeflags() || token != "+") {
+        printf("process: test-jobserver: fifo flags '%s', token '%s'\n", flags.c_str(), token.c_str());
+        exit(1);
+    }
+
+    // a dropped handle keeps its slot until the child is reaped
+    auto single = mpp::jobserver::create(1);
+    process_builder().command(SHELL)
+        .arguments(std::vector<std::string>{"-c", "sleep 0.3"})
+        .use_jobserver(single)
+        .start();
+    {
+        bool held = !single->acquire(std::chrono::milliseconds(100));
+        mpp::jobserver_token back = single->acquire(std::chrono::milliseconds(5000));
+        if (!held || !back) {
+            printf("process: test-jobserver: slot of a dropped handle %s\n", held ? "never came back" : "freed early");
+            exit(1);
+        }
+    }
+
+    // even if the handle was suspended when dropped
+    {
+        process p = process_builder().command("sleep")
+            .arguments(std::vector<std::string>{"0.1"})
+            .use_jobserver(single)
+            .start();
+        p.suspend();
+    }
+    if (!single->acquire(std::chrono::milliseconds(5000))) {
+        printf("process: test-jobserver: slot of a suspended dropped handle never came back\n");
+        exit(1);
+    }
+
+    std::string auth;
+    std::size_t slots = 0;
+    if (!mpp_impl::parse_makeflags("k -j8 --jobserver-fds=3,4 --jobserver-auth=fifo:/tmp/x", auth, slots)
+        || auth != "fifo:/tmp/x" || slots != 8) {
+        printf("process: test-jobserver: parsing failed\n");
+        exit(1);
+    }
+#endif
+}
+
+void test_script_exec() {
+#ifndef MOZART_PLATFORM_WIN32
+    char dir[] = "/tmp/mpp-exec-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        printf("process: test-script-exec: mkdtemp failed\n");
+        exit(1);
+    }
+    std::string script = std::string(dir) + "/script";
+    auto write_script = [&script](const char *text) {
+        FILE *fp = fopen(script.c_str(), "w");
+        fputs(text, fp);
+        fclose(fp);
+        chmod(script.c_str(), 0755);
+    };
+    auto run = [](process_builder builder) {
+        process p = builder.arguments(std::vector<std::string>{"x"}).start();
+        std::string s;
+        std::getline(p.out(), s);
+        p.wait_for();
+        return s;
+    };
+
+    // no shebang: run by /bin/sh once the kernel refused it, then directly,
+    // also when found relative to the cwd of the child
+    write_script("echo plain $1\n");
+    std::string absolute = run(process_builder().command(script));
+    std::string again = run(process_builder().command(script));
+    std::string relative = run(process_builder().command("./script").directory(dir));
+
+    // a replaced file is classified again
+    write_script("#!/bin/sh\necho shebang $1\n");
+    std::string replaced = run(process_builder().command(script));
+    if (absolute != "plain x" || again != "plain x" || relative != "plain x" || replaced != "shebang x") {
+        printf("process: test-script-exec: got '%s', '%s', '%s', '%s'\n",
+               absolute.c_str(), again.c_str(), relative.c_str(), replaced.c_str());
+        exit(1);
+    }
+
+    unlink(script.c_str());
+    rmdir(dir);
+#endif
+}
+
+void test_exit_fd() {
+#ifndef MOZART_PLATFORM_WIN32
+    process p = process_builder().command("/bin/sh")
+        .arguments(std::vector<std::string>{"-c", "echo hello; sleep 0.2; exit 3"})
+        .start();
+    if (p.try_reap()) {
+        printf("process: test-exit-fd: reaped a running child\n");
+        exit(1);
+    }
+
+    mpp::fd_type exit_fd = p.exit_fd();
+    if (exit_fd == mpp::FD_INVALID) {
+        // no pidfd in this kernel
+        p.wait_for();
+        return;
+    }
+
+    // one loop for output and exit, like an epoll loop would
+    std::string output;
+    bool exited = false;
+    bool eof = false;
+    while (!exited || !eof) {
+        pollfd fds[2] = {{exit_fd, POLLIN, 0}, {eof ? -1 : p.stdout_fd(), POLLIN, 0}};
+        if (poll(fds, 2, 5000) <= 0) {
+            printf("process: test-exit-fd: poll timed out\n");
+            exit(1);
+        }
+        if (fds[1].revents != 0) {
+            char buf[256];
+            mpp::ssize_t n = mpp_impl::read_some(p.stdout_fd(), buf, sizeof(buf));
+            eof = n <= 0;
+            output.append(buf, n > 0 ? n : 0);
+        }
+        if (fds[0].revents != 0) {
+            exited = p.try_reap();
+            if (!exited) {
+                printf("process: test-exit-fd: try_reap() failed after exit\n");
+                exit(1);
+            }
+        }
+    }
+
+    if (output != "hello\n" || p.wait_for() != 3 || !p.try_reap()) {
+        printf("process: test-exit-fd: got '%s'\n", output.c_str());
+        exit(1);
+    }
+#endif
+}
+
 int main(int argc, const char **argv) {
     test_basic();
     test_execvpe_unix();
@@ -171,5 +1314,27 @@ int main(int argc, const char **argv) {
     test_env();
     test_r_file();
     test_exit_code();
+    test_stdio_policy();
+    test_pmr();
+    test_spawn_trace();
+    test_suspend();
+    test_pressure_shed();
+    test_wait_ready();
+    test_line_filter();
+    test_startup_record();
+    test_exit_accounting();
+    test_detach();
+    test_simulated_backend();
+    test_process_graph();
+    test_drain_loop();
+    test_shared_input();
+    test_destroy_policy();
+    test_jobserver();
+    test_script_exec();
+    test_exit_fd();
+
+    std::string self(argv[0]);
+    auto slash = self.find_last_of("/\\");
+    test_stdio_replay(slash == std::string::npos ? "." : self.substr(0, slash));
     return 0;
 }
@@ -0,0 +1,457 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/process>
+#include <mozart++/startup_record>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef MOZART_PLATFORM_WIN32
+#include <unistd.h>
+#endif
+
+#ifdef MOZART_PLATFORM_DARWIN
+#include <crt_externs.h>
+#define environ (*_NSGetEnviron())
+#elif !defined(MOZART_PLATFORM_WIN32)
+extern char **environ;
+#endif
+
+#ifdef MOZART_PLATFORM_LINUX
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/**
+ * Runs a command many times and reports the distribution of its wall
+ * time, its resource usage and, where the kernel allows, its hardware
+ * counters.
+ *
+ * The command is started without a shell, from an exec image built
+ * once and with the executable looked up once, so a run costs one
+ * fork and exec on top of the command itself. Streams go to the null
+ * device unless --show-output is given, no pipe is created.
+ *
+ * usage: mpp-bench-cmd [options] [--] <command> [args...]
+ *      --runs N          measured runs (default: 10)
+ *      --warmup N        runs before measuring, discarded (default: 1)
+ *      --jobs N          runs at the same time (default: 1)
+ *      --cpus A,B,...    pin runner i and its children to the i-th CPU
+ *                        of the list, round robin, Linux only
+ *      --show-output     let the command write to our stdout and stderr
+ *      --ignore-failure  a non-zero exit code is not a failure
+ *      --json            print JSON instead of text
+ *
+ * Hardware counters count user space only, inherited by the children
+ * of each runner thread. They include the few thousand instructions
+ * start() spends in the runner itself.
+ */
+
+using bench_clock = std::chrono::steady_clock;
+
+struct run_result {
+    double _wall_us = 0;
+    int _exit_code = 0;
+    bool _failed = false;
+    bool _has_usage = false;
+    mpp::resource_usage _usage;
+    bool _has_perf = false;
+    std::uint64_t _cycles = 0;
+    std::uint64_t _instructions = 0;
+};
+
+/**
+ * Cycles and instructions of the calling thread and of the
+ * children it starts afterwards, which add theirs when they exit.
+ */
+class perf_counters {
+private:
+    int _cycles = -1;
+    int _instructions = -1;
+
+#ifdef MOZART_PLATFORM_LINUX
+
+    static int open_counter(std::uint64_t config) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.inherit = 1;
+        // allowed with the default perf_event_paranoid
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    static std::uint64_t read_counter(int fd) {
+        std::uint64_t value = 0;
+        return ::read(fd, &value, sizeof(value)) == sizeof(value) ? value : 0;
+    }
+
+#endif
+
+public:
+    perf_counters() {
+#ifdef MOZART_PLATFORM_LINUX
+        _cycles = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+        _instructions = open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+        if (_cycles < 0 || _instructions < 0) {
+            close_all();
+        }
+#endif
+    }
+
+    ~perf_counters() {
+        close_all();
+    }
+
+    perf_counters(const perf_counters &) = delete;
+
+    perf_counters &operator=(const perf_counters &) = delete;
+
+    void close_all() {
+#ifdef MOZART_PLATFORM_LINUX
+        if (_cycles >= 0) {
+            close(_cycles);
+        }
+        if (_instructions >= 0) {
+            close(_instructions);
+        }
+#endif
+        _cycles = _instructions = -1;
+    }
+
+    bool available() const {
+        return _cycles >= 0;
+    }
+
+    void read(std::uint64_t &cycles, std::uint64_t &instructions) const {
+#ifdef MOZART_PLATFORM_LINUX
+        if (available()) {
+            cycles = read_counter(_cycles);
+            instructions = read_counter(_instructions);
+        }
+#endif
+    }
+};
+
+/**
+ * Where execvpe() would find the command, so that children exec it
+ * directly instead of trying every directory of PATH.
+ */
+static std::string find_command(const std::string &command) {
+#ifndef MOZART_PLATFORM_WIN32
+    if (command.find('/') != std::string::npos) {
+        return command;
+    }
+    const char *path = getenv("PATH");
+    std::string dirs = path != nullptr ? path : "/bin:/usr/bin";
+    for (std::size_t begin = 0; begin <= dirs.size();) {
+        std::size_t end = dirs.find(':', begin);
+        if (end == std::string::npos) {
+            end = dirs.size();
+        }
+        std::string dir = dirs.substr(begin, end - begin);
+        std::string file = (dir.empty() ? "." : dir) + "/" + command;
+        if (access(file.c_str(), X_OK) == 0) {
+            return file;
+        }
+        begin = end + 1;
+    }
+#endif
+    return command;
+}
+
+static bool pin_to_cpu(int cpu) {
+#ifdef MOZART_PLATFORM_LINUX
+    // the calling thread only, children inherit it
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+template <typename Stream>
+static void run_one(mpp::process_builder &builder, const perf_counters &perf, run_result &r) {
+    std::uint64_t cycles = 0;
+    std::uint64_t instructions = 0;
+    perf.read(cycles, instructions);
+
+    auto begin = bench_clock::now();
+    auto p = builder.start<mpp::stdio_null, Stream, Stream>();
+    r._exit_code = p.wait_for();
+    r._wall_us = std::chrono::duration<double, std::micro>(bench_clock::now() - begin).count();
+
+    if (perf.available()) {
+        std::uint64_t c = 0;
+        std::uint64_t i = 0;
+        perf.read(c, i);
+        r._has_perf = true;
+        r._cycles = c - cycles;
+        r._instructions = i - instructions;
+    }
+    r._has_usage = p.accounting()._has_usage;
+    r._usage = p.accounting()._usage;
+}
+
+struct summary {
+    double _mean = 0;
+    double _stddev = 0;
+    double _min = 0;
+    double _p50 = 0;
+    double _p90 = 0;
+    double _p99 = 0;
+    double _max = 0;
+};
+
+static summary summarize(std::vector<double> v) {
+    summary s;
+    if (v.empty()) {
+        return s;
+    }
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (double x : v) {
+        sum += x;
+    }
+    s._mean = sum / v.size();
+    double sq = 0;
+    for (double x : v) {
+        sq += (x - s._mean) * (x - s._mean);
+    }
+    s._stddev = v.size() > 1 ? std::sqrt(sq / (v.size() - 1)) : 0;
+    auto at = [&v](double p) {
+        return v[std::min(v.size() - 1, static_cast<std::size_t>(p * (v.size() - 1) + 0.5))];
+    };
+    s._min = v.front();
+    s._p50 = at(0.5);
+    s._p90 = at(0.9);
+    s._p99 = at(0.99);
+    s._max = v.back();
+    return s;
+}
+
+static void print_text(const char *name, const char *unit, const summary &s) {
+    printf("%-14s mean %.3f %s +- %.3f  min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+           name, s._mean, unit, s._stddev, s._min, s._p50, s._p90, s._p99, s._max);
+}
+
+static void print_json(const char *name, const summary &s, bool last = false) {
+    printf("  \"%s\": {\"mean\": %.3f, \"stddev\": %.3f, \"min\": %.3f, \"p50\": %.3f, "
+           "\"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+           name, s._mean, s._stddev, s._min, s._p50, s._p90, s._p99, s._max, last ? "" : ",");
+}
+
+int main(int argc, const char **argv) {
+    int runs = 10;
+    int warmup = 1;
+    int jobs = 1;
+    std::vector<int> cpus;
+    bool show_output = false;
+    bool ignore_failure = false;
+    bool json = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "--") == 0) {
+            ++i;
+            break;
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+            std::string list = argv[++i];
+            for (std::size_t pos = 0; pos < list.size();) {
+                std::size_t comma = list.find(',', pos);
+                if (comma == std::string::npos) {
+                    comma = list.size();
+                }
+                cpus.push_back(atoi(list.substr(pos, comma - pos).c_str()));
+                pos = comma + 1;
+            }
+        } else if (strcmp(argv[i], "--show-output") == 0) {
+            show_output = true;
+        } else if (strcmp(argv[i], "--ignore-failure") == 0) {
+            ignore_failure = true;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else {
+            fprintf(stderr, "mpp-bench-cmd: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: mpp-bench-cmd [--runs N] [--warmup N] [--jobs N] [--cpus A,B,...]\n"
+                        "                     [--show-output] [--ignore-failure] [--json]\n"
+                        "                     [--] <command> [args...]\n");
+        return 1;
+    }
+
+    // the whole startup is encoded once, every run starts from the same image
+    std::string buffer;
+    mpp::startup_record record;
+    mpp::process_builder builder;
+    {
+        mpp::process_builder prototype;
+        prototype.command(find_command(argv[i]));
+        prototype.arguments(std::vector<std::string>(argv + i + 1, argv + argc));
+#ifndef MOZART_PLATFORM_WIN32
+        for (char **env = environ; *env != nullptr; ++env) {
+            const char *eq = strchr(*env, '=');
+            if (eq != nullptr) {
+                prototype.environment(std::string(*env, static_cast<std::size_t>(eq - *env)), eq + 1);
+            }
+        }
+#endif
+        prototype.save(buffer);
+        record.parse(buffer.data(), buffer.size());
+        builder.load(record);
+    }
+
+    std::size_t total = static_cast<std::size_t>(warmup + runs);
+    std::vector<run_result> results(total);
+    std::atomic<std::size_t> next{0};
+    std::atomic<bool> perf_ok{true};
+    std::mutex error_lock;
+    std::string first_error;
+
+    std::vector<std::thread> runners;
+    for (int t = 0; t < jobs; ++t) {
+        runners.emplace_back([&, t]() {
+            if (!cpus.empty() && !pin_to_cpu(cpus[t % cpus.size()])) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (first_error.empty()) {
+                    first_error = "cannot pin to CPU " + std::to_string(cpus[t % cpus.size()]);
+                }
+            }
+            // a builder per runner, starting does not modify it but
+            // nothing promises it is safe to share
+            mpp::process_builder local = builder;
+            perf_counters perf;
+            if (!perf.available()) {
+                perf_ok = false;
+            }
+            for (std::size_t n = next++; n < total; n = next++) {
+                run_result &r = results[n];
+                try {
+                    if (show_output) {
+                        run_one<mpp::stdio_inherit>(local, perf, r);
+                    } else {
+                        run_one<mpp::stdio_null>(local, perf, r);
+                    }
+                    r._failed = r._exit_code != 0 && !ignore_failure;
+                } catch (const mpp::runtime_error &e) {
+                    r._failed = true;
+                    std::lock_guard<std::mutex> guard(error_lock);
+                    if (first_error.empty()) {
+                        first_error = e.what();
+                    }
+                }
+            }
+        });
+    }
+    for (auto &r : runners) {
+        r.join();
+    }
+
+    std::vector<double> wall_ms;
+    std::vector<double> user_ms;
+    std::vector<double> sys_ms;
+    std::vector<double> rss_kb;
+    std::vector<double> minor_faults;
+    std::vector<double> major_faults;
+    std::vector<double> switches;
+    std::vector<double> cycles;
+    std::vector<double> instructions;
+    std::size_t failed = 0;
+    for (std::size_t n = static_cast<std::size_t>(warmup); n < total; ++n) {
+        const run_result &r = results[n];
+        if (r._failed) {
+            ++failed;
+            continue;
+        }
+        wall_ms.push_back(r._wall_us / 1000);
+        if (r._has_usage) {
+            user_ms.push_back(r._usage._user_ns / 1e6);
+            sys_ms.push_back(r._usage._system_ns / 1e6);
+            rss_kb.push_back(static_cast<double>(r._usage._max_rss_kb));
+            minor_faults.push_back(static_cast<double>(r._usage._minor_faults));
+            major_faults.push_back(static_cast<double>(r._usage._major_faults));
+            switches.push_back(static_cast<double>(r._usage._voluntary_switches
+                                                   + r._usage._involuntary_switches));
+        }
+        if (r._has_perf && perf_ok) {
+            cycles.push_back(static_cast<double>(r._cycles));
+            instructions.push_back(static_cast<double>(r._instructions));
+        }
+    }
+
+    if (!first_error.empty()) {
+        fprintf(stderr, "mpp-bench-cmd: %s\n", first_error.c_str());
+    }
+
+    if (json) {
+        printf("{\n");
+        printf("  \"runs\": %d,\n", runs);
+        printf("  \"warmup\": %d,\n", warmup);
+        printf("  \"jobs\": %d,\n", jobs);
+        printf("  \"failed\": %zu,\n", failed);
+        if (!cycles.empty()) {
+            print_json("cycles", summarize(cycles));
+            print_json("instructions", summarize(instructions));
+        }
+        if (!user_ms.empty()) {
+            print_json("user_ms", summarize(user_ms));
+            print_json("sys_ms", summarize(sys_ms));
+            print_json("max_rss_kb", summarize(rss_kb));
+            print_json("minor_faults", summarize(minor_faults));
+            print_json("major_faults", summarize(major_faults));
+            print_json("context_switches", summarize(switches));
+        }
+        print_json("wall_ms", summarize(wall_ms), true);
+        printf("}\n");
+    } else {
+        printf("command:       %s\n", argv[i]);
+        printf("runs:          %d measured, %d warmup, %d jobs, %zu failed\n", runs, warmup, jobs, failed);
+        print_text("wall:", "ms", summarize(wall_ms));
+        if (!user_ms.empty()) {
+            print_text("user:", "ms", summarize(user_ms));
+            print_text("system:", "ms", summarize(sys_ms));
+            print_text("max rss:", "KiB", summarize(rss_kb));
+            print_text("minor faults:", "", summarize(minor_faults));
+            print_text("major faults:", "", summarize(major_faults));
+            print_text("ctx switches:", "", summarize(switches));
+        }
+        if (!cycles.empty()) {
+            summary c = summarize(cycles);
+            summary n = summarize(instructions);
+            print_text("cycles:", "", c);
+            print_text("instructions:", "", n);
+            printf("%-14s %.2f\n", "ipc:", c._mean > 0 ? n._mean / c._mean : 0);
+        } else {
+            printf("%-14s unavailable\n", "cycles:");
+        }
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,241 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/process_trace>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+/**
+ * Replays a spawn trace recorded by mpp::spawn_recorder against stand-in
+ * children (mpp-standin) that emit the recorded output volume and live for
+ * the recorded runtime, and reports the overhead of the library itself.
+ *
+ * usage: mpp-replay <trace> <standin> [--speed X] [--jobs N]
+ *      --speed X   replay X times faster than recorded, 0 for as fast
+ *                  as possible (default: 1, the original pace)
+ *      --jobs N    number of replay threads, bounds the concurrency
+ *                  of children (default: 16)
+ */
+
+#ifdef MOZART_PLATFORM_WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+using mpp::process;
+using mpp::process_builder;
+using mpp::spawn_record;
+using replay_clock = std::chrono::steady_clock;
+
+struct replay_result {
+    double _start_us = 0;
+    double _wait_us = 0;
+    double _late_us = 0;
+    std::uint64_t _drained = 0;
+    bool _failed = false;
+};
+
+/**
+ * Pad a list of strings to the recorded count and total size,
+ * on top of what is already there.
+ */
+static void pad_to(std::vector<std::string> &out, std::size_t count, std::size_t bytes,
+                   std::size_t used_count, std::size_t used_bytes) {
+    if (count <= used_count) {
+        return;
+    }
+    std::size_t pads = count - used_count;
+    std::size_t pad_bytes = bytes > used_bytes ? bytes - used_bytes : 0;
+    for (std::size_t i = 0; i < pads; ++i) {
+        std::size_t n = pad_bytes / pads + (i < pad_bytes % pads ? 1 : 0);
+        out.emplace_back(std::max<std::size_t>(n, 1), 'x');
+    }
+}
+
+static replay_result replay_one(const spawn_record &r, const char *standin, double speed,
+                                std::FILE *null_dev) {
+    replay_result result;
+    std::uint64_t runtime_us = speed > 0 ? static_cast<std::uint64_t>(r._runtime_us / speed) : 0;
+
+    std::vector<std::string> args{
+        "--stdout-bytes", std::to_string(r._output_bytes),
+        "--runtime-us", std::to_string(runtime_us),
+        "--exit", std::to_string(r._exit_code < 0 ? 0 : r._exit_code),
+    };
+    std::size_t used_bytes = 0;
+    for (const auto &a : args) {
+        used_bytes += a.size();
+    }
+    pad_to(args, r._argc, r._arg_bytes, args.size(), used_bytes);
+
+    process_builder builder;
+    builder.command(standin).arguments(args);
+
+    if (r._envc > 0) {
+        std::vector<std::string> envs;
+        pad_to(envs, r._envc, r._env_bytes, 0, 0);
+        for (std::size_t i = 0; i < envs.size(); ++i) {
+            std::string key = "MPP_PAD_" + std::to_string(i);
+            // "key=value" was recorded as a whole
+            std::size_t n = envs[i].size() > key.size() + 1 ? envs[i].size() - key.size() - 1 : 0;
+            builder.environment(key, std::string(n, 'x'));
+        }
+    }
+
+    // streams that were not pipes go to the null device, whether they
+    // were redirected, bound to the null device or inherited
+    const unsigned stdout_bound = mpp::SPAWN_STDOUT_REDIRECTED | mpp::SPAWN_STDOUT_NULL | mpp::SPAWN_STDOUT_INHERITED;
+    if (r._stdio & (mpp::SPAWN_STDIN_REDIRECTED | mpp::SPAWN_STDIN_NULL | mpp::SPAWN_STDIN_INHERITED)) {
+        builder.redirect_stdin(fileno(null_dev));
+    }
+    if (r._stdio & stdout_bound) {
+        builder.redirect_stdout(fileno(null_dev));
+    }
+    if (r._stdio & (mpp::SPAWN_STDERR_REDIRECTED | mpp::SPAWN_STDERR_NULL | mpp::SPAWN_STDERR_INHERITED)) {
+        builder.redirect_stderr(fileno(null_dev));
+    }
+    builder.merge_outputs((r._stdio & mpp::SPAWN_MERGE_OUTPUTS) != 0);
+
+    try {
+        auto start = replay_clock::now();
+        process p = builder.start();
+        result._start_us = std::chrono::duration<double, std::micro>(replay_clock::now() - start).count();
+
+        if (!(r._stdio & stdout_bound)) {
+            static thread_local std::vector<char> buffer(64 * 1024);
+            while (p.out().read(buffer.data(), buffer.size()) || p.out().gcount() > 0) {
+                result._drained += static_cast<std::uint64_t>(p.out().gcount());
+            }
+        }
+
+        // the stand-in is expected to exit right after its runtime
+        auto expected_exit = start + std::chrono::microseconds(runtime_us);
+        auto wait_start = std::max(replay_clock::now(), expected_exit);
+        p.wait_for();
+        result._wait_us = std::chrono::duration<double, std::micro>(replay_clock::now() - wait_start).count();
+    } catch (const mpp::runtime_error &e) {
+        fprintf(stderr, "mpp-replay: %s: %s\n", r._command.c_str(), e.what());
+        result._failed = true;
+    }
+    return result;
+}
+
+static double percentile(std::vector<double> &v, double p) {
+    if (v.empty()) {
+        return 0;
+    }
+    std::size_t idx = std::min(v.size() - 1, static_cast<std::size_t>(p * (v.size() - 1) + 0.5));
+    std::nth_element(v.begin(), v.begin() + idx, v.end());
+    return v[idx];
+}
+
+int main(int argc, const char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: mpp-replay <trace> <standin> [--speed X] [--jobs N]\n");
+        return 1;
+    }
+
+    double speed = 1.0;
+    int jobs = 16;
+    for (int i = 3; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--speed") == 0) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            jobs = std::max(1, atoi(argv[++i]));
+        }
+    }
+
+    std::vector<spawn_record> records;
+    try {
+        mpp::spawn_trace_reader reader(argv[1]);
+        spawn_record r;
+        while (reader.next(r)) {
+            records.push_back(r);
+        }
+    } catch (const mpp::runtime_error &e) {
+        fprintf(stderr, "mpp-replay: %s\n", e.what());
+        return 1;
+    }
+
+    // records are written at exit, replay them in order of start
+    std::sort(records.begin(), records.end(), [](const spawn_record &a, const spawn_record &b) {
+        return a._start_us < b._start_us;
+    });
+
+    std::FILE *null_dev = fopen(NULL_DEVICE, "r+");
+    if (null_dev == nullptr) {
+        fprintf(stderr, "mpp-replay: unable to open " NULL_DEVICE ": %s\n", strerror(errno));
+        return 1;
+    }
+    std::vector<replay_result> results(records.size());
+    std::atomic<std::size_t> next{0};
+    auto epoch = replay_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < jobs; ++t) {
+        workers.emplace_back([&]() {
+            for (std::size_t i = next++; i < records.size(); i = next++) {
+                const spawn_record &r = records[i];
+                double late_us = 0;
+                if (speed > 0) {
+                    auto due = epoch + std::chrono::microseconds(
+                        static_cast<std::uint64_t>(r._start_us / speed));
+                    std::this_thread::sleep_until(due);
+                    late_us = std::chrono::duration<double, std::micro>(replay_clock::now() - due).count();
+                }
+                results[i] = replay_one(r, argv[2], speed, null_dev);
+                results[i]._late_us = late_us;
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+
+    double wall_s = std::chrono::duration<double>(replay_clock::now() - epoch).count();
+    std::vector<double> start_us;
+    std::vector<double> wait_us;
+    std::vector<double> late_us;
+    std::uint64_t drained = 0;
+    std::size_t failed = 0;
+    for (const auto &r : results) {
+        if (r._failed) {
+            ++failed;
+            continue;
+        }
+        start_us.push_back(r._start_us);
+        wait_us.push_back(r._wait_us);
+        late_us.push_back(r._late_us);
+        drained += r._drained;
+    }
+
+    printf("records:        %zu (%zu failed)\n", records.size(), failed);
+    printf("wall time:      %.3f s\n", wall_s);
+    printf("spawn rate:     %.1f /s\n", records.size() / wall_s);
+    printf("drained:        %.2f MiB (%.1f MiB/s)\n",
+           drained / 1048576.0, drained / 1048576.0 / wall_s);
+    printf("start() us:     p50 %.1f  p99 %.1f  max %.1f\n",
+           percentile(start_us, 0.5), percentile(start_us, 0.99), percentile(start_us, 1.0));
+    printf("wait_for() us:  p50 %.1f  p99 %.1f  max %.1f\n",
+           percentile(wait_us, 0.5), percentile(wait_us, 0.99), percentile(wait_us, 1.0));
+    if (speed > 0) {
+        printf("schedule lag us: p50 %.1f  p99 %.1f  max %.1f\n",
+               percentile(late_us, 0.5), percentile(late_us, 0.99), percentile(late_us, 1.0));
+    }
+
+    fclose(null_dev);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+/**
+ * Mozart++ Template Library
+ * Licensed under MIT License
+ * Copyright (c) 2020 Covariant Institute
+ * Website: https://covariant.cn/
+ * Github:  https://github.com/covariant-institute/
+ */
+
+#include <mozart++/stdio_replay>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+
+/**
+ * A stand-in child for replayed workloads: emits the requested number of
+ * bytes, lives for the requested time and exits with the requested code.
+ * Unknown arguments are ignored, so callers can pad the command line to
+ * the size of the original one.
+ *
+ * usage: mpp-standin [--stdout-bytes N] [--stderr-bytes N]
+ *                    [--runtime-us N] [--exit N] [padding...]
+ *        mpp-standin --replay FILE [--speed X]
+ *      --replay FILE  reproduce a recording of process_builder::record_stdio()
+ *                     instead: consume the recorded stdin, write the recorded
+ *                     outputs and exit with the recorded code
+ *      --speed X      replay X times faster than recorded, 0 for as fast
+ *                     as possible (default: 1, the original pace)
+ */
+
+static void emit(std::FILE *fp, unsigned long long bytes) {
+    static char chunk[64 * 1024];
+    std::memset(chunk, 'x', sizeof(chunk));
+    while (bytes > 0) {
+        std::size_t n = bytes < sizeof(chunk) ? static_cast<std::size_t>(bytes) : sizeof(chunk);
+        if (std::fwrite(chunk, 1, n, fp) != n) {
+            // reader went away
+            return;
+        }
+        bytes -= n;
+    }
+    std::fflush(fp);
+}
+
+static void consume(std::FILE *fp, std::size_t bytes) {
+    static char chunk[64 * 1024];
+    while (bytes > 0) {
+        std::size_t n = std::fread(chunk, 1, bytes < sizeof(chunk) ? bytes : sizeof(chunk), fp);
+        if (n == 0) {
+            // writer went away
+            return;
+        }
+        bytes -= n;
+    }
+}
+
+static int replay(const char *path, double speed) {
+    auto start = std::chrono::steady_clock::now();
+    mpp::stdio_replay_reader reader(path);
+    mpp::stdio_chunk chunk;
+    int exit_code = 0;
+
+    while (reader.next(chunk)) {
+        if (speed > 0) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(
+                static_cast<long long>(chunk._time_us / speed)));
+        }
+        switch (chunk._kind) {
+            case mpp::STDIO_CHUNK_STDIN:
+                consume(stdin, chunk._data.size());
+                break;
+            case mpp::STDIO_CHUNK_STDOUT:
+            case mpp::STDIO_CHUNK_STDERR: {
+                std::FILE *fp = chunk._kind == mpp::STDIO_CHUNK_STDOUT ? stdout : stderr;
+                std::fwrite(chunk._data.data(), 1, chunk._data.size(), fp);
+                std::fflush(fp);
+                break;
+            }
+            default:
+                exit_code = chunk._exit_code;
+                break;
+        }
+    }
+    return exit_code;
+}
+
+int main(int argc, const char **argv) {
+    auto start = std::chrono::steady_clock::now();
+    unsigned long long stdout_bytes = 0;
+    unsigned long long stderr_bytes = 0;
+    unsigned long long runtime_us = 0;
+    int exit_code = 0;
+    const char *replay_path = nullptr;
+    double speed = 1;
+
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::strcmp(argv[i], "--stdout-bytes") == 0) {
+            stdout_bytes = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--stderr-bytes") == 0) {
+            stderr_bytes = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--runtime-us") == 0) {
+            runtime_us = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--exit") == 0) {
+            exit_code = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--replay") == 0) {
+            replay_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--speed") == 0) {
+            speed = std::strtod(argv[++i], nullptr);
+        }
+    }
+
+    if (replay_path != nullptr) {
+        return replay(replay_path, speed);
+    }
+
+    emit(stdout, stdout_bytes);
+    emit(stderr, stderr_bytes);
+    std::this_thread::sleep_until(start + std::chrono::microseconds(runtime_us));
+    return exit_code;
+}